@@ -0,0 +1,212 @@
+// Cost of one sample against a recorded procfs (scripts/capture_procfs.py): time, heap allocations and
+// system calls per call of collate(), the serializers and a whole tick. Fails if a process comes back
+// with a wrong name, or if a tick allocates once its buffers are warm, which the sampling loop relies on.
+#include <atomic>
+#include <chrono>
+#include <csignal>
+#include <cstdint>
+#include <cstdlib>
+#include <iomanip>
+#include <iostream>
+#include <new>
+#include <string>
+#include <sys/ptrace.h>
+#include <sys/resource.h>
+#include <sys/wait.h>
+#include <unistd.h>
+#include <vector>
+
+#include "collector.h"
+#include "log.h"
+#include "packet.h"
+#include "window.h"
+
+namespace {
+
+std::atomic<uint64_t> allocations{0};
+
+// System calls made by f() per call, counted in a traced child so that only the calls themselves are
+// seen; 0 iterations measure the cost of the start and stop markers, which is subtracted. Returns a
+// negative number where tracing is not permitted.
+template <typename F> double count_syscalls(int64_t iterations, F &&f) {
+  const auto stops = [&](int64_t count) -> int64_t {
+    const pid_t child = fork();
+    if (child < 0) {
+      return -1;
+    }
+    if (child == 0) {
+      if (ptrace(PTRACE_TRACEME, 0, nullptr, nullptr) != 0) {
+        _exit(1);
+      }
+      raise(SIGSTOP);
+      for (int64_t i = 0; i < count; ++i) {
+        f();
+      }
+      raise(SIGSTOP);
+      _exit(0);
+    }
+    int status = 0;
+    if (waitpid(child, &status, 0) != child || !WIFSTOPPED(status)) {
+      waitpid(child, &status, 0);
+      return -1;
+    }
+    ptrace(PTRACE_SETOPTIONS, child, nullptr, reinterpret_cast<void *>(PTRACE_O_TRACESYSGOOD));
+    int64_t result = 0;
+    ptrace(PTRACE_SYSCALL, child, nullptr, nullptr);
+    // Syscall stops come in entry and exit pairs until the second SIGSTOP.
+    while (waitpid(child, &status, 0) == child && WIFSTOPPED(status) && WSTOPSIG(status) == (SIGTRAP | 0x80)) {
+      ++result;
+      ptrace(PTRACE_SYSCALL, child, nullptr, nullptr);
+    }
+    ptrace(PTRACE_DETACH, child, nullptr, nullptr);
+    waitpid(child, &status, 0);
+    return WIFEXITED(status) && WEXITSTATUS(status) == 0 ? result : -1;
+  };
+  const auto base = stops(0);
+  const auto measured = stops(iterations);
+  if (base < 0 || measured < 0) {
+    return -1;
+  }
+  return static_cast<double>(measured - base) / 2 / static_cast<double>(iterations);
+}
+
+template <typename F> void measure(const char *name, int64_t iterations, F &&f) {
+  // Fills caches and buffers, twice for those that alternate between two.
+  f();
+  f();
+  const auto before = allocations.load();
+  const auto start = std::chrono::steady_clock::now();
+  for (int64_t i = 0; i < iterations; ++i) {
+    f();
+  }
+  const auto elapsed = std::chrono::steady_clock::now() - start;
+  const double ns = std::chrono::duration<double, std::nano>(elapsed).count() / static_cast<double>(iterations);
+  const double allocs = static_cast<double>(allocations.load() - before) / static_cast<double>(iterations);
+  const double syscalls = count_syscalls(std::min<int64_t>(iterations, 3), f);
+  std::cout << "  " << name << ": " << ns << " ns/op, " << allocs << " allocs/op, ";
+  if (syscalls < 0) {
+    std::cout << "syscalls/op n/a\n";
+  } else {
+    std::cout << syscalls << " syscalls/op\n";
+  }
+}
+
+// Ticks after the first few, whose buffers reach their final size, must not allocate.
+bool check_steady_state(Packet &packet, Stats &stats, const std::vector<int32_t> &pids) {
+  SampleWindow window(std::chrono::hours(1), true);
+  const auto tick = [&]() {
+    ProcessDelta delta;
+    packet.update_process_table(delta);
+    packet.collate(stats, pids);
+    window.add(stats);
+    packet.to_json(stats);
+    packet.to_delta(stats, 30);
+  };
+  for (int32_t i = 0; i < 3; ++i) {
+    tick();
+  }
+  const auto before = allocations.load();
+  for (int32_t i = 0; i < 10; ++i) {
+    tick();
+  }
+  const auto allocated = allocations.load() - before;
+  std::cout << "  steady state: " << allocated << " allocations in 10 ticks\n";
+  return allocated == 0;
+}
+
+// Every sampled process must carry the name the process table read from its own stat.
+bool check_names(Packet &packet, const Stats &stats) {
+  size_t wrong = 0;
+  const auto &table = packet.get_process_list();
+  auto entry = table.begin();
+  for (const auto &process : stats.processes) {
+    for (; entry != table.end() && entry->pid < process.pid; ++entry) {
+    }
+    if (entry == table.end() || entry->pid != process.pid || process.name != "(" + entry->name + ")") {
+      ++wrong;
+    }
+  }
+  if (wrong > 0) {
+    std::cout << "  names: " << wrong << " of " << stats.processes.size() << " processes misnamed\n";
+  }
+  return wrong == 0;
+}
+
+bool run(const char *name, const PacketOptions &options, int64_t iterations) {
+  Packet packet(options);
+  ProcessDelta delta;
+  packet.update_process_table(delta);
+  std::vector<int32_t> pids;
+  for (const auto &process : packet.get_process_list()) {
+    pids.push_back(process.pid);
+  }
+  std::cout << name << ": " << pids.size() << " processes\n";
+
+  Stats stats;
+  packet.collate(stats, pids);
+  size_t threads = 0;
+  for (const auto &process : stats.processes) {
+    threads += process.threads.size();
+  }
+  std::cout << "  " << threads << " threads, " << packet.to_json(stats).size() << " bytes of json\n";
+  if (!check_names(packet, stats)) {
+    return false;
+  }
+
+  measure("collate       ", iterations, [&]() { packet.collate(stats, pids); });
+  measure("to_json       ", iterations, [&]() { packet.to_json(stats); });
+  measure("to_binary     ", iterations, [&]() { packet.to_binary(stats); });
+  measure("to_delta      ", iterations, [&]() { packet.to_delta(stats, 30); });
+  // What the sampling thread does per tick with the default json encoding.
+  measure("tick          ", iterations, [&]() {
+    ProcessDelta tick_delta;
+    packet.update_process_table(tick_delta);
+    packet.collate(stats, pids);
+    packet.to_json(stats);
+  });
+  return check_steady_state(packet, stats, pids);
+}
+
+}  // namespace
+
+// Counts every heap allocation of the process. Kept out of line, or GCC takes the malloc() and free() inside
+// for a mismatched pair.
+__attribute__((noinline)) void *operator new(size_t size) {
+  allocations.fetch_add(1, std::memory_order_relaxed);
+  if (void *p = std::malloc(size > 0 ? size : 1)) {
+    return p;
+  }
+  throw std::bad_alloc();
+}
+__attribute__((noinline)) void operator delete(void *p) noexcept { std::free(p); }
+__attribute__((noinline)) void operator delete(void *p, size_t) noexcept { std::free(p); }
+
+int32_t main(int32_t argc, char **argv) {
+  const char *env = std::getenv("PLOTOP_BENCH_PROC");
+  const std::string root = argc > 1 ? argv[1] : env ? env : "build/bench/procfs-1000-10000";
+  const int64_t iterations = argc > 2 ? std::stoll(argv[2]) : 20;
+  Log::set_level(Log::ERROR);
+  std::cout << std::fixed << std::setprecision(1);
+
+  PacketOptions options;
+  options.proc_root = root;
+  std::cout << "procfs " << root << "\n";
+  bool steady = run("default", options, iterations);
+  parse_process_metrics("all", options.metrics);
+  options.collectors.assign(CollectorRegistry::names().begin(), CollectorRegistry::names().end());
+  options.cpu_percent = true;
+  steady = run("-m all -c all -u 1", options, iterations) && steady;
+  // Last, as the hard limit cannot be raised again: most files no longer fit the descriptor budget and are
+  // read one-shot.
+  struct rlimit limit = {768, 768};
+  if (setrlimit(RLIMIT_NOFILE, &limit) == 0) {
+    PacketOptions spill;
+    spill.proc_root = root;
+    steady = run("default, 768 descriptors", spill, iterations) && steady;
+  }
+  if (!steady) {
+    std::cerr << "A sample was misnamed or a steady-state tick allocated\n";
+    return 1;
+  }
+  return 0;
+}
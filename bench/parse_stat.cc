@@ -0,0 +1,98 @@
+// Microbenchmark of parse_stat() against the sscanf() parser it replaced.
+#include <chrono>
+#include <cstdint>
+#include <cstdio>
+#include <iostream>
+#include <string>
+#include <vector>
+
+#include "procfs.h"
+
+namespace {
+
+struct LegacyStat {
+  int32_t pid;
+  char comm[4096];
+  char state;
+  int32_t ppid, pgrp, session, tty_nr, tpgid;
+  uint32_t flags;
+  uint64_t minflt, cminflt, majflt, cmajflt, utime, stime;
+  int64_t cutime, cstime, priority, nice, num_threads, itrealvalue;
+  uint64_t starttime, vsize;
+  int64_t rss;
+  uint64_t rsslim, startcode, endcode, startstack, kstkesp, kstkeip, signal, blocked, sigignore, sigcatch, wchan,
+      nswap, cnswap;
+  int32_t exit_signal, processor;
+  uint32_t rt_priority, policy;
+  uint64_t delayacct_blkio_ticks, guest_time;
+  int64_t cguest_time;
+  uint64_t start_data, end_data, start_brk, arg_start, arg_end, env_start, env_end;
+  int32_t exit_code;
+};
+
+bool legacy_parse(const std::string &stat_str, LegacyStat &stat) {
+  std::string_view stat_view(stat_str);
+  std::string comm_str(stat_str.substr(0, stat_str.find_last_of(")") + 1));
+  if (sscanf(comm_str.c_str(), "%d %s", &stat.pid, stat.comm) != 2) {
+    return false;
+  }
+  auto other_view = stat_view.substr(stat_view.find_last_of(")") + 1);
+  other_view = other_view.substr(other_view.find_first_not_of(" \t"));
+  const auto scan_count =
+      sscanf(other_view.data(),
+             "%c %d %d %d %d %d %u %lu %lu %lu %lu %lu %lu %ld %ld %ld %ld %ld %ld %lu %lu %ld %lu %lu %lu %lu "
+             "%lu %lu %lu %lu %lu %lu %lu %lu %lu %d %u %u %u %lu %ld %lu %lu %lu %lu %lu %lu %lu %lu %d",
+             &stat.state, &stat.ppid, &stat.pgrp, &stat.session, &stat.tty_nr, &stat.tpgid, &stat.flags, &stat.minflt,
+             &stat.cminflt, &stat.majflt, &stat.cmajflt, &stat.utime, &stat.stime, &stat.cutime, &stat.cstime,
+             &stat.priority, &stat.nice, &stat.num_threads, &stat.itrealvalue, &stat.starttime, &stat.vsize,
+             &stat.rss, &stat.rsslim, &stat.startcode, &stat.endcode, &stat.startstack, &stat.kstkesp, &stat.kstkeip,
+             &stat.signal, &stat.blocked, &stat.sigignore, &stat.sigcatch, &stat.wchan, &stat.nswap, &stat.cnswap,
+             &stat.exit_signal, &stat.processor, &stat.rt_priority, &stat.policy, &stat.delayacct_blkio_ticks,
+             &stat.guest_time, &stat.cguest_time, &stat.start_data, &stat.end_data, &stat.start_brk, &stat.arg_start,
+             &stat.arg_end, &stat.env_start, &stat.env_end, &stat.exit_code);
+  return scan_count == 50;
+}
+
+template <typename F> double measure(const char *name, int64_t iterations, F &&f) {
+  uint64_t sink = 0;
+  const auto start = std::chrono::steady_clock::now();
+  for (int64_t i = 0; i < iterations; ++i) {
+    sink += f();
+  }
+  const auto elapsed = std::chrono::steady_clock::now() - start;
+  const double ns = std::chrono::duration<double, std::nano>(elapsed).count() / static_cast<double>(iterations);
+  std::cout << "  " << name << ": " << ns << " ns/op (checksum " << sink << ")\n";
+  return ns;
+}
+
+}  // namespace
+
+int32_t main(int32_t argc, char **argv) {
+  const int64_t iterations = argc > 1 ? std::stoll(argv[1]) : 1000000;
+
+  std::vector<std::string> lines;
+  ProcFile self;
+  if (self.open("/proc/self/stat") && self.read()) {
+    lines.push_back(self.content());
+  }
+  lines.push_back("4242 (Web Content (x)) S 1 4242 4242 0 -1 4194560 123456 0 12 0 987654 45678 0 0 20 0 57 0 "
+                  "1234567 3456789012 45678 18446744073709551615 1 1 0 0 0 0 0 4096 0 0 0 0 17 3 0 0 0 0 0 0 0 0 0 "
+                  "0 0 0 0");
+
+  constexpr uint64_t mask = stat_mask(kStatUtime, kStatStime, kStatPriority, kStatStarttime);
+  for (const auto &line : lines) {
+    std::cout << line.substr(0, line.rfind(')') + 1) << "\n";
+    LegacyStat legacy;
+    const double before = measure("sscanf    ", iterations, [&]() {
+      legacy_parse(line, legacy);
+      return legacy.utime + legacy.stime;
+    });
+    StatView stat;
+    const double after = measure("parse_stat", iterations, [&]() {
+      parse_stat(line, mask, stat);
+      return stat.get(kStatUtime) + stat.get(kStatStime);
+    });
+    std::cout << "  speedup: " << before / after << "x\n";
+  }
+  return 0;
+}
@@ -6,6 +6,7 @@
 #include <functional>
 #include <iostream>
 #include <list>
+#include <sstream>
 #include <string>
 #include <unordered_map>
 #include <vector>
@@ -48,7 +49,9 @@ class Cmdline {
     arg = default_value;
     arguments_[std::string(1, short_name)] =
         arguments_[name] = [&](const std::string &value) { arg = static_cast<T>(std::stod(value)); };
-    args_info_.push_back({short_name, name, description, std::to_string(default_value), false});
+    std::ostringstream default_stream;
+    default_stream << default_value;
+    args_info_.push_back({short_name, name, description, default_stream.str(), false});
   }
 
   void add_argument(char short_name, const std::string &name, std::string &arg, const std::string &default_value,
@@ -0,0 +1,122 @@
+#ifndef PLOTOP_COLLECTOR_H
+#define PLOTOP_COLLECTOR_H
+
+#include <cstdint>
+#include <memory>
+#include <string>
+#include <string_view>
+#include <vector>
+
+#include "jsonify.h"
+#include "wire.h"
+
+// One value of a collector: type "u" for a gauge, "c" for a cumulative counter that delta frames send as a
+// difference. Fractions go out in fixed point, e.g. hundredths for load averages.
+struct CollectorField {
+  const char *name;
+  const char *type;
+};
+
+// What a collector reports. The name keys its object in the stats JSON and its record in the wire schema,
+// so it must not clash with the built-in records (thread, process, exited, stats).
+struct CollectorSpec {
+  const char *name;
+  const CollectorField *fields;
+  size_t count;
+};
+
+// One collector's values in a sample, in spec field order.
+struct Collected {
+  const CollectorSpec *spec;
+  std::vector<uint64_t> values;
+};
+
+// A source of system-wide metrics sampled next to the built-in ones. Collectors only read and parse; the
+// spec drives serialization, so adding one needs no change to the stats layout or the server.
+class Collector {
+ public:
+  virtual ~Collector() {}
+
+ public:
+  // Fixed for the lifetime of the collector, in static storage.
+  virtual const CollectorSpec &spec() const = 0;
+
+  // Opens the source under the given procfs root; a collector that fails here is left out of every sample.
+  virtual bool init(const std::string &proc_root) = 0;
+
+  // Reads the current values into values, which has spec().count elements set to zero. Returns false if
+  // the source could not be read, leaving the values at zero for this sample.
+  virtual bool sample(uint64_t *values) = 0;
+};
+
+// Collectors available on this platform, by spec name.
+class CollectorRegistry {
+ public:
+  static const std::vector<std::string_view> &names();
+
+  // Returns nullptr for an unknown name.
+  static std::unique_ptr<Collector> create(std::string_view name);
+
+  // Parses a comma separated list of collector names or "all"; empty enables none.
+  static bool parse(std::string_view text, std::vector<std::string> &selected) {
+    std::vector<std::string> result;
+    while (!text.empty()) {
+      const auto comma = text.find(',');
+      const auto name = text.substr(0, comma);
+      text.remove_prefix(comma == std::string_view::npos ? text.size() : comma + 1);
+      if (name == "all") {
+        result.assign(names().begin(), names().end());
+        continue;
+      }
+      bool known = false;
+      for (const auto &candidate : names()) {
+        known = known || candidate == name;
+      }
+      if (!known) {
+        return false;
+      }
+      result.emplace_back(name);
+    }
+    selected.swap(result);
+    return true;
+  }
+};
+
+inline JsonWriter &to_jsonify(JsonWriter &jsonify, const Collected &collected) {
+  jsonify.begin_object();
+  for (size_t i = 0; i < collected.spec->count; ++i) {
+    jsonify.field(collected.spec->fields[i].name, collected.values[i]);
+  }
+  return jsonify.end_object();
+}
+
+inline WireWriter &to_wire(WireWriter &wire, const Collected &collected) {
+  for (const auto value : collected.values) {
+    wire.write(value);
+  }
+  return wire;
+}
+
+// previous comes from the same collector, so the fields line up.
+inline WireWriter &to_wire_delta(WireWriter &wire, const Collected &collected, const Collected &previous) {
+  for (size_t i = 0; i < collected.spec->count; ++i) {
+    if (collected.spec->fields[i].type[0] == 'c') {
+      wire.write_delta(collected.values[i], previous.values[i]);
+    } else {
+      wire.write(collected.values[i]);
+    }
+  }
+  return wire;
+}
+
+// Schema record of a collector: "name":[["field","type"],...]
+inline std::string &append_wire_record(std::string &schema, const CollectorSpec &spec) {
+  schema.append("\"").append(spec.name).append("\":[");
+  for (size_t i = 0; i < spec.count; ++i) {
+    schema.append(i > 0 ? ",[\"" : "[\"").append(spec.fields[i].name).append("\",\"");
+    schema.append(spec.fields[i].type).append("\"]");
+  }
+  return schema.append("]");
+}
+
+#endif  // PLOTOP_COLLECTOR_H
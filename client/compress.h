@@ -0,0 +1,91 @@
+#ifndef PLOTOP_COMPRESS_H
+#define PLOTOP_COMPRESS_H
+
+#include <cstdint>
+#include <cstring>
+#include <string>
+#include <string_view>
+#include <vector>
+
+#include "wire.h"
+
+// Streaming LZ77 compressor for the outgoing byte stream ("lz" compression). Matches may reach back into
+// earlier blocks through a 64 KiB window that the server keeps in step, so the keys, pids and tids that
+// repeat every sample shrink to a few bytes. Each block is compressed whole and ends on a frame boundary,
+// so the server can decode it on arrival and compression adds no latency.
+//
+// Block: varint raw size, then repeated varint literal count, literals, varint match length and varint
+// match distance. A match length of zero, with no distance, only follows the final literals.
+class LzCompressor {
+ public:
+  static constexpr size_t kWindow = 64 * 1024;
+
+ public:
+  LzCompressor() : table_(static_cast<size_t>(1) << kHashBits, -1) {}
+
+ public:
+  void compress(std::string_view input, std::string &out) {
+    const size_t start = buffer_.size();
+    buffer_.append(input.data(), input.size());
+    const size_t end = buffer_.size();
+    const char *data = buffer_.data();
+
+    WireWriter wire(out);
+    wire.write_unsigned(input.size());
+    size_t literal = start;
+    size_t pos = start;
+    while (pos + kMinMatch <= end) {
+      auto &slot = table_[hash_(data + pos)];
+      const int32_t candidate = slot;
+      slot = static_cast<int32_t>(pos);
+      if (candidate < 0 || pos - candidate > kWindow || std::memcmp(data + candidate, data + pos, kMinMatch) != 0) {
+        ++pos;
+        continue;
+      }
+
+      size_t length = kMinMatch;
+      while (pos + length < end && data[candidate + length] == data[pos + length]) {
+        ++length;
+      }
+      wire.write_unsigned(pos - literal);
+      out.append(data + literal, pos - literal);
+      wire.write_unsigned(length);
+      wire.write_unsigned(pos - candidate);
+      for (size_t i = pos + 1; i < pos + length && i + kMinMatch <= end; ++i) {
+        table_[hash_(data + i)] = static_cast<int32_t>(i);
+      }
+      pos += length;
+      literal = pos;
+    }
+    if (literal < end) {
+      wire.write_unsigned(end - literal);
+      out.append(data + literal, end - literal);
+      wire.write_unsigned(0);
+    }
+
+    // Keep only the window for the next block and rebase the positions that still fall inside it.
+    if (buffer_.size() > kWindow) {
+      const int32_t shift = static_cast<int32_t>(buffer_.size() - kWindow);
+      buffer_.erase(0, static_cast<size_t>(shift));
+      for (auto &position : table_) {
+        position = position >= shift ? position - shift : -1;
+      }
+    }
+  }
+
+ private:
+  static constexpr size_t kMinMatch = 4;
+  static constexpr uint32_t kHashBits = 14;
+
+  static uint32_t hash_(const char *data) {
+    uint32_t value;
+    std::memcpy(&value, data, sizeof(value));
+    return (value * 2654435761u) >> (32 - kHashBits);
+  }
+
+ private:
+  std::string buffer_;         // window followed by the block being compressed
+  std::vector<int32_t> table_;  // last position of each 4-byte hash in buffer_
+};
+
+#endif  // PLOTOP_COMPRESS_H
@@ -3,25 +3,40 @@
 
 #include <atomic>
 #include <chrono>
+#include <condition_variable>
+#include <cstdint>
 #include <functional>
+#include <mutex>
 #include <thread>
 
 #include "log.h"
 
+// Scheduling quality of the tick being run, handed to the task so it can be reported with the sample.
+struct IntervalStatistics {
+  uint64_t ticks;
+  int64_t jitter_us;  // how late this tick started against its deadline
+  uint64_t overruns;  // ticks whose task ran past the next deadline
+  uint64_t skipped;   // deadlines dropped because of overruns
+};
+
+// Runs task on absolute deadlines start + offset + k * interval, so the task's own runtime does not shift
+// the schedule. The waits are absolute (steady clock) and stop() interrupts them immediately. A task that
+// runs past one or more deadlines is counted as an overrun and the missed ticks are skipped, not replayed.
 class Interval {
  public:
-  Interval(int64_t start_offset_s, int64_t interval_s, std::function<void()> task)
-      : start_offset_ms_(start_offset_s), interval_ms_(interval_s), stop_(false), task_(task) {
-    last_time_ = std::chrono::steady_clock::now();
-    next_time_ = last_time_ + std::chrono::seconds(start_offset_s);
-    Log::debug("Interval start_offset_s: ", start_offset_s, " interval_s: ", interval_s);
+  using Task = std::function<void(const IntervalStatistics &)>;
+
+ public:
+  Interval(std::chrono::milliseconds start_offset, std::chrono::milliseconds interval, Task task)
+      : start_offset_(start_offset), interval_(interval), stop_(false), task_(task) {
+    Log::debug("Interval start_offset_ms: ", start_offset.count(), " interval_ms: ", interval.count());
     thread_ = std::thread(&Interval::run, this);
   }
 
-  Interval(int64_t interval_s, std::function<void()> task) : Interval(0, interval_s, task) {}
+  Interval(std::chrono::milliseconds interval, Task task) : Interval(std::chrono::milliseconds(0), interval, task) {}
 
   ~Interval() {
-    stop_ = true;
+    stop();
     if (thread_.joinable()) {
       thread_.join();
     }
@@ -34,29 +49,47 @@ class Interval {
     }
   }
 
-  void stop() { stop_ = true; }
+  void stop() {
+    {
+      std::lock_guard<std::mutex> lock(mutex_);
+      stop_ = true;
+    }
+    cv_.notify_all();
+  }
 
  private:
   void run() {
     try {
-      while (!stop_) {
-        now_ = std::chrono::steady_clock::now();
-        if (now_ >= next_time_) {
-          try {
-            task_();
-          } catch (const std::exception &e) {
-            Log::error("Error accurred: ", e.what());
-            return;
+      IntervalStatistics statistics = {};
+      auto deadline = std::chrono::steady_clock::now() + start_offset_;
+      while (true) {
+        {
+          std::unique_lock<std::mutex> lock(mutex_);
+          if (cv_.wait_until(lock, deadline, [this]() { return stop_.load(); })) {
+            break;
           }
-          last_time_ = now_;
-          next_time_ = last_time_ + std::chrono::seconds(interval_ms_);
         }
 
-        const auto sleep_time = next_time_ - std::chrono::steady_clock::now();
-        if (sleep_time.count() > 0) {
-          auto sleep_ms = std::chrono::duration_cast<std::chrono::milliseconds>(sleep_time).count();
-          if (sleep_ms > 100) sleep_ms = 100;
-          std::this_thread::sleep_for(std::chrono::milliseconds(sleep_ms));
+        const auto started = std::chrono::steady_clock::now();
+        statistics.ticks++;
+        statistics.jitter_us = std::chrono::duration_cast<std::chrono::microseconds>(started - deadline).count();
+        try {
+          task_(statistics);
+        } catch (const std::exception &e) {
+          Log::error("Error accurred: ", e.what());
+          return;
+        }
+
+        deadline += interval_;
+        const auto finished = std::chrono::steady_clock::now();
+        if (finished >= deadline) {
+          const auto missed = (finished - deadline) / interval_ + 1;
+          deadline += missed * interval_;
+          statistics.overruns++;
+          statistics.skipped += static_cast<uint64_t>(missed);
+          Log::debug("Interval overrun, task took ",
+                     std::chrono::duration_cast<std::chrono::milliseconds>(finished - started).count(),
+                     " ms, skipped ", missed, " ticks");
         }
       }
     } catch (const std::exception &e) {
@@ -66,15 +99,14 @@ class Interval {
   }
 
  private:
-  int64_t start_offset_ms_;
-  int64_t interval_ms_;
-  std::chrono::time_point<std::chrono::steady_clock> last_time_;
-  std::chrono::time_point<std::chrono::steady_clock> next_time_;
-  std::chrono::time_point<std::chrono::steady_clock> now_;
+  std::chrono::milliseconds start_offset_;
+  std::chrono::milliseconds interval_;
 
+  std::mutex mutex_;
+  std::condition_variable cv_;
   std::atomic<bool> stop_;
   std::thread thread_;
-  std::function<void()> task_;
+  Task task_;
 };
 
 #endif  // PLOTOP_INTERVAL_H
@@ -1,129 +1,147 @@
 #ifndef PLOTOP_JSONIFY_H
 #define PLOTOP_JSONIFY_H
 
-#include <algorithm>
-#include <memory>
+#include <charconv>
+#include <cstdint>
+#include <cstdio>
+#include <list>
 #include <string>
-#include <unordered_map>
-#include <variant>
-
-class Jsonify;
-class Jsonify {
-  enum class Type {
-    STRING,
-    LIST,
-    JSONIFY,
-  };
-
+#include <string_view>
+#include <type_traits>
+#include <vector>
+
+// Streaming JSON writer that appends straight into a caller-owned buffer. Value types are resolved at
+// compile time: integers go through std::to_chars, strings are escaped, lists and vectors become arrays
+// and any other type is written by an ADL-found to_jsonify(JsonWriter &, const T &) overload.
+class JsonWriter {
  public:
-  template <typename T> friend Jsonify &to_jsonify(Jsonify &jsonify, const T &value) {
-    jsonify = Jsonify(value);
-    return jsonify;
-  }
+  explicit JsonWriter(std::string &out) : out_(out) {}
 
  public:
-  Jsonify() : type_(Type::JSONIFY) {}
-  Jsonify(const std::string &value) : type_(Type::STRING), value_(value) {}
-  Jsonify(const char *value) : type_(Type::STRING), value_(value) {}
-  Jsonify(const char value) : type_(Type::STRING), value_(std::string(1, value)) {}
-  Jsonify(const bool value) : type_(Type::STRING), value_(value ? "true" : "false") {}
-  Jsonify(const int8_t value) : type_(Type::STRING), value_(std::to_string(value)) {}
-  Jsonify(const int32_t value) : type_(Type::STRING), value_(std::to_string(value)) {}
-  Jsonify(const int64_t value) : type_(Type::STRING), value_(std::to_string(value)) {}
-  Jsonify(const uint8_t value) : type_(Type::STRING), value_(std::to_string(value)) {}
-  Jsonify(const uint32_t value) : type_(Type::STRING), value_(std::to_string(value)) {}
-  Jsonify(const uint64_t value) : type_(Type::STRING), value_(std::to_string(value)) {}
-  Jsonify(const float value) : type_(Type::STRING), value_(std::to_string(value)) {}
-  Jsonify(const double value) : type_(Type::STRING), value_(std::to_string(value)) {}
+  JsonWriter &begin_object() {
+    separate_();
+    out_.push_back('{');
+    need_comma_ = false;
+    return *this;
+  }
 
-  template <typename T> Jsonify(const T &value) : type_(Type::JSONIFY) { to_jsonify(*this, value); }
-  template <typename T> Jsonify(const std::list<T> &list) : type_(Type::LIST) {
-    list_.clear();
-    for (const auto &value : list) {
-      list_.push_back(std::make_shared<Jsonify>(value));
-    }
+  JsonWriter &end_object() {
+    out_.push_back('}');
+    need_comma_ = true;
+    return *this;
   }
 
- public:
-  Jsonify &operator[](const std::string &key) {
-    if (jsonify_.find(key) == jsonify_.end()) {
-      jsonify_[key] = std::make_shared<Jsonify>();
-    }
-    return *jsonify_[key];
+  JsonWriter &begin_array() {
+    separate_();
+    out_.push_back('[');
+    need_comma_ = false;
+    return *this;
   }
 
-  template <typename T> Jsonify &operator=(const T &value) {
-    *this = Jsonify(value);
+  JsonWriter &end_array() {
+    out_.push_back(']');
+    need_comma_ = true;
     return *this;
   }
 
- public:
-  std::string to_string() const {
-    switch (type_) {
-    case Type::STRING:
-      return to_string_string_();
-    case Type::LIST:
-      return to_string_list_();
-    case Type::JSONIFY:
-      return to_string_jsonify_();
-    default:
-      abort();
-    }
+  JsonWriter &key(std::string_view name) {
+    separate_();
+    write_string_(name);
+    out_.push_back(':');
+    after_key_ = true;
+    return *this;
   }
 
- private:
-  bool is_number_(const std::string &value) const {
-    try {
-      std::stod(value);
-      return true;
-    } catch (...) {
-      return false;
-    }
+  template <typename T> JsonWriter &field(std::string_view name, const T &value) {
+    key(name);
+    return write(value);
   }
 
-  std::string to_string_string_() const {
-    if (is_number_(value_)) {
-      return value_;
+  template <typename T> JsonWriter &write(const T &value) {
+    if constexpr (std::is_same_v<T, bool>) {
+      separate_();
+      out_.append(value ? "true" : "false");
+      need_comma_ = true;
+    } else if constexpr (std::is_same_v<T, char>) {
+      separate_();
+      write_string_(std::string_view(&value, 1));
+      need_comma_ = true;
+    } else if constexpr (std::is_integral_v<T>) {
+      separate_();
+      char buf[24];
+      const auto result = std::to_chars(buf, buf + sizeof(buf), value);
+      out_.append(buf, result.ptr);
+      need_comma_ = true;
+    } else if constexpr (std::is_floating_point_v<T>) {
+      separate_();
+      char buf[32];
+      const auto size = std::snprintf(buf, sizeof(buf), "%.10g", static_cast<double>(value));
+      out_.append(buf, static_cast<size_t>(size));
+      need_comma_ = true;
+    } else if constexpr (std::is_convertible_v<const T &, std::string_view>) {
+      separate_();
+      write_string_(value);
+      need_comma_ = true;
+    } else {
+      to_jsonify(*this, value);
     }
+    return *this;
+  }
 
-    // replace \x00 and etc with ' '
-    std::string jsonify = value_;
-    std::replace_if(jsonify.begin(), jsonify.end(), [](const char c) { return c < 32; }, ' ');
-    // replace " with "\""
-    std::replace_if(jsonify.begin(), jsonify.end(), [](const char c) { return c == '"'; }, '\\');
+  template <typename T> JsonWriter &write(const std::list<T> &values) { return write_array_(values); }
+  template <typename T> JsonWriter &write(const std::vector<T> &values) { return write_array_(values); }
 
-    return "\"" + jsonify + "\"";
+ private:
+  template <typename C> JsonWriter &write_array_(const C &values) {
+    begin_array();
+    for (const auto &value : values) {
+      write(value);
+    }
+    return end_array();
   }
 
-  std::string to_string_list_() const {
-    std::string jsonify = "[";
-    for (const auto &value : list_) {
-      jsonify += value->to_string() + ",";
+  void separate_() {
+    if (after_key_) {
+      after_key_ = false;
+    } else if (need_comma_) {
+      out_.push_back(',');
     }
-    if (!list_.empty()) {
-      jsonify.pop_back();
-    }
-    jsonify += "]";
-    return jsonify;
   }
 
-  std::string to_string_jsonify_() const {
-    std::string jsonify = "{";
-    for (const auto &[key, value] : jsonify_) {
-      jsonify += "\"" + key + "\":" + value->to_string() + ",";
-    }
-    if (!jsonify_.empty()) {
-      jsonify.pop_back();
+  void write_string_(std::string_view value) {
+    static constexpr char hex[] = "0123456789abcdef";
+    out_.push_back('"');
+    for (const char c : value) {
+      switch (c) {
+      case '"':
+        out_.append("\\\"");
+        break;
+      case '\\':
+        out_.append("\\\\");
+        break;
+      case '\n':
+        out_.append("\\n");
+        break;
+      case '\t':
+        out_.append("\\t");
+        break;
+      default:
+        if (static_cast<unsigned char>(c) < 0x20) {
+          out_.append("\\u00");
+          out_.push_back(hex[(c >> 4) & 0xf]);
+          out_.push_back(hex[c & 0xf]);
+        } else {
+          out_.push_back(c);
+        }
+      }
     }
-    jsonify += "}";
-    return jsonify;
+    out_.push_back('"');
   }
 
  private:
-  Type type_;
-  std::string value_;
-  std::list<std::shared_ptr<Jsonify>> list_;
-  std::unordered_map<std::string, std::shared_ptr<Jsonify>> jsonify_;
+  std::string &out_;
+  bool need_comma_ = false;
+  bool after_key_ = false;
 };
 
 #endif  // PLOTOP_JSONIFY_H
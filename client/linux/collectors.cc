@@ -0,0 +1,213 @@
+#include "collector.h"
+
+#include <cstdint>
+#include <string>
+#include <string_view>
+#include <vector>
+
+#include "procfs.h"
+
+namespace {
+
+// Parses a decimal such as "12.34" into hundredths (1234); further digits are dropped.
+bool parse_hundredths(std::string_view token, uint64_t &value) {
+  const auto dot = token.find('.');
+  uint64_t whole = 0;
+  if (!parse_number(token.substr(0, dot), whole)) {
+    return false;
+  }
+  uint64_t fraction = 0;
+  if (dot != std::string_view::npos) {
+    const auto digits = token.substr(dot + 1, 2);
+    if (!parse_number(digits, fraction)) {
+      return false;
+    }
+    fraction *= digits.size() == 1 ? 10 : 1;
+  }
+  value = whole * 100 + fraction;
+  return true;
+}
+
+// Splits off the next space separated token of text.
+std::string_view next_token(std::string_view &text) {
+  const auto begin = text.find_first_not_of(' ');
+  if (begin == std::string_view::npos) {
+    text = {};
+    return {};
+  }
+  const auto end = text.find(' ', begin);
+  const auto token = text.substr(begin, end == std::string_view::npos ? end : end - begin);
+  text.remove_prefix(end == std::string_view::npos ? text.size() : end);
+  return token;
+}
+
+// /proc/pressure/{cpu,memory,io}: share of wall time in which some or all non-idle tasks were stalled on
+// the resource. Averages are in hundredths of a percent, totals in microseconds.
+class PressureCollector : public Collector {
+ public:
+  const CollectorSpec &spec() const override {
+    static constexpr CollectorField fields[] = {
+        {"cpu_some_avg10", "u"},    {"cpu_some_avg60", "u"},    {"cpu_some_avg300", "u"},
+        {"cpu_some_total", "c"},    {"cpu_full_avg10", "u"},    {"cpu_full_avg60", "u"},
+        {"cpu_full_avg300", "u"},   {"cpu_full_total", "c"},    {"memory_some_avg10", "u"},
+        {"memory_some_avg60", "u"}, {"memory_some_avg300", "u"}, {"memory_some_total", "c"},
+        {"memory_full_avg10", "u"}, {"memory_full_avg60", "u"}, {"memory_full_avg300", "u"},
+        {"memory_full_total", "c"}, {"io_some_avg10", "u"},     {"io_some_avg60", "u"},
+        {"io_some_avg300", "u"},    {"io_some_total", "c"},     {"io_full_avg10", "u"},
+        {"io_full_avg60", "u"},     {"io_full_avg300", "u"},    {"io_full_total", "c"},
+    };
+    static constexpr CollectorSpec spec = {"pressure", fields, sizeof(fields) / sizeof(fields[0])};
+    return spec;
+  }
+
+  // Fine as long as one resource is there; the others stay at zero.
+  bool init(const std::string &proc_root) override {
+    bool any = false;
+    for (size_t i = 0; i < kResources; ++i) {
+      any = files_[i].open(proc_root + "/pressure/" + kNames[i]) || any;
+    }
+    return any;
+  }
+
+  bool sample(uint64_t *values) override {
+    bool ok = true;
+    for (size_t i = 0; i < kResources; ++i) {
+      if (files_[i].is_open()) {
+        ok = (files_[i].read() && parse_(files_[i].content(), values + i * kFieldsPerResource)) && ok;
+      }
+    }
+    return ok;
+  }
+
+ private:
+  static constexpr size_t kResources = 3;
+  static constexpr size_t kFieldsPerResource = 8;
+  static constexpr const char *kNames[kResources] = {"cpu", "memory", "io"};
+
+  // "some avg10=0.00 avg60=0.00 avg300=0.00 total=0" and, on most kernels, the same for "full".
+  static bool parse_(std::string_view content, uint64_t *values) {
+    while (!content.empty()) {
+      const auto newline = content.find('\n');
+      auto line = content.substr(0, newline);
+      content.remove_prefix(newline == std::string_view::npos ? content.size() : newline + 1);
+
+      const auto kind = next_token(line);
+      uint64_t *out = kind == "some" ? values : kind == "full" ? values + 4 : nullptr;
+      if (!out) {
+        continue;
+      }
+      for (size_t i = 0; i < 4; ++i) {
+        const auto token = next_token(line);
+        const auto equals = token.find('=');
+        if (equals == std::string_view::npos) {
+          return false;
+        }
+        const auto value = token.substr(equals + 1);
+        if (!(i < 3 ? parse_hundredths(value, out[i]) : parse_number(value, out[i]))) {
+          return false;
+        }
+      }
+    }
+    return true;
+  }
+
+ private:
+  ProcFile files_[kResources];
+};
+
+// /proc/loadavg: load averages in hundredths, runnable and total scheduling entities.
+class LoadavgCollector : public Collector {
+ public:
+  const CollectorSpec &spec() const override {
+    static constexpr CollectorField fields[] = {
+        {"load1", "u"}, {"load5", "u"}, {"load15", "u"}, {"running", "u"}, {"tasks", "u"},
+    };
+    static constexpr CollectorSpec spec = {"loadavg", fields, sizeof(fields) / sizeof(fields[0])};
+    return spec;
+  }
+
+  bool init(const std::string &proc_root) override { return file_.open(proc_root + "/loadavg"); }
+
+  // "0.12 0.35 0.26 1/73 31851"
+  bool sample(uint64_t *values) override {
+    if (!file_.read()) {
+      return false;
+    }
+    std::string_view line = file_.content();
+    for (size_t i = 0; i < 3; ++i) {
+      if (!parse_hundredths(next_token(line), values[i])) {
+        return false;
+      }
+    }
+    const auto tasks = next_token(line);
+    const auto slash = tasks.find('/');
+    return slash != std::string_view::npos && parse_number(tasks.substr(0, slash), values[3]) &&
+           parse_number(tasks.substr(slash + 1), values[4]);
+  }
+
+ private:
+  ProcFile file_;
+};
+
+// Reclaim, swap and fault counters from /proc/vmstat. Counters the kernel does not have stay at zero.
+class VmstatCollector : public Collector {
+ public:
+  const CollectorSpec &spec() const override {
+    static constexpr CollectorField fields[] = {
+        {"pgpgin", "c"},         {"pgpgout", "c"},        {"pswpin", "c"},         {"pswpout", "c"},
+        {"pgfault", "c"},        {"pgmajfault", "c"},     {"pgscan_kswapd", "c"},  {"pgscan_direct", "c"},
+        {"pgsteal_kswapd", "c"}, {"pgsteal_direct", "c"}, {"oom_kill", "c"},
+    };
+    static constexpr CollectorSpec spec = {"vmstat", fields, sizeof(fields) / sizeof(fields[0])};
+    return spec;
+  }
+
+  bool init(const std::string &proc_root) override { return file_.open(proc_root + "/vmstat"); }
+
+  // "name value" lines; about 170 of them, of which only the fields above are converted.
+  bool sample(uint64_t *values) override {
+    if (!file_.read()) {
+      return false;
+    }
+    const auto &spec = this->spec();
+    std::string_view content = file_.content();
+    while (!content.empty()) {
+      const auto newline = content.find('\n');
+      const auto line = content.substr(0, newline);
+      content.remove_prefix(newline == std::string_view::npos ? content.size() : newline + 1);
+
+      const auto space = line.find(' ');
+      const auto name = line.substr(0, space);
+      for (size_t i = 0; i < spec.count; ++i) {
+        if (name == spec.fields[i].name) {
+          parse_number(line.substr(space + 1), values[i]);
+          break;
+        }
+      }
+    }
+    return true;
+  }
+
+ private:
+  ProcFile file_;
+};
+
+}  // namespace
+
+const std::vector<std::string_view> &CollectorRegistry::names() {
+  static const std::vector<std::string_view> names = {"pressure", "loadavg", "vmstat"};
+  return names;
+}
+
+std::unique_ptr<Collector> CollectorRegistry::create(std::string_view name) {
+  if (name == "pressure") {
+    return std::unique_ptr<Collector>(new PressureCollector());
+  }
+  if (name == "loadavg") {
+    return std::unique_ptr<Collector>(new LoadavgCollector());
+  }
+  if (name == "vmstat") {
+    return std::unique_ptr<Collector>(new VmstatCollector());
+  }
+  return nullptr;
+}
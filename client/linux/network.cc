@@ -1,17 +1,27 @@
 #include "network.h"
 
 #include <arpa/inet.h>
+#include <cerrno>
 #include <cstdint>
 #include <mutex>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
 #include <string>
 #include <sys/socket.h>
+#include <sys/uio.h>
 #include <unistd.h>
+#include <vector>
 
+#include "compress.h"
 #include "log.h"
+#include "wire.h"
 
 class Network::ImplNetwork {
  public:
-  ImplNetwork(const std::string &address, int32_t port) : address_(address), port_(port) { connect_(); }
+  ImplNetwork(const std::string &address, int32_t port, bool blocking)
+      : address_(address), port_(port), blocking_(blocking) {
+    connect_();
+  }
   ~ImplNetwork() {
     if (sock_ >= 0) {
       close(sock_);
@@ -20,19 +30,198 @@ class Network::ImplNetwork {
 
  public:
   void send(const std::string &data) {
+    std::string copy(data);
+    std::lock_guard<std::mutex> lock(send_mutex_);
+    write_(copy);
+    flush_();
+  }
+
+  void write(std::string &data) {
+    std::lock_guard<std::mutex> lock(send_mutex_);
+    write_(data);
+  }
+
+  bool flush() {
+    std::lock_guard<std::mutex> lock(send_mutex_);
+    return flush_();
+  }
+
+  size_t pending() const {
+    std::lock_guard<std::mutex> lock(send_mutex_);
+    return pending_;
+  }
+
+  bool blocked() const {
+    std::lock_guard<std::mutex> lock(send_mutex_);
+    return blocked_;
+  }
+
+  void set_nodelay(bool enabled) {
+    const int32_t value = enabled ? 1 : 0;
+    if (sock_ >= 0 && setsockopt(sock_, IPPROTO_TCP, TCP_NODELAY, &value, sizeof(value)) < 0) {
+      Log::error("Failed to set TCP_NODELAY ", errno);
+    }
+  }
+
+  void set_compression(bool enabled) {
+    std::lock_guard<std::mutex> lock(send_mutex_);
+    if (enabled && !compressor_) {
+      compressor_.reset(new LzCompressor());
+    } else if (!enabled) {
+      compressor_.reset();
+    }
+  }
+
+  BatchStatistics batch_statistics() const {
+    std::lock_guard<std::mutex> lock(statistics_mutex_);
+    return statistics_;
+  }
+
+  std::string recv() {
+    std::string message;
+    while (!receive_(message, 0)) {
+    }
+    return message;
+  }
+
+  bool poll(std::string &message) { return receive_(message, MSG_DONTWAIT); }
+
+  bool ready() const { return sock_ >= 0; }
+
+  bool connecting() const { return connecting_; }
+
+  bool finish_connect() {
+    int32_t error = 0;
+    socklen_t length = sizeof(error);
+    if (getsockopt(sock_, SOL_SOCKET, SO_ERROR, &error, &length) < 0) {
+      error = errno;
+    }
+    if (error != 0) {
+      Log::error("Failed to connect to ", address_, ":", port_, " ", error);
+      close(sock_);
+      sock_ = -1;
+      return false;
+    }
+    connecting_ = false;
+    Log::debug("Connected to ", address_, ":", port_);
+    return true;
+  }
+
+  int32_t fd() const { return sock_; }
+
+ private:
+  // Frames beyond this flush on their own, which keeps the iovec array well under IOV_MAX.
+  static constexpr size_t kMaxBatchFrames = 64;
+
+  void write_(std::string &data) {
+    if (count_ == batch_.size()) {
+      batch_.emplace_back();
+    }
+    batch_[count_].swap(data);
+    data.clear();
+    pending_ += batch_[count_].size();
+    batch_bytes_ += batch_[count_].size();
+    ++batch_frames_;
+    ++count_;
+    if (count_ - first_ >= kMaxBatchFrames && !blocked_) {
+      flush_();
+    }
+  }
+
+  bool flush_() {
     if (sock_ < 0) {
       Log::error("Socket not connected");
       throw std::runtime_error("Socket not connected");
     }
 
-    std::lock_guard<std::mutex> lock(send_mutex_);
-    if (::send(sock_, data.c_str(), data.size(), MSG_NOSIGNAL) < 0) {
-      Log::error("Failed to send data ", errno);
-      throw std::runtime_error("Failed to send data " + std::to_string(errno));
+    if (compressor_ && first_ == 0 && offset_ == 0 && count_ > 0 && !compressed_) {
+      compress_batch_();
     }
+
+    // sendmsg rather than writev, which cannot pass MSG_NOSIGNAL.
+    while (first_ < count_) {
+      struct iovec iov[kMaxBatchFrames];
+      size_t frames = 0;
+      for (size_t i = first_; i < count_ && frames < kMaxBatchFrames; ++i, ++frames) {
+        const size_t skip = i == first_ ? offset_ : 0;
+        iov[frames].iov_base = batch_[i].data() + skip;
+        iov[frames].iov_len = batch_[i].size() - skip;
+      }
+      struct msghdr msg = {};
+      msg.msg_iov = iov;
+      msg.msg_iovlen = frames;
+      const auto sent = ::sendmsg(sock_, &msg, MSG_NOSIGNAL);
+      if (sent < 0) {
+        if (errno == EINTR) {
+          continue;
+        }
+        if (errno == EAGAIN || errno == EWOULDBLOCK) {
+          blocked_ = true;
+          return false;
+        }
+        Log::error("Failed to send data ", errno);
+        throw std::runtime_error("Failed to send data " + std::to_string(errno));
+      }
+
+      pending_ -= static_cast<size_t>(sent);
+      {
+        std::lock_guard<std::mutex> lock(statistics_mutex_);
+        statistics_.wire_bytes += static_cast<uint64_t>(sent);
+      }
+      size_t left = static_cast<size_t>(sent);
+      while (first_ < count_) {
+        const size_t remaining = batch_[first_].size() - offset_;
+        if (left < remaining) {
+          offset_ += left;
+          break;
+        }
+        left -= remaining;
+        ++first_;
+        offset_ = 0;
+      }
+    }
+    blocked_ = false;
+    if (count_ == 0) {
+      return true;
+    }
+
+    size_t bucket = 0;
+    while (bucket + 1 < BatchStatistics::kBuckets && batch_frames_ > (static_cast<size_t>(1) << bucket)) {
+      ++bucket;
+    }
+    {
+      std::lock_guard<std::mutex> lock(statistics_mutex_);
+      statistics_.histogram[bucket]++;
+      statistics_.flushes++;
+      statistics_.frames += batch_frames_;
+      statistics_.bytes += batch_bytes_;
+    }
+    count_ = 0;
+    first_ = 0;
+    batch_bytes_ = 0;
+    batch_frames_ = 0;
+    compressed_ = false;
+    return true;
   }
 
-  std::string recv() {
+  // Replaces the batch by a single COMPRESSED frame. Frames written while it is still being sent go out
+  // uncompressed after it; the server accepts both, and neither side's window includes them.
+  void compress_batch_() {
+    plain_.clear();
+    for (size_t i = 0; i < count_; ++i) {
+      plain_.append(batch_[i]);
+    }
+    auto &frame = batch_[0];
+    frame.clear();
+    const auto start = WireWriter::begin_frame(frame, WireKind::COMPRESSED);
+    compressor_->compress(plain_, frame);
+    WireWriter::end_frame(frame, start);
+    count_ = 1;
+    pending_ = frame.size();
+    compressed_ = true;
+  }
+
+  bool receive_(std::string &message, int32_t flags) {
     if (sock_ < 0) {
       Log::error("Socket not connected");
       throw std::runtime_error("Socket not connected");
@@ -41,18 +230,24 @@ class Network::ImplNetwork {
     while (true) {
       const auto pos = read_buffer_.find('\n');
       if (pos != std::string::npos) {
-        std::string message = read_buffer_.substr(0, pos + 1);
+        message.assign(read_buffer_, 0, pos + 1);
         read_buffer_.erase(0, pos + 1);
-        return message;
+        return true;
       }
 
       char buf[4096];
-      const auto bytes = ::recv(sock_, buf, sizeof(buf), 0);
+      const auto bytes = ::recv(sock_, buf, sizeof(buf), flags);
       if (bytes == 0) {
         Log::error("Connection closed by peer");
         throw std::runtime_error("Connection closed by peer");
       }
       if (bytes < 0) {
+        if (errno == EINTR) {
+          continue;
+        }
+        if ((flags & MSG_DONTWAIT) && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+          return false;
+        }
         Log::error("Failed to receive data ", errno);
         throw std::runtime_error("Failed to receive data " + std::to_string(errno));
       }
@@ -61,12 +256,9 @@ class Network::ImplNetwork {
     }
   }
 
-  bool ready() const { return sock_ >= 0; }
-
- private:
   void connect_() {
     Log::debug("Connecting to ", address_, ":", port_);
-    sock_ = socket(AF_INET, SOCK_STREAM, 0);
+    sock_ = socket(AF_INET, SOCK_STREAM | (blocking_ ? 0 : SOCK_NONBLOCK), 0);
     if (sock_ < 0) {
       Log::error("Failed to create socket");
       return;
@@ -83,6 +275,10 @@ class Network::ImplNetwork {
     }
 
     if (connect(sock_, (struct sockaddr *)&server, sizeof(server)) < 0) {
+      if (!blocking_ && errno == EINPROGRESS) {
+        connecting_ = true;
+        return;
+      }
       close(sock_);
       sock_ = -1;
       Log::error("Failed to connect to ", address_, ":", port_);
@@ -94,14 +290,42 @@ class Network::ImplNetwork {
  private:
   std::string address_;
   int32_t port_;
+  bool blocking_;
   int32_t sock_;
+  bool connecting_ = false;
   std::string read_buffer_;
-  std::mutex send_mutex_;
+  mutable std::mutex send_mutex_;
+  std::vector<std::string> batch_;
+  size_t count_ = 0;
+  size_t first_ = 0;   // frames of the batch already sent
+  size_t offset_ = 0;  // bytes already sent of batch_[first_]
+  size_t pending_ = 0;
+  size_t batch_bytes_ = 0;
+  size_t batch_frames_ = 0;
+  bool blocked_ = false;
+  std::unique_ptr<LzCompressor> compressor_;
+  std::string plain_;
+  bool compressed_ = false;
+  // Separate from send_mutex_, which a blocking write holds, so reading the counters never waits on the socket.
+  mutable std::mutex statistics_mutex_;
+  BatchStatistics statistics_ = {};
 };
 
-Network::Network(const std::string &address, int32_t port) : impl_(new ImplNetwork(address, port)) {}
+Network::Network(const std::string &address, int32_t port, bool blocking)
+    : impl_(new ImplNetwork(address, port, blocking)) {}
 Network::~Network() {}
 
 void Network::send(const std::string &data) { impl_->send(data); }
+void Network::write(std::string &data) { impl_->write(data); }
+bool Network::flush() { return impl_->flush(); }
+size_t Network::pending() const { return impl_->pending(); }
+bool Network::blocked() const { return impl_->blocked(); }
+void Network::set_nodelay(bool enabled) { impl_->set_nodelay(enabled); }
+void Network::set_compression(bool enabled) { impl_->set_compression(enabled); }
+BatchStatistics Network::batch_statistics() const { return impl_->batch_statistics(); }
 std::string Network::recv() { return impl_->recv(); }
+bool Network::poll(std::string &message) { return impl_->poll(message); }
 bool Network::ready() const { return impl_->ready(); }
+bool Network::connecting() const { return impl_->connecting(); }
+bool Network::finish_connect() { return impl_->finish_connect(); }
+int32_t Network::fd() const { return impl_->fd(); }
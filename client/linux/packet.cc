@@ -1,15 +1,20 @@
 #include "packet.h"
 
 #include <algorithm>
-#include <dirent.h>
 
 #include <cstdint>
-#include <fstream>
 #include <list>
+#include <mutex>
 #include <string>
 #include <string_view>
+#include <sys/resource.h>
+#include <unistd.h>
+#include <vector>
 
 #include "log.h"
+#include "proc_events.h"
+#include "procfs.h"
+#include "worker_pool.h"
 
 struct StatM {
   int32_t size;
@@ -21,230 +26,222 @@ struct StatM {
   int32_t dt;
 };
 
-struct Stat {
-  int32_t pid;
-  char comm[4096];
-  char state;
-  int32_t ppid;
-  int32_t pgrp;
-  int32_t session;
-  int32_t tty_nr;
-  int32_t tpgid;
-  uint32_t flags;
-  uint64_t minflt;
-  uint64_t cminflt;
-  uint64_t majflt;
-  uint64_t cmajflt;
-  uint64_t utime;
-  uint64_t stime;
-  int64_t cutime;
-  int64_t cstime;
-  int64_t priority;
-  int64_t nice;
-  int64_t num_threads;
-  int64_t itrealvalue;
-  uint64_t starttime;
-  uint64_t vsize;
-  int64_t rss;
-  uint64_t rsslim;
-  uint64_t startcode;
-  uint64_t endcode;
-  uint64_t startstack;
-  uint64_t kstkesp;
-  uint64_t kstkeip;
-  uint64_t signal;
-  uint64_t blocked;
-  uint64_t sigignore;
-  uint64_t sigcatch;
-  uint64_t wchan;
-  uint64_t nswap;
-  uint64_t cnswap;
-  int32_t exit_signal;
-  int32_t processor;
-  uint32_t rt_priority;
-  uint32_t policy;
-  uint64_t delayacct_blkio_ticks;
-  uint64_t guest_time;
-  int64_t cguest_time;
-  uint64_t start_data;
-  uint64_t end_data;
-  uint64_t start_brk;
-  uint64_t arg_start;
-  uint64_t arg_end;
-  uint64_t env_start;
-  uint64_t env_end;
-  int32_t exit_code;
+// Columns of the cpu lines of /proc/stat, in order.
+enum CpuField : size_t {
+  kCpuUser,
+  kCpuNice,
+  kCpuSystem,
+  kCpuIdle,
+  kCpuIowait,
+  kCpuIrq,
+  kCpuSoftirq,
+  kCpuSteal,
+  kCpuGuest,
+  kCpuGuestNice,
+  kCpuFields,
 };
 
-struct CPUsage {
-  char cpu_name[32];
-  uint64_t user;
-  uint64_t nice;
-  uint64_t system;
-  uint64_t idle;
-  uint64_t iowait;
-  uint64_t irq;
-  uint64_t softirq;
-  uint64_t steal;
-  uint64_t guest;
-  uint64_t guest_nice;
+// The /proc/stat cpu lines of one sample in columns, one per CpuField, so the percentage kernel below runs
+// over contiguous arrays. Line 0 is the aggregate.
+struct CpuColumns {
+  std::vector<uint64_t> fields[kCpuFields];
+
+  size_t lines() const { return fields[0].size(); }
+
+  void clear() {
+    for (auto &field : fields) {
+      field.clear();
+    }
+  }
 };
 
 class Packet::ImplPacket {
-  static const std::string get_proc() { return "/proc"; }
-  static const std::string get_proc_cpuinfo() { return "/proc/cpuinfo"; }
-  static const std::string get_proc_stat() { return "/proc/stat"; }
-  static const std::string get_proc_meminfo() { return "/proc/meminfo"; }
-  static const std::string get_proc_pid_mem(int32_t pid) { return "/proc/" + std::to_string(pid) + "/statm"; }
-  static const std::string get_proc_pid_stat(int32_t pid) { return "/proc/" + std::to_string(pid) + "/stat"; }
-  static const std::string get_proc_pid_status(int32_t pid) { return "/proc/" + std::to_string(pid) + "/status"; }
-  static const std::string get_proc_pid_cmdline(int32_t pid) { return "/proc/" + std::to_string(pid) + "/cmdline"; }
-  static const std::string get_proc_tid(int32_t pid) { return "/proc/" + std::to_string(pid) + "/task"; }
-  static const std::string get_proc_tid_stat(int32_t pid, int32_t tid) {
-    return "/proc/" + std::to_string(pid) + "/task/" + std::to_string(tid) + "/stat";
-  }
-  static const std::string get_proc_tid_status(int32_t pid, int32_t tid) {
-    return "/proc/" + std::to_string(pid) + "/task/" + std::to_string(tid) + "/status";
-  }
+  static constexpr uint64_t kProcessStatMask = stat_mask(kStatUtime, kStatStime, kStatStarttime);
+  static constexpr uint64_t kFaultsStatMask = stat_mask(kStatMinflt, kStatMajflt);
+  static constexpr uint64_t kThreadStatMask = stat_mask(kStatUtime, kStatStime, kStatPriority);
+  // Exited processes reported per sample; the rest are summed up into one record.
+  static constexpr size_t kMaxExited = 64;
+
+  enum class ScanResult { FAILED, GONE, FOUND };
+
+  struct ProcessEntry {
+    int32_t pid;
+    uint64_t starttime;
+    std::string name;
+  };
+
+  struct TouchedPid {
+    int32_t pid;
+    uint32_t order;  // of its event
+    bool exited;
+  };
+
+  // A thread with the CPU time it used since the previous sample.
+  struct ThreadCandidate {
+    Thread thread;
+    uint64_t user;
+    uint64_t system;
+  };
+
+  // Per-pid output of a pool worker.
+  struct ProcessScan {
+    ProcEntry *entry = nullptr;
+    ScanResult result = ScanResult::FAILED;
+    Process process;
+  };
+
+  // Buffers of a pool worker, reused for every process it scans.
+  struct WorkerState {
+    explicit WorkerState(const std::string &root) : path(root) {}
+    ProcPath path;
+    std::vector<int32_t> tids;
+    std::vector<ThreadCandidate> candidates;
+  };
+
+  std::string get_proc() const { return proc_root_; }
+  std::string get_proc_cpuinfo() const { return proc_root_ + "/cpuinfo"; }
+  std::string get_proc_stat() const { return proc_root_ + "/stat"; }
+  std::string get_proc_meminfo() const { return proc_root_ + "/meminfo"; }
 
  public:
-  ImplPacket() {}
+  explicit ImplPacket(const PacketOptions &options)
+      : proc_root_(proc_root_of_(options.proc_root)),
+        metrics_(options.metrics),
+        process_stat_mask_(kProcessStatMask | (metrics_ & kMetricFaults ? kFaultsStatMask : 0)),
+        cpu_percent_(options.cpu_percent),
+        page_kb_(page_kb_of_(sysconf(_SC_PAGESIZE))),
+        thread_policies_(options.threads),
+        pool_(options.scan_threads),
+        table_path_(proc_root_) {
+    for (size_t i = 0; i < pool_.size(); ++i) {
+      workers_.emplace_back(proc_root_);
+    }
+    for (const auto &name : options.collectors) {
+      auto collector = CollectorRegistry::create(name);
+      if (!collector) {
+        Log::warning("Unknown collector ", name);
+      } else if (!collector->init(proc_root_)) {
+        Log::warning("Collector ", name, " is not available on this system");
+      } else {
+        collectors_.push_back(std::move(collector));
+      }
+    }
+    // Events come from the running kernel, which a recorded tree does not follow.
+    if (options.proc_events && proc_root_ == kProcRoot) {
+      events_.reset(new ProcEvents());
+      if (!events_->ready()) {
+        events_.reset();
+      }
+    }
+  }
   ~ImplPacket() {}
 
  public:
-  void collate(Stats &stats, const std::list<int32_t> &pids) {
-    stats.total_memory = get_total_memory_();
-    stats.free_memory = get_free_memory_();
-    stats.processes = get_processes_(pids);
-    auto summary_cpu = get_cpu_usage_();
-    for (const auto &cpu : summary_cpu) {
-      stats.cpu_user.push_back(cpu.user);
-      stats.cpu_system.push_back(cpu.system);
-      stats.cpu_idle.push_back(cpu.idle);
-      stats.cpu_iowait.push_back(cpu.iowait);
-      stats.cpu_irq.push_back(cpu.irq);
-      stats.cpu_softirq.push_back(cpu.softirq);
+  std::vector<const CollectorSpec *> collector_specs() const {
+    std::vector<const CollectorSpec *> specs;
+    for (const auto &collector : collectors_) {
+      specs.push_back(&collector->spec());
     }
+    return specs;
   }
 
- private:
-  template <typename T> T get_key_value_from_file_(const std::string &file, const std::string &key) {
-    std::ifstream ifs(file);
-    if (!ifs.is_open()) {
-      return T();
-    }
-
-    std::string line;
-    while (std::getline(ifs, line)) {
-      if (line.find(key) != std::string::npos) {
-        const auto pos = line.find_first_of("0123456789");
-        if (pos == std::string::npos) {
-          return T();
-        }
-        try {
-          return std::stoll(line.substr(pos));
-        } catch (const std::exception &) {
-          return T();
-        }
+  // Threads come with the processes they belong to, so kGroupThreads implies kGroupProcesses.
+  void collate(Stats &stats, const std::vector<int32_t> &pids, uint32_t groups) {
+    if (groups & kGroupThreads) {
+      groups |= kGroupProcesses;
+    }
+    stats.groups = groups;
+    if (groups & kGroupMemory) {
+      stats.memory = get_memory_();
+    }
+    if (groups & kGroupProcesses) {
+      get_processes_(pids, (groups & kGroupThreads) != 0, stats.processes);
+      if (events_) {
+        events_->take_exited(stats.exited, kMaxExited);
+      } else {
+        stats.exited.clear();
       }
     }
-
-    return T();
-  }
-
-  std::string get_string_from_file_(const std::string &file) const {
-    std::ifstream ifs(file);
-    if (!ifs.is_open()) {
-      return "";
+    if (groups & kGroupCollectors) {
+      stats.collected.resize(collectors_.size());
+      for (size_t i = 0; i < collectors_.size(); ++i) {
+        auto &collected = stats.collected[i];
+        collected.spec = &collectors_[i]->spec();
+        collected.values.assign(collected.spec->count, 0);
+        collectors_[i]->sample(collected.values.data());
+      }
+    }
+    if (groups & kGroupCpu) {
+      get_cpu_usage_(stats);
     }
-
-    std::string line;
-    std::getline(ifs, line);
-    return line;
   }
 
-  int64_t get_total_memory_() { return get_key_value_from_file_<int64_t>(get_proc_meminfo(), "MemTotal:"); }
-  int64_t get_free_memory_() { return get_key_value_from_file_<int64_t>(get_proc_meminfo(), "MemFree:"); }
-
-  std::list<int32_t> get_pids_() const {
-    std::list<int32_t> pids;
-    DIR *dir = opendir(get_proc().c_str());
-    if (dir == nullptr) {
-      return pids;
-    }
-
-    struct dirent *entry;
-    while ((entry = readdir(dir)) != nullptr) {
-      if (entry->d_type == DT_DIR) {
-        const std::string name = entry->d_name;
-        if (name.find_first_not_of("0123456789") == std::string::npos) {
-          try {
-            pids.push_back(std::stoi(name));
-          } catch (const std::exception &) {
-          }
-        }
-      }
+ private:
+  // One read of /proc/meminfo per sample, values in kB. Keys are compared exactly, so e.g. "Cached"
+  // does not pick up "SwapCached".
+  MemInfo get_memory_() {
+    static constexpr std::pair<std::string_view, uint64_t MemInfo::*> keys[] = {
+        {"MemTotal", &MemInfo::total},
+        {"MemFree", &MemInfo::free},
+        {"MemAvailable", &MemInfo::available},
+        {"Buffers", &MemInfo::buffers},
+        {"Cached", &MemInfo::cached},
+        {"SwapCached", &MemInfo::swap_cached},
+        {"SwapTotal", &MemInfo::swap_total},
+        {"SwapFree", &MemInfo::swap_free},
+        {"Dirty", &MemInfo::dirty},
+        {"Writeback", &MemInfo::writeback},
+        {"Shmem", &MemInfo::shmem},
+        {"Slab", &MemInfo::slab},
+        {"SReclaimable", &MemInfo::slab_reclaimable},
+    };
+
+    MemInfo memory = {};
+    if (!meminfo_file_.is_open() && !meminfo_file_.open(get_proc_meminfo())) {
+      return memory;
+    }
+    if (!meminfo_file_.read()) {
+      meminfo_file_.close();
+      return memory;
     }
 
-    closedir(dir);
-    return pids;
-  }
+    std::string_view content(meminfo_file_.content());
+    while (!content.empty()) {
+      auto end = content.find('\n');
+      const auto line = content.substr(0, end);
+      content.remove_prefix(end == std::string_view::npos ? content.size() : end + 1);
 
-  std::list<int32_t> get_tids_(int32_t pid) const {
-    std::list<int32_t> tids;
-    DIR *dir = opendir(get_proc_tid(pid).c_str());
-    if (dir == nullptr) {
-      return tids;
-    }
-
-    struct dirent *entry;
-    while ((entry = readdir(dir)) != nullptr) {
-      if (entry->d_type == DT_DIR) {
-        const std::string name = entry->d_name;
-        if (name.find_first_not_of("0123456789") == std::string::npos) {
-          try {
-            tids.push_back(std::stoi(name));
-          } catch (const std::exception &) {
-          }
+      const auto colon = line.find(':');
+      if (colon == std::string_view::npos) {
+        continue;
+      }
+      const auto key = line.substr(0, colon);
+      for (const auto &[name, member] : keys) {
+        if (key != name) {
+          continue;
         }
+        auto value = line.substr(colon + 1);
+        const auto begin = value.find_first_not_of(' ');
+        if (begin == std::string_view::npos) {
+          break;
+        }
+        value = value.substr(begin, value.find(' ', begin) - begin);
+        parse_number(value, memory.*member);
+        break;
       }
     }
-
-    closedir(dir);
-    return tids;
+    return memory;
   }
 
-  bool parse_stat_(const std::string &stat_str, Stat &stat) const {
-    std::string_view stat_view(stat_str);
-    std::string comm_str(stat_str.substr(0, stat_str.find_last_of(")") + 1));
-    const auto pid_comm_count = sscanf(comm_str.c_str(), "%d %s", &stat.pid, stat.comm);
-    if (pid_comm_count != 2) {
-      Log::error("Failed to parse ", stat_str, " expected ", 2, " got ", pid_comm_count);
-      return false;
-    }
-
-    auto other_view = stat_view.substr(stat_view.find_last_of(")") + 1);
-    other_view = other_view.substr(other_view.find_first_not_of(" \t"));
-    const auto scan_count =
-        sscanf(other_view.data(),
-               "%c %d %d %d %d %d %u %lu %lu %lu %lu %lu %lu %ld %ld %ld %ld %ld %ld %lu %lu %ld %lu %lu %lu %lu "
-               "%lu %lu %lu %lu %lu %lu %lu %lu %lu %d %u %u %u %lu %ld %lu %lu %lu %lu %lu %lu %lu %lu %d",
-               &stat.state, &stat.ppid, &stat.pgrp, &stat.session, &stat.tty_nr, &stat.tpgid, &stat.flags, &stat.minflt,
-               &stat.cminflt, &stat.majflt, &stat.cmajflt, &stat.utime, &stat.stime, &stat.cutime, &stat.cstime,
-               &stat.priority, &stat.nice, &stat.num_threads, &stat.itrealvalue, &stat.starttime, &stat.vsize,
-               &stat.rss, &stat.rsslim, &stat.startcode, &stat.endcode, &stat.startstack, &stat.kstkesp, &stat.kstkeip,
-               &stat.signal, &stat.blocked, &stat.sigignore, &stat.sigcatch, &stat.wchan, &stat.nswap, &stat.cnswap,
-               &stat.exit_signal, &stat.processor, &stat.rt_priority, &stat.policy, &stat.delayacct_blkio_ticks,
-               &stat.guest_time, &stat.cguest_time, &stat.start_data, &stat.end_data, &stat.start_brk, &stat.arg_start,
-               &stat.arg_end, &stat.env_start, &stat.env_end, &stat.exit_code);
-    if (scan_count != 50) {
-      Log::error("Failed to parse \"", other_view.data(), "\" expected ", 50, " got ", scan_count);
+  bool parse_stat_(const std::string &stat_str, uint64_t mask, StatView &stat) const {
+    if (!parse_stat(stat_str, mask, stat)) {
+      Log::error("Failed to parse ", stat_str);
       return false;
     }
     return true;
   }
 
-  bool parse_statm_(const std::string &statm_str, StatM &statm) {
+  bool parse_statm_(const std::string &statm_str, StatM &statm) const {
     const auto scan_count = sscanf(statm_str.c_str(), "%d %d %d %d %d %d %d", &statm.size, &statm.resident,
                                    &statm.shared, &statm.text, &statm.lib, &statm.data, &statm.dt);
     if (scan_count != 7) {
@@ -254,168 +251,555 @@ class Packet::ImplPacket {
     return true;
   }
 
-  bool parse_cpu_usage_(const std::string &cpu_str, CPUsage &cpu) {
-    const auto scan_count =
-        sscanf(cpu_str.c_str(), "%s %lu %lu %lu %lu %lu %lu %lu %lu %lu %lu", cpu.cpu_name, &cpu.user, &cpu.nice,
-               &cpu.system, &cpu.idle, &cpu.iowait, &cpu.irq, &cpu.softirq, &cpu.steal, &cpu.guest, &cpu.guest_nice);
-    if (scan_count != 11) {
-      Log::error("Failed to parse ", cpu_str, " expected ", 11, " got ", scan_count);
-      return false;
+  // "cpu  4705 356 584 3699 23 23 0 0 0 0", the summary line and one per core.
+  bool parse_cpu_usage_(std::string_view line, uint64_t (&cpu)[kCpuFields]) const {
+    const auto name_end = line.find(' ');
+    line.remove_prefix(name_end == std::string_view::npos ? line.size() : name_end);
+    for (auto &value : cpu) {
+      const auto begin = line.find_first_not_of(' ');
+      const auto end = line.find(' ', begin);
+      if (begin == std::string_view::npos || !parse_number(line.substr(begin, end - begin), value)) {
+        Log::error("Failed to parse cpu line, expected ", static_cast<size_t>(kCpuFields), " values");
+        return false;
+      }
+      line.remove_prefix(end == std::string_view::npos ? line.size() : end);
     }
     return true;
   }
 
-  std::list<Thread> get_threads_(int32_t pid) {
-    std::list<Thread> threads;
-    for (const auto tid : get_tids_(pid)) {
-      const std::string stat_str = get_string_from_file_(get_proc_tid_stat(pid, tid));
+  // Fills threads in place, sorted by tid, with the "other" thread of CAP (tid 0) first.
+  void get_threads_(int32_t pid, ProcEntry &entry, const ThreadPolicy &policy, WorkerState &worker,
+                    std::vector<Thread> &threads) {
+    threads.clear();
+    auto &candidates = worker.candidates;
+    candidates.clear();
+    list_ids(worker.path.tasks(pid), worker.tids);
+    std::sort(worker.tids.begin(), worker.tids.end());
+    for (const auto tid : worker.tids) {
+      auto &task = cache_.task(entry, tid);
+      const std::string &stat_str = cache_.read(task.stat, worker.path.tid(pid, tid, "stat"));
       if (stat_str.empty()) {
+        cache_.evict_task(entry, tid);
         continue;
       }
-      Stat stat;
-      if (!parse_stat_(stat_str, stat)) {
+      StatView stat;
+      if (!parse_stat_(stat_str, kThreadStatMask, stat)) {
         continue;
       }
 
       Thread thread;
       thread.tid = tid;
-      thread.priority = stat.priority;
-      thread.cpu_user = stat.utime;
-      thread.cpu_system = stat.stime;
-      threads.push_back(thread);
+      thread.priority = stat.get_signed(kStatPriority);
+      thread.cpu_user = stat.get(kStatUtime);
+      thread.cpu_system = stat.get(kStatStime);
+      // Counters of a new thread start from zero, so its first sample counts all the CPU it used so far.
+      const ThreadCandidate candidate = {thread, thread.cpu_user - std::min(task.cpu_user, thread.cpu_user),
+                                         thread.cpu_system - std::min(task.cpu_system, thread.cpu_system)};
+      task.cpu_user = thread.cpu_user;
+      task.cpu_system = thread.cpu_system;
+      if (policy.mode == ThreadPolicy::ALL) {
+        threads.push_back(thread);
+      } else if (candidate.user + candidate.system > 0 || policy.mode == ThreadPolicy::CAP) {
+        select_thread_(candidates, candidate, policy, entry);
+      }
+    }
+    cache_.sweep_tasks(entry);
+    if (policy.mode == ThreadPolicy::ALL) {
+      return;
     }
 
-    return threads;
+    if (policy.mode == ThreadPolicy::CAP && (entry.other_cpu_user > 0 || entry.other_cpu_system > 0)) {
+      threads.push_back({0, 0, entry.other_cpu_user, entry.other_cpu_system});
+    }
+    std::sort(candidates.begin(), candidates.end(),
+              [](const ThreadCandidate &a, const ThreadCandidate &b) { return a.thread.tid < b.thread.tid; });
+    for (const auto &candidate : candidates) {
+      threads.push_back(candidate.thread);
+    }
   }
-  std::list<Process> get_processes_(const std::list<int32_t> &pids) {
-    std::list<Process> processes;
-    for (const auto pid : get_pids_()) {
-      try {
-        const std::string stat_str = get_string_from_file_(get_proc_pid_stat(pid));
-        if (stat_str.empty()) {
-          continue;
-        }
 
-        Stat stat;
-        if (!parse_stat_(stat_str, stat)) {
-          continue;
+  // Keeps the policy's limit of busiest threads in a min-heap on their CPU delta; with CAP the threads pushed
+  // out, and those idle, add their delta to the process's accumulated "other" thread instead.
+  static void select_thread_(std::vector<ThreadCandidate> &heap, const ThreadCandidate &candidate,
+                             const ThreadPolicy &policy, ProcEntry &entry) {
+    const auto busier = [](const ThreadCandidate &a, const ThreadCandidate &b) {
+      return a.user + a.system > b.user + b.system;
+    };
+    if (policy.mode == ThreadPolicy::CHANGED) {
+      heap.push_back(candidate);
+      return;
+    }
+    const ThreadCandidate *dropped = &candidate;
+    ThreadCandidate evicted;
+    if (candidate.user + candidate.system > 0) {
+      if (heap.size() < policy.limit) {
+        heap.push_back(candidate);
+        std::push_heap(heap.begin(), heap.end(), busier);
+        return;
+      }
+      if (busier(candidate, heap.front())) {
+        std::pop_heap(heap.begin(), heap.end(), busier);
+        evicted = heap.back();
+        heap.back() = candidate;
+        std::push_heap(heap.begin(), heap.end(), busier);
+        dropped = &evicted;
+      }
+    }
+    if (policy.mode == ThreadPolicy::CAP) {
+      entry.other_cpu_user += dropped->user;
+      entry.other_cpu_system += dropped->system;
+    }
+  }
+  // Goes straight to /proc/<pid> for every filtered pid, so the cost of a sample depends on the
+  // number of watched processes rather than on the number of processes on the system.
+  //
+  // The cache entries are looked up here, then the pids are spread over the worker pool. Each worker fills
+  // the scan slot of the pid it took, so the results are merged afterwards in pid order without a lock. They
+  // are swapped into processes rather than moved, so the scan slots and processes keep their buffers.
+  void get_processes_(const std::vector<int32_t> &pids, bool threads, std::vector<Process> &processes) {
+    targets_.assign(pids.begin(), pids.end());
+    std::sort(targets_.begin(), targets_.end());
+    targets_.erase(std::unique(targets_.begin(), targets_.end()), targets_.end());
+
+    cache_.begin();
+    scans_.resize(targets_.size());
+    for (size_t i = 0; i < targets_.size(); ++i) {
+      scans_[i].entry = &cache_.entry(targets_[i]);
+    }
+    pool_.run(targets_.size(), [this, threads](size_t index, size_t worker) {
+      scan_process_(targets_[index], scans_[index], threads, worker);
+    });
+
+    size_t found = 0;
+    for (size_t i = 0; i < targets_.size(); ++i) {
+      auto &scan = scans_[i];
+      if (scan.result == ScanResult::FOUND) {
+        if (found == processes.size()) {
+          processes.emplace_back();
         }
+        std::swap(processes[found++], scan.process);
+      } else if (scan.result == ScanResult::GONE) {
+        cache_.evict(targets_[i]);
+      }
+    }
+    processes.resize(found);
+    cache_.sweep();
+  }
 
-        std::string name(stat.comm);
-        auto pid_match = [&](int32_t filter_pid) { return pid == filter_pid; };
-        const bool match = !pids.empty() && std::any_of(pids.begin(), pids.end(), pid_match);
-        if (!match) {
-          continue;
-        }
+  // Runs on a pool worker and touches nothing but its own scan slot and cache entry.
+  void scan_process_(int32_t pid, ProcessScan &scan, bool threads, size_t worker_index) {
+    scan.result = ScanResult::FAILED;
+    auto &worker = workers_[worker_index];
+    try {
+      auto &entry = *scan.entry;
+      const std::string &stat_str = cache_.read(entry.stat, worker.path.pid(pid, "stat"));
+      if (stat_str.empty()) {
+        scan.result = ScanResult::GONE;
+        return;
+      }
 
-        const std::string statm_str = get_string_from_file_(get_proc_pid_mem(pid));
-        if (statm_str.empty()) {
-          continue;
-        }
-        StatM statm;
-        if (!parse_statm_(statm_str, statm)) {
-          continue;
-        }
+      StatView stat;
+      if (!parse_stat_(stat_str, process_stat_mask_, stat)) {
+        return;
+      }
+      cache_.identify(entry, stat.get(kStatStarttime));
+      // stat.comm points into the buffer of the read above, which the next read may reuse once the cache is
+      // out of descriptors: take the name and the thread policy before reading anything else.
+      auto &process = scan.process;
+      process.name.clear();
+      process.name.reserve(stat.comm.size() + 2);
+      process.name.append("(").append(stat.comm).append(")");
+      const ThreadPolicy &policy = thread_policies_.get(stat.comm);
+      stat.comm = {};
+
+      const std::string &statm_str = cache_.read(entry.statm, worker.path.pid(pid, "statm"));
+      if (statm_str.empty()) {
+        scan.result = ScanResult::GONE;
+        return;
+      }
+      StatM statm;
+      if (!parse_statm_(statm_str, statm)) {
+        return;
+      }
 
-        Process process;
-        process.pid = pid;
-        process.memory = statm.resident * 4;  // resident is in pages
-        process.name = name;
-        process.cpu_user = stat.utime;
-        process.cpu_system = stat.stime;
-        process.threads = get_threads_(pid);
-        processes.push_back(process);
-      } catch (const std::exception &) {
+      process.pid = pid;
+      process.memory = static_cast<uint64_t>(statm.resident) * page_kb_;
+      process.cpu_user = stat.get(kStatUtime);
+      process.cpu_system = stat.get(kStatStime);
+      process.has_threads = threads;
+      if (threads) {
+        get_threads_(pid, entry, policy, worker, process.threads);
+      } else {
+        process.threads.clear();
       }
+      get_metrics_(pid, entry, stat, worker.path, process);
+      scan.result = ScanResult::FOUND;
+    } catch (const std::exception &) {
     }
+  }
 
-    return processes;
+  // Fills the enabled metric groups. io and smaps_rollup need ptrace access to the process, so a group that
+  // cannot be read is left at zero instead of failing the whole process.
+  void get_metrics_(int32_t pid, ProcEntry &entry, const StatView &stat, ProcPath &path, Process &process) {
+    process.metrics = metrics_;
+    if (metrics_ & kMetricFaults) {
+      process.minor_faults = stat.get(kStatMinflt);
+      process.major_faults = stat.get(kStatMajflt);
+    }
+    if (metrics_ & kMetricIo) {
+      const std::string &io = cache_.read(entry.io, path.pid(pid, "io"));
+      process.read_bytes = 0;
+      process.write_bytes = 0;
+      parse_field(io, "read_bytes", process.read_bytes);
+      parse_field(io, "write_bytes", process.write_bytes);
+    }
+    if (metrics_ & kMetricContextSwitches) {
+      const std::string &status = cache_.read(entry.status, path.pid(pid, "status"));
+      process.voluntary_switches = 0;
+      process.involuntary_switches = 0;
+      parse_field(status, "voluntary_ctxt_switches", process.voluntary_switches);
+      parse_field(status, "nonvoluntary_ctxt_switches", process.involuntary_switches);
+    }
+    if (metrics_ & kMetricSmaps) {
+      const std::string &smaps = cache_.read(entry.smaps_rollup, path.pid(pid, "smaps_rollup"));
+      process.pss = 0;
+      process.swap = 0;
+      parse_field(smaps, "Pss", process.pss);
+      parse_field(smaps, "Swap", process.swap);
+    }
   }
 
-  std::list<CPUsage> get_cpu_usage_() {
-    std::list<CPUsage> cpus;
-    std::ifstream ifs(get_proc_stat());
-    if (!ifs.is_open()) {
-      return cpus;
+  static std::string proc_root_of_(const std::string &root) {
+    if (root != kProcRoot && access((root + "/stat").c_str(), R_OK) != 0) {
+      Log::warning("No procfs at ", root, ", reading ", kProcRoot);
+      return kProcRoot;
     }
+    return root;
+  }
 
-    std::string line;
-    while (std::getline(ifs, line)) {
-      if (line.find("cpu") != std::string::npos) {
-        CPUsage cpu;
-        if (!parse_cpu_usage_(line, cpu)) {
-          continue;
+  static uint64_t page_kb_of_(long page_size) {
+    if (page_size <= 0) {
+      Log::warning("Failed to get the page size, assuming 4 kB");
+      return 4;
+    }
+    return static_cast<uint64_t>(page_size) / 1024;
+  }
+
+  // One read of /proc/stat through a descriptor kept open, like /proc/meminfo.
+  void get_cpu_usage_(Stats &stats) {
+    for (auto *values : {&stats.cpu_user, &stats.cpu_system, &stats.cpu_idle, &stats.cpu_iowait, &stats.cpu_irq,
+                         &stats.cpu_softirq}) {
+      values->clear();
+    }
+    stats.cpu_percent = cpu_percent_;
+    cpu_now_.clear();
+    if (!stat_file_.is_open() && !stat_file_.open(get_proc_stat())) {
+      return;
+    }
+    if (!stat_file_.read()) {
+      stat_file_.close();
+      return;
+    }
+
+    std::string_view content(stat_file_.content());
+    while (!content.empty()) {
+      const auto end = content.find('\n');
+      const auto line = content.substr(0, end);
+      content.remove_prefix(end == std::string_view::npos ? content.size() : end + 1);
+      // The cpu lines come first.
+      if (line.substr(0, 3) != "cpu") {
+        break;
+      }
+      uint64_t cpu[kCpuFields];
+      if (!parse_cpu_usage_(line, cpu)) {
+        continue;
+      }
+      if (cpu_percent_) {
+        for (size_t field = 0; field < kCpuFields; ++field) {
+          cpu_now_.fields[field].push_back(cpu[field]);
         }
-        cpus.push_back(cpu);
+        continue;
       }
+      stats.cpu_user.push_back(cpu[kCpuUser]);
+      stats.cpu_system.push_back(cpu[kCpuSystem]);
+      stats.cpu_idle.push_back(cpu[kCpuIdle]);
+      stats.cpu_iowait.push_back(cpu[kCpuIowait]);
+      stats.cpu_irq.push_back(cpu[kCpuIrq]);
+      stats.cpu_softirq.push_back(cpu[kCpuSoftirq]);
     }
+    if (cpu_percent_) {
+      get_cpu_percent_(stats);
+    }
+  }
 
-    return cpus;
+  // Time a counter advanced by; per-core iowait may go backwards, which counts as none.
+  static uint64_t advanced_(uint64_t now, uint64_t last) { return now > last ? now - last : 0; }
+
+  // Shares of the time each line spent in each state since the previous sample, in hundredths of a percent.
+  // The first sample, and the first after the number of cores changed, is measured from boot. The loops run
+  // over contiguous columns without branches so that the compiler can vectorize them; guest time is already
+  // part of user time and is not added again.
+  void get_cpu_percent_(Stats &stats) {
+    static constexpr CpuField kElapsed[] = {kCpuUser,   kCpuNice, kCpuSystem,  kCpuIdle,
+                                            kCpuIowait, kCpuIrq,  kCpuSoftirq, kCpuSteal};
+    static constexpr std::pair<std::vector<uint64_t> Stats::*, CpuField> kShares[] = {
+        {&Stats::cpu_user_percent, kCpuUser},     {&Stats::cpu_system_percent, kCpuSystem},
+        {&Stats::cpu_iowait_percent, kCpuIowait}, {&Stats::cpu_irq_percent, kCpuIrq},
+        {&Stats::cpu_softirq_percent, kCpuSoftirq}, {&Stats::cpu_steal_percent, kCpuSteal},
+    };
+
+    const size_t lines = cpu_now_.lines();
+    if (cpu_last_.lines() != lines) {
+      for (auto &field : cpu_last_.fields) {
+        field.assign(lines, 0);
+      }
+    }
+    // Adds what each line's counter of field advanced by to sums.
+    const auto add = [&](CpuField field, uint64_t *sums) {
+      const uint64_t *now = cpu_now_.fields[field].data();
+      const uint64_t *last = cpu_last_.fields[field].data();
+      for (size_t i = 0; i < lines; ++i) {
+        sums[i] += advanced_(now[i], last[i]);
+      }
+    };
+    cpu_elapsed_.assign(lines, 0);
+    for (const auto field : kElapsed) {
+      add(field, cpu_elapsed_.data());
+    }
+    cpu_scale_.resize(lines);
+    for (size_t i = 0; i < lines; ++i) {
+      cpu_scale_[i] = cpu_elapsed_[i] > 0 ? 10000.0 / static_cast<double>(cpu_elapsed_[i]) : 0.0;
+    }
+    for (const auto &[member, field] : kShares) {
+      auto &shares = stats.*member;
+      shares.assign(lines, 0);
+      add(field, shares.data());
+      if (field == kCpuUser) {
+        add(kCpuNice, shares.data());
+      }
+      for (size_t i = 0; i < lines; ++i) {
+        shares[i] = static_cast<uint64_t>(static_cast<double>(shares[i]) * cpu_scale_[i] + 0.5);
+      }
+    }
+    stats.cpu_elapsed = lines > 0 ? cpu_elapsed_[0] : 0;
+    std::swap(cpu_now_, cpu_last_);
   }
 
  public:
-  std::list<ProcessInfo> get_process_list_() const {
-    std::list<ProcessInfo> processes;
-    for (const auto pid : get_pids_()) {
-      try {
-        const std::string stat_str = get_string_from_file_(get_proc_pid_stat(pid));
-        if (stat_str.empty()) {
-          continue;
-        }
+  // Builds the next generation of the table and diffs it against the previous one. With proc events the
+  // table is patched with the starts, execs and exits since the last call; otherwise, after events were lost
+  // or for good once the listener stopped, /proc is rescanned. A pid whose starttime or name changed (reuse
+  // or exec) is reported as added again.
+  bool update_process_table_(ProcessDelta &delta) {
+    if (events_ && !events_->ready()) {
+      Log::warning("Proc connector stopped, rescanning /proc for every process table update");
+      events_.reset();
+    }
+    if (events_ && table_complete_ && events_->take_events(events_buffer_)) {
+      if (events_buffer_.empty()) {
+        return false;
+      }
+      apply_events_();
+    } else {
+      scan_process_table_();
+      table_complete_ = true;
+    }
 
-        Stat stat;
-        if (!parse_stat_(stat_str, stat)) {
-          continue;
+    std::lock_guard<std::mutex> lock(process_table_mutex_);
+    auto it_last = process_table_.begin();
+    for (const auto &current : next_table_) {
+      while (it_last != process_table_.end() && it_last->pid < current.pid) {
+        delta.removed.push_back(it_last->pid);
+        ++it_last;
+      }
+      if (it_last != process_table_.end() && it_last->pid == current.pid) {
+        if (it_last->starttime != current.starttime || it_last->name != current.name) {
+          delta.added.push_back({current.pid, current.name});
         }
+        ++it_last;
+      } else {
+        delta.added.push_back({current.pid, current.name});
+      }
+    }
+    for (; it_last != process_table_.end(); ++it_last) {
+      delta.removed.push_back(it_last->pid);
+    }
+    process_table_.swap(next_table_);
 
-        std::string name(stat.comm);
-        if (name.size() >= 2 && name.front() == '(' && name.back() == ')') {
-          name = name.substr(1, name.size() - 2);
-        }
+    return !delta.added.empty() || !delta.removed.empty();
+  }
 
-        processes.push_back({pid, name});
-      } catch (const std::exception &) {
+  // Entries are assigned over those of an older generation, so their names keep their buffers.
+  void scan_process_table_() {
+    list_ids(proc_root_, pids_);
+    std::sort(pids_.begin(), pids_.end());
+    size_t count = 0;
+    for (const auto pid : pids_) {
+      if (count == next_table_.size()) {
+        next_table_.emplace_back();
       }
+      count += read_process_entry_(pid, next_table_[count]) ? 1 : 0;
     }
+    next_table_.resize(count);
+  }
 
-    processes.sort([](const ProcessInfo &a, const ProcessInfo &b) { return a.pid < b.pid; });
-    return processes;
+  // Only this thread changes process_table_, so it can be read without the lock here. Each pid an event
+  // touched is settled once, by its last event: an exit drops it, anything else reads its stat again. A
+  // process that started and exited since the last call is already gone and simply stays out of the table.
+  // The table is merged into next_table_ entry by entry, like a scan, so the entries keep their buffers.
+  void apply_events_() {
+    touched_.clear();
+    for (const auto &event : events_buffer_) {
+      touched_.push_back({event.pid, static_cast<uint32_t>(touched_.size()), event.type == ProcEvent::EXITED});
+    }
+    std::sort(touched_.begin(), touched_.end(), [](const TouchedPid &a, const TouchedPid &b) {
+      return a.pid != b.pid ? a.pid < b.pid : a.order < b.order;
+    });
+
+    size_t count = 0;
+    const auto next_entry = [&]() -> ProcessEntry & {
+      if (count == next_table_.size()) {
+        next_table_.emplace_back();
+      }
+      return next_table_[count++];
+    };
+    const auto keep = [&](const ProcessEntry &kept) {
+      auto &entry = next_entry();
+      entry.pid = kept.pid;
+      entry.starttime = kept.starttime;
+      entry.name.assign(kept.name);
+    };
+    auto it = process_table_.cbegin();
+    for (size_t i = 0; i < touched_.size(); ++i) {
+      const auto &touched = touched_[i];
+      if (i + 1 < touched_.size() && touched_[i + 1].pid == touched.pid) {
+        continue;
+      }
+      for (; it != process_table_.cend() && it->pid < touched.pid; ++it) {
+        keep(*it);
+      }
+      if (it != process_table_.cend() && it->pid == touched.pid) {
+        ++it;
+      }
+      if (!touched.exited && !read_process_entry_(touched.pid, next_entry())) {
+        --count;
+      }
+    }
+    for (; it != process_table_.cend(); ++it) {
+      keep(*it);
+    }
+    next_table_.resize(count);
+  }
+
+  bool read_process_entry_(int32_t pid, ProcessEntry &entry) {
+    const bool read = scan_file_.open(table_path_.pid(pid, "stat")) && scan_file_.read();
+    scan_file_.close();
+    StatView stat;
+    if (!read || !parse_stat_(scan_file_.content(), stat_mask(kStatStarttime), stat)) {
+      return false;
+    }
+    entry.pid = pid;
+    entry.starttime = stat.get(kStatStarttime);
+    entry.name.assign(stat.comm);
+    return true;
   }
 
-  bool process_list_changed_() const {
-    auto current = get_process_list_();
-    if (current.size() != last_process_list_.size()) {
-      last_process_list_ = std::move(current);
-      return true;
+  // Always reads the live /proc, whatever the procfs root. The ProcFile used here is counted as well, which
+  // is negligible next to a sample.
+  void collate_self_(SelfStats &stats) const {
+    stats.file_opens = ProcFile::opens();
+    stats.file_reads = ProcFile::reads();
+    struct rusage usage = {};
+    if (getrusage(RUSAGE_SELF, &usage) == 0) {
+      stats.cpu_user_us = static_cast<uint64_t>(usage.ru_utime.tv_sec) * 1000000 + usage.ru_utime.tv_usec;
+      stats.cpu_system_us = static_cast<uint64_t>(usage.ru_stime.tv_sec) * 1000000 + usage.ru_stime.tv_usec;
+    }
+    ProcFile statm;
+    StatM mem = {};
+    if (statm.open("/proc/self/statm") && statm.read() && parse_statm_(statm.content(), mem)) {
+      stats.rss_kb = static_cast<uint64_t>(mem.resident) * page_kb_;
     }
+  }
 
-    auto it_current = current.begin();
-    auto it_last = last_process_list_.begin();
-    for (; it_current != current.end(); ++it_current, ++it_last) {
-      if (it_current->pid != it_last->pid || it_current->name != it_last->name) {
-        last_process_list_ = std::move(current);
-        return true;
-      }
+  std::list<ProcessInfo> get_process_list_() const {
+    std::lock_guard<std::mutex> lock(process_table_mutex_);
+    std::list<ProcessInfo> processes;
+    for (const auto &entry : process_table_) {
+      processes.push_back({entry.pid, entry.name});
     }
+    return processes;
+  }
 
-    return false;
+  // Counts each pid once, however often the filter lists it, as get_processes_ samples it once.
+  int32_t count_running_(const std::list<int32_t> &pids) const {
+    std::vector<int32_t> unique(pids.begin(), pids.end());
+    std::sort(unique.begin(), unique.end());
+    unique.erase(std::unique(unique.begin(), unique.end()), unique.end());
+    int32_t count = 0;
+    ProcPath path(proc_root_);
+    for (const auto pid : unique) {
+      if (pid > 0 && access(path.pid(pid, "stat").c_str(), F_OK) == 0) {
+        ++count;
+      }
+    }
+    return count;
   }
 
  private:
-  mutable std::list<ProcessInfo> last_process_list_;
+  mutable std::mutex process_table_mutex_;
+  std::vector<ProcessEntry> process_table_;
+  std::vector<ProcessEntry> next_table_;
+  ProcFile scan_file_;
+  ProcfsCache cache_;
+  ProcFile meminfo_file_;
+  ProcFile stat_file_;
+  CpuColumns cpu_now_;  // this sample's and the previous one's counters, with cpu_percent_
+  CpuColumns cpu_last_;
+  std::vector<uint64_t> cpu_elapsed_;
+  std::vector<double> cpu_scale_;
+  const std::string proc_root_;
+  const uint32_t metrics_;
+  const uint64_t process_stat_mask_;
+  const bool cpu_percent_;
+  const uint64_t page_kb_;
+  std::vector<int32_t> targets_;
+  std::vector<ProcessScan> scans_;
+  const ThreadPolicies thread_policies_;
+  WorkerPool pool_;
+  std::vector<WorkerState> workers_;  // per pool worker
+  ProcPath table_path_;              // for the process table, on the sampling thread
+  std::vector<int32_t> pids_;
+  std::unique_ptr<ProcEvents> events_;
+  std::vector<std::unique_ptr<Collector>> collectors_;
+  std::vector<ProcEvent> events_buffer_;
+  std::vector<TouchedPid> touched_;  // by apply_events_()
+  bool table_complete_ = false;
 };
 
-Packet::Packet() : impl_(new ImplPacket()) {}
+Packet::Packet(const PacketOptions &options)
+    : impl_(new ImplPacket(options)),
+      metrics_(options.metrics),
+      cpu_percent_(options.cpu_percent),
+      collectors_(impl_->collector_specs()),
+      schema_(schema_frame_(metrics_, cpu_percent_, collectors_)) {}
 Packet::~Packet() {}
 
-void Packet::collate(Stats &stats, const std::list<int32_t> &pids) {
-  impl_->collate(stats, pids);
+void Packet::collate(Stats &stats, const std::vector<int32_t> &pids, uint32_t groups) {
+  impl_->collate(stats, pids, groups);
+}
+
+void Packet::collate_self(SelfStats &stats) const {
+  impl_->collate_self_(stats);
 }
 
 std::list<ProcessInfo> Packet::get_process_list() const {
   return impl_->get_process_list_();
 }
 
-bool Packet::process_list_changed() const {
-  return impl_->process_list_changed_();
+int32_t Packet::count_running(const std::list<int32_t> &pids) const {
+  return impl_->count_running_(pids);
+}
+
+bool Packet::update_process_table(ProcessDelta &delta) {
+  return impl_->update_process_table_(delta);
 }
@@ -0,0 +1,506 @@
+#ifndef PLOTOP_PROC_EVENTS_H
+#define PLOTOP_PROC_EVENTS_H
+
+#include <algorithm>
+#include <atomic>
+#include <cerrno>
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <linux/cn_proc.h>
+#include <linux/connector.h>
+#include <linux/genetlink.h>
+#include <linux/netlink.h>
+#include <linux/taskstats.h>
+#include <mutex>
+#include <poll.h>
+#include <string>
+#include <sys/eventfd.h>
+#include <sys/socket.h>
+#include <thread>
+#include <unistd.h>
+#include <unordered_map>
+#include <vector>
+
+#include "log.h"
+#include "packet.h"
+
+// A change to the process table, in the order the kernel reported it.
+struct ProcEvent {
+  enum Type : uint8_t {
+    STARTED,
+    EXECUTED,
+    RENAMED,  // the thread group leader changed its name, e.g. with prctl(PR_SET_NAME)
+    EXITED,
+  };
+
+  Type type;
+  int32_t pid;
+};
+
+// Process starts, execs, renames and exits pushed by the kernel proc connector, so the process table is kept up to
+// date without rescanning /proc. With taskstats exit accounting, every process that exits is also reported
+// with the CPU time it used over its whole life, including those that lived shorter than a sample.
+//
+// Taskstats needs CAP_NET_ADMIN, and so does the connector on many kernels; when the connector cannot be
+// joined ready() is false and the caller keeps polling /proc. A listener thread drains the sockets as events
+// arrive, so a build spawning thousands of processes does not overflow them between samples.
+class ProcEvents {
+ public:
+  ProcEvents() : ticks_per_second_(static_cast<uint64_t>(sysconf(_SC_CLK_TCK))) {
+    if (!open_connector_()) {
+      close_();
+      return;
+    }
+    if (!open_taskstats_()) {
+      Log::info("Taskstats exit accounting unavailable, exited processes are not reported");
+      if (taskstats_ >= 0) {
+        ::close(taskstats_);
+        taskstats_ = -1;
+      }
+    }
+    wake_ = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
+    if (wake_ < 0) {
+      Log::error("Failed to create eventfd: ", std::strerror(errno));
+      close_();
+      return;
+    }
+    listening_ = true;
+    thread_ = std::thread(&ProcEvents::run_, this);
+  }
+
+  ~ProcEvents() {
+    if (thread_.joinable()) {
+      const uint64_t one = 1;
+      if (::write(wake_, &one, sizeof(one)) == sizeof(one)) {
+        thread_.join();
+      } else {
+        thread_.detach();
+        return;  // the thread still uses the descriptors
+      }
+    }
+    close_();
+  }
+
+  ProcEvents(const ProcEvents &) = delete;
+  ProcEvents &operator=(const ProcEvents &) = delete;
+
+ public:
+  // False once the listener thread stopped on an error: no more events arrive and the caller has to go
+  // back to polling /proc.
+  bool ready() const { return listening_.load(); }
+
+  // Swaps the events received since the last call into events. Returns false if some were lost in between,
+  // after which the process table has to be rebuilt from a scan.
+  bool take_events(std::vector<ProcEvent> &events) {
+    events.clear();
+    std::lock_guard<std::mutex> lock(mutex_);
+    events.swap(events_);
+    const bool complete = !lost_;
+    lost_ = false;
+    return complete;
+  }
+
+  // Moves the processes that exited since the last call into exited, the max - 1 most CPU-intensive ones by
+  // name and the rest summed up into one record with pid 0.
+  void take_exited(std::vector<ExitedProcess> &exited, size_t max) {
+    exited.clear();
+    std::lock_guard<std::mutex> lock(mutex_);
+    if (exits_.empty() && other_.cpu_user + other_.cpu_system == 0) {
+      return;
+    }
+    sorted_.clear();
+    for (auto &[pid, process] : exits_) {
+      sorted_.push_back(std::move(process));
+    }
+    exits_.clear();
+    const size_t keep = max > 0 ? max - 1 : 0;
+    if (sorted_.size() > keep) {
+      std::nth_element(sorted_.begin(), sorted_.begin() + keep, sorted_.end(),
+                       [](const ExitedProcess &a, const ExitedProcess &b) {
+                         return a.cpu_user + a.cpu_system > b.cpu_user + b.cpu_system;
+                       });
+      for (auto it = sorted_.begin() + keep; it != sorted_.end(); ++it) {
+        fold_(*it);
+      }
+      sorted_.resize(keep);
+    }
+    // Sorted by pid for the delta encoding, the pid 0 record first.
+    std::sort(sorted_.begin(), sorted_.end(),
+              [](const ExitedProcess &a, const ExitedProcess &b) { return a.pid < b.pid; });
+    if (other_.cpu_user + other_.cpu_system > 0) {
+      other_.name = "(other)";
+      exited.push_back(other_);
+      other_ = {};
+    }
+    exited.insert(exited.end(), std::make_move_iterator(sorted_.begin()), std::make_move_iterator(sorted_.end()));
+  }
+
+ private:
+  // Events kept between two samples before giving up and asking for a rescan instead.
+  static constexpr size_t kMaxPendingEvents = 65536;
+  // Exited processes kept individually between two samples; later ones only add to the pid 0 record.
+  static constexpr size_t kMaxPendingExits = 4096;
+  // Thread groups with exited threads whose own exit has not been seen yet.
+  static constexpr size_t kMaxPartialGroups = 65536;
+  static constexpr size_t kBufferSize = 64 * 1024;
+
+  bool open_connector_() {
+    connector_ = socket(PF_NETLINK, SOCK_DGRAM | SOCK_CLOEXEC, NETLINK_CONNECTOR);
+    if (connector_ < 0) {
+      Log::info("Proc connector unavailable (", std::strerror(errno), "), polling /proc");
+      return false;
+    }
+    struct sockaddr_nl address = {};
+    address.nl_family = AF_NETLINK;
+    address.nl_groups = CN_IDX_PROC;
+    if (bind(connector_, reinterpret_cast<struct sockaddr *>(&address), sizeof(address)) < 0) {
+      Log::info("Proc connector unavailable (", std::strerror(errno), "), polling /proc");
+      return false;
+    }
+    enlarge_receive_buffer_(connector_);
+    if (!send_connector_op_(PROC_CN_MCAST_LISTEN)) {
+      Log::info("Proc connector unavailable (", std::strerror(errno), "), polling /proc");
+      return false;
+    }
+    Log::info("Tracking processes through the proc connector");
+    return true;
+  }
+
+  // The op follows cn_msg, whose flexible data member rules out declaring the message as one struct.
+  bool send_connector_op_(uint32_t op) {
+    alignas(nlmsghdr) char message[NLMSG_SPACE(sizeof(cn_msg) + sizeof(op))] = {};
+    auto *header = reinterpret_cast<nlmsghdr *>(message);
+    header->nlmsg_len = NLMSG_LENGTH(sizeof(cn_msg) + sizeof(op));
+    header->nlmsg_type = NLMSG_DONE;
+    header->nlmsg_pid = static_cast<uint32_t>(getpid());
+    auto *connector = reinterpret_cast<cn_msg *>(NLMSG_DATA(header));
+    connector->id.idx = CN_IDX_PROC;
+    connector->id.val = CN_VAL_PROC;
+    connector->len = sizeof(op);
+    std::memcpy(connector->data, &op, sizeof(op));
+    return ::send(connector_, message, header->nlmsg_len, 0) >= 0;
+  }
+
+  // Resolves the taskstats generic netlink family and registers for the exit records of every CPU.
+  bool open_taskstats_() {
+    taskstats_ = socket(PF_NETLINK, SOCK_RAW | SOCK_CLOEXEC, NETLINK_GENERIC);
+    if (taskstats_ < 0) {
+      return false;
+    }
+    struct sockaddr_nl address = {};
+    address.nl_family = AF_NETLINK;
+    if (bind(taskstats_, reinterpret_cast<struct sockaddr *>(&address), sizeof(address)) < 0) {
+      return false;
+    }
+
+    if (!send_generic_(GENL_ID_CTRL, CTRL_CMD_GETFAMILY, CTRL_ATTR_FAMILY_NAME, TASKSTATS_GENL_NAME)) {
+      return false;
+    }
+    buffer_.resize(kBufferSize);
+    const auto received = ::recv(taskstats_, buffer_.data(), buffer_.size(), 0);
+    if (received <= 0) {
+      return false;
+    }
+    const auto *header = reinterpret_cast<const nlmsghdr *>(buffer_.data());
+    if (!NLMSG_OK(header, static_cast<uint32_t>(received)) || header->nlmsg_type == NLMSG_ERROR) {
+      return false;
+    }
+    for_each_attribute_(genl_attributes_(header), genl_attributes_end_(header), [&](const nlattr *attribute) {
+      if (attribute->nla_type == CTRL_ATTR_FAMILY_ID) {
+        std::memcpy(&family_, attribute_data_(attribute), sizeof(family_));
+      }
+    });
+    if (family_ == 0) {
+      return false;
+    }
+
+    cpumask_ = "0-" + std::to_string(std::max(sysconf(_SC_NPROCESSORS_CONF), 1L) - 1);
+    if (!send_generic_(family_, TASKSTATS_CMD_GET, TASKSTATS_CMD_ATTR_REGISTER_CPUMASK, cpumask_, NLM_F_ACK)) {
+      return false;
+    }
+    if (!receive_ack_()) {
+      cpumask_.clear();
+      return false;
+    }
+    enlarge_receive_buffer_(taskstats_);
+    return true;
+  }
+
+  // Exit records may already arrive ahead of the ack; those few are dropped.
+  bool receive_ack_() {
+    while (true) {
+      const auto received = ::recv(taskstats_, buffer_.data(), buffer_.size(), 0);
+      if (received <= 0) {
+        return false;
+      }
+      auto remaining = static_cast<uint32_t>(received);
+      for (auto *header = reinterpret_cast<const nlmsghdr *>(buffer_.data()); NLMSG_OK(header, remaining);
+           header = NLMSG_NEXT(header, remaining)) {
+        if (header->nlmsg_type == NLMSG_ERROR) {
+          return reinterpret_cast<const nlmsgerr *>(NLMSG_DATA(header))->error == 0;
+        }
+      }
+    }
+  }
+
+  bool send_generic_(uint16_t family, uint8_t command, uint16_t type, const std::string &value, uint16_t flags = 0) {
+    std::vector<char> message(NLMSG_SPACE(GENL_HDRLEN + NLA_HDRLEN + NLA_ALIGN(value.size() + 1)));
+    auto *header = reinterpret_cast<nlmsghdr *>(message.data());
+    header->nlmsg_len = NLMSG_LENGTH(GENL_HDRLEN + NLA_HDRLEN + NLA_ALIGN(value.size() + 1));
+    header->nlmsg_type = family;
+    header->nlmsg_flags = NLM_F_REQUEST | flags;
+    auto *generic = reinterpret_cast<genlmsghdr *>(NLMSG_DATA(header));
+    generic->cmd = command;
+    generic->version = 1;
+    auto *attribute = reinterpret_cast<nlattr *>(reinterpret_cast<char *>(generic) + GENL_HDRLEN);
+    attribute->nla_type = type;
+    attribute->nla_len = static_cast<uint16_t>(NLA_HDRLEN + value.size() + 1);
+    std::memcpy(reinterpret_cast<char *>(attribute) + NLA_HDRLEN, value.c_str(), value.size() + 1);
+    return ::send(taskstats_, message.data(), header->nlmsg_len, 0) >= 0;
+  }
+
+  static void enlarge_receive_buffer_(int32_t fd) {
+    const int32_t size = 4 * 1024 * 1024;
+    if (setsockopt(fd, SOL_SOCKET, SO_RCVBUFFORCE, &size, sizeof(size)) < 0) {
+      setsockopt(fd, SOL_SOCKET, SO_RCVBUF, &size, sizeof(size));
+    }
+  }
+
+  void close_() {
+    if (connector_ >= 0) {
+      send_connector_op_(PROC_CN_MCAST_IGNORE);
+      ::close(connector_);
+      connector_ = -1;
+    }
+    if (taskstats_ >= 0) {
+      if (!cpumask_.empty()) {
+        send_generic_(family_, TASKSTATS_CMD_GET, TASKSTATS_CMD_ATTR_DEREGISTER_CPUMASK, cpumask_);
+      }
+      ::close(taskstats_);
+      taskstats_ = -1;
+    }
+    if (wake_ >= 0) {
+      ::close(wake_);
+      wake_ = -1;
+    }
+  }
+
+  void run_() {
+    buffer_.resize(kBufferSize);
+    struct pollfd fds[3] = {{wake_, POLLIN, 0}, {connector_, POLLIN, 0}, {taskstats_, POLLIN, 0}};
+    while (true) {
+      if (::poll(fds, 3, -1) < 0) {
+        if (errno == EINTR) {
+          continue;
+        }
+        Log::error("Proc connector poll failed: ", std::strerror(errno));
+        std::lock_guard<std::mutex> lock(mutex_);
+        lost_ = true;
+        listening_ = false;
+        return;
+      }
+      if (fds[0].revents) {
+        return;
+      }
+      if (fds[1].revents) {
+        drain_(connector_, &ProcEvents::on_connector_);
+      }
+      if (fds[2].revents) {
+        drain_(taskstats_, &ProcEvents::on_taskstats_);
+      }
+    }
+  }
+
+  void drain_(int32_t fd, void (ProcEvents::*handler)(const nlmsghdr *)) {
+    while (true) {
+      const auto received = ::recv(fd, buffer_.data(), buffer_.size(), MSG_DONTWAIT);
+      if (received < 0) {
+        if (errno == ENOBUFS) {
+          // The kernel dropped messages: the table is stale until rebuilt, some exits go unreported.
+          Log::debug("Proc events overflowed the socket buffer");
+          std::lock_guard<std::mutex> lock(mutex_);
+          lost_ = lost_ || fd == connector_;
+          continue;
+        }
+        return;
+      }
+      auto remaining = static_cast<uint32_t>(received);
+      for (auto *header = reinterpret_cast<const nlmsghdr *>(buffer_.data()); NLMSG_OK(header, remaining);
+           header = NLMSG_NEXT(header, remaining)) {
+        if (header->nlmsg_type != NLMSG_ERROR && header->nlmsg_type != NLMSG_NOOP) {
+          (this->*handler)(header);
+        }
+      }
+    }
+  }
+
+  // Threads have their own fork and exit events; only thread group leaders change the process table.
+  void on_connector_(const nlmsghdr *header) {
+    const auto *connector = reinterpret_cast<const cn_msg *>(NLMSG_DATA(header));
+    if (connector->id.idx != CN_IDX_PROC || connector->len < sizeof(proc_event)) {
+      return;
+    }
+    proc_event event;
+    std::memcpy(&event, connector->data, sizeof(event));
+
+    ProcEvent change;
+    switch (event.what) {
+      case proc_event::PROC_EVENT_FORK:
+        if (event.event_data.fork.child_pid != event.event_data.fork.child_tgid) {
+          return;
+        }
+        change = {ProcEvent::STARTED, event.event_data.fork.child_tgid};
+        break;
+      case proc_event::PROC_EVENT_EXEC:
+        change = {ProcEvent::EXECUTED, event.event_data.exec.process_tgid};
+        break;
+      case proc_event::PROC_EVENT_COMM:
+        // The process name is the leader's; other threads renaming themselves leave it alone.
+        if (event.event_data.comm.process_pid != event.event_data.comm.process_tgid) {
+          return;
+        }
+        change = {ProcEvent::RENAMED, event.event_data.comm.process_tgid};
+        break;
+      case proc_event::PROC_EVENT_EXIT:
+        if (event.event_data.exit.process_pid != event.event_data.exit.process_tgid) {
+          return;
+        }
+        change = {ProcEvent::EXITED, event.event_data.exit.process_tgid};
+        break;
+      default:
+        return;
+    }
+
+    std::lock_guard<std::mutex> lock(mutex_);
+    if (lost_) {
+      return;
+    }
+    if (events_.size() >= kMaxPendingEvents) {
+      events_.clear();
+      lost_ = true;
+      return;
+    }
+    events_.push_back(change);
+  }
+
+  // Exit records carry the CPU time of a single thread, so they are summed per thread group until the group
+  // is gone: a multi-threaded process sends a group aggregate (without CPU times) along with the record of its
+  // last thread, a single-threaded one just the record of its only thread. A leader that exits before its
+  // other threads looks like the latter, and the rest of the group is then reported again on its own.
+  // Kernels too old to fill ac_tgid cannot attribute threads and report no exits.
+  void on_taskstats_(const nlmsghdr *header) {
+    struct taskstats stats;
+    bool task = false;
+    bool group = false;
+    for_each_attribute_(genl_attributes_(header), genl_attributes_end_(header), [&](const nlattr *aggregate) {
+      if (aggregate->nla_type == TASKSTATS_TYPE_AGGR_PID) {
+        task = read_task_stats_(aggregate, stats);
+      } else if (aggregate->nla_type == TASKSTATS_TYPE_AGGR_TGID) {
+        group = true;
+      }
+    });
+    if (!task) {
+      return;
+    }
+
+    std::lock_guard<std::mutex> lock(mutex_);
+    const auto tgid = static_cast<int32_t>(stats.ac_tgid);
+    if (partial_.size() >= kMaxPartialGroups && partial_.find(tgid) == partial_.end()) {
+      partial_.clear();  // only threads of live processes pile up here; forget them rather than grow
+    }
+    auto &partial = partial_[tgid];
+    partial.utime_us += stats.ac_utime;
+    partial.stime_us += stats.ac_stime;
+    stats.ac_comm[TS_COMM_LEN - 1] = '\0';
+    if (stats.ac_pid == stats.ac_tgid) {
+      partial.name.assign(stats.ac_comm);
+    }
+    if (!group && stats.ac_pid != stats.ac_tgid) {
+      return;
+    }
+
+    ExitedProcess process;
+    process.pid = tgid;
+    process.name.append("(").append(partial.name.empty() ? stats.ac_comm : partial.name).append(")");
+    process.cpu_user = partial.utime_us * ticks_per_second_ / 1000000;
+    process.cpu_system = partial.stime_us * ticks_per_second_ / 1000000;
+    partial_.erase(tgid);
+    if (exits_.size() >= kMaxPendingExits && exits_.find(process.pid) == exits_.end()) {
+      fold_(process);
+      return;
+    }
+    exits_[process.pid] = std::move(process);
+  }
+
+  // Copies the taskstats of an AGGR_PID attribute; false unless the kernel filled in ac_tgid.
+  static bool read_task_stats_(const nlattr *aggregate, struct taskstats &stats) {
+    bool found = false;
+    const auto *begin = static_cast<const char *>(attribute_data_(aggregate));
+    const auto *end = reinterpret_cast<const char *>(aggregate) + aggregate->nla_len;
+    for_each_attribute_(begin, end, [&](const nlattr *attribute) {
+      const size_t size = attribute->nla_len - NLA_HDRLEN;
+      const size_t needed = offsetof(struct taskstats, ac_tgid) + sizeof(stats.ac_tgid);
+      if (attribute->nla_type != TASKSTATS_TYPE_STATS || size < needed) {
+        return;
+      }
+      std::memset(&stats, 0, sizeof(stats));
+      std::memcpy(&stats, attribute_data_(attribute), std::min(size, sizeof(stats)));
+      found = true;
+    });
+    return found;
+  }
+
+  void fold_(const ExitedProcess &process) {
+    other_.cpu_user += process.cpu_user;
+    other_.cpu_system += process.cpu_system;
+  }
+
+  static const char *genl_attributes_(const nlmsghdr *header) {
+    return static_cast<const char *>(NLMSG_DATA(header)) + GENL_HDRLEN;
+  }
+  static const char *genl_attributes_end_(const nlmsghdr *header) {
+    return reinterpret_cast<const char *>(header) + header->nlmsg_len;
+  }
+  static const void *attribute_data_(const nlattr *attribute) {
+    return reinterpret_cast<const char *>(attribute) + NLA_HDRLEN;
+  }
+
+  template <typename Visitor> static void for_each_attribute_(const char *begin, const char *end, Visitor visit) {
+    while (begin + NLA_HDRLEN <= end) {
+      const auto *attribute = reinterpret_cast<const nlattr *>(begin);
+      if (attribute->nla_len < NLA_HDRLEN || begin + attribute->nla_len > end) {
+        return;
+      }
+      visit(attribute);
+      begin += NLA_ALIGN(attribute->nla_len);
+    }
+  }
+
+ private:
+  const uint64_t ticks_per_second_;
+  int32_t connector_ = -1;
+  int32_t taskstats_ = -1;
+  int32_t wake_ = -1;
+  uint16_t family_ = 0;
+  std::string cpumask_;
+  std::vector<char> buffer_;
+  std::thread thread_;
+  std::atomic<bool> listening_{false};
+
+  std::mutex mutex_;
+  std::vector<ProcEvent> events_;
+  bool lost_ = false;
+  struct PartialExit {
+    uint64_t utime_us = 0;
+    uint64_t stime_us = 0;
+    std::string name;
+  };
+
+  std::unordered_map<int32_t, ExitedProcess> exits_;
+  std::unordered_map<int32_t, PartialExit> partial_;
+  std::vector<ExitedProcess> sorted_;
+  ExitedProcess other_ = {};
+};
+
+#endif  // PLOTOP_PROC_EVENTS_H
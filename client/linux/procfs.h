@@ -0,0 +1,494 @@
+#ifndef PLOTOP_PROCFS_H
+#define PLOTOP_PROCFS_H
+
+#include <algorithm>
+#include <atomic>
+#include <cerrno>
+#include <charconv>
+#include <cstdint>
+#include <cstring>
+#include <dirent.h>
+#include <fcntl.h>
+#include <initializer_list>
+#include <string>
+#include <string_view>
+#include <sys/resource.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#include <unordered_map>
+#include <vector>
+
+// Field numbers of /proc/<pid>/stat as documented in proc(5), 1-based.
+enum StatField : uint32_t {
+  kStatPid = 1,
+  kStatComm = 2,
+  kStatState = 3,
+  kStatPpid = 4,
+  kStatMinflt = 10,
+  kStatMajflt = 12,
+  kStatUtime = 14,
+  kStatStime = 15,
+  kStatPriority = 18,
+  kStatNice = 19,
+  kStatNumThreads = 20,
+  kStatStarttime = 22,
+  kStatVsize = 23,
+  kStatRss = 24,
+  kStatProcessor = 39,
+  kStatFieldCount = 52,
+};
+
+constexpr uint64_t stat_mask(StatField field) { return uint64_t(1) << field; }
+template <typename... Fields> constexpr uint64_t stat_mask(StatField field, Fields... fields) {
+  return stat_mask(field) | stat_mask(fields...);
+}
+
+// Result of parse_stat(). comm points into the parsed line and is only valid while that buffer is;
+// values holds the numeric fields selected by the mask, indexed by StatField.
+struct StatView {
+  int32_t pid = 0;
+  std::string_view comm;
+  char state = '?';
+  uint64_t values[kStatFieldCount + 1] = {};
+
+  uint64_t get(StatField field) const { return values[field]; }
+  int64_t get_signed(StatField field) const { return static_cast<int64_t>(values[field]); }
+};
+
+// Parses a decimal, optionally negative, integer. Negative values wrap into the unsigned result and are
+// recovered with StatView::get_signed.
+inline bool parse_number(std::string_view token, uint64_t &value) {
+  if (token.empty()) {
+    return false;
+  }
+  const bool negative = token.front() == '-';
+  if (negative) {
+    token.remove_prefix(1);
+  }
+  if (token.empty()) {
+    return false;
+  }
+  uint64_t result = 0;
+  for (const char c : token) {
+    if (c < '0' || c > '9') {
+      return false;
+    }
+    result = result * 10 + static_cast<uint64_t>(c - '0');
+  }
+  value = negative ? ~result + 1 : result;
+  return true;
+}
+
+// Finds the line "key:" of a status-style file and parses the number after it; a unit such as " kB"
+// after the number is ignored.
+inline bool parse_field(std::string_view content, std::string_view key, uint64_t &value) {
+  size_t pos = 0;
+  while (pos < content.size()) {
+    const size_t end = std::min(content.find('\n', pos), content.size());
+    const auto line = content.substr(pos, end - pos);
+    pos = end + 1;
+    if (line.size() <= key.size() || line[key.size()] != ':' || line.substr(0, key.size()) != key) {
+      continue;
+    }
+    const auto rest = line.substr(key.size() + 1);
+    const size_t begin = rest.find_first_not_of(" \t");
+    if (begin == std::string_view::npos) {
+      return false;
+    }
+    const size_t digits = rest.find_first_not_of("0123456789", begin);
+    return parse_number(rest.substr(begin, digits == std::string_view::npos ? digits : digits - begin), value);
+  }
+  return false;
+}
+
+// Single pass over a stat line that converts only the fields selected in mask. comm is delimited by the
+// first '(' and the last ')', so names containing spaces or parentheses are handled.
+inline bool parse_stat(std::string_view line, uint64_t mask, StatView &stat) {
+  const auto open = line.find('(');
+  const auto close = line.rfind(')');
+  if (open == std::string_view::npos || close == std::string_view::npos || close < open) {
+    return false;
+  }
+
+  uint64_t pid = 0;
+  auto pid_view = line.substr(0, open);
+  while (!pid_view.empty() && pid_view.back() == ' ') {
+    pid_view.remove_suffix(1);
+  }
+  if (!parse_number(pid_view, pid)) {
+    return false;
+  }
+  stat.pid = static_cast<int32_t>(pid);
+  stat.comm = line.substr(open + 1, close - open - 1);
+
+  uint32_t last = kStatState;
+  for (uint32_t field = kStatFieldCount; field > kStatState; --field) {
+    if (mask & stat_mask(static_cast<StatField>(field))) {
+      last = field;
+      break;
+    }
+  }
+
+  size_t pos = close + 1;
+  for (uint32_t field = kStatState; field <= last; ++field) {
+    while (pos < line.size() && line[pos] == ' ') {
+      ++pos;
+    }
+    if (pos >= line.size()) {
+      return false;
+    }
+    auto end = line.find(' ', pos);
+    if (end == std::string_view::npos) {
+      end = line.size();
+    }
+    if (field == kStatState) {
+      stat.state = line[pos];
+    } else if (mask & stat_mask(static_cast<StatField>(field))) {
+      if (!parse_number(line.substr(pos, end - pos), stat.values[field])) {
+        return false;
+      }
+    }
+    pos = end;
+  }
+  return true;
+}
+
+// Builds "<root>/<pid>[/task/<tid>]/<file>" paths in one buffer reused across calls, so a path costs no
+// allocation once the buffer has grown to the longest one. The result is valid until the next call.
+class ProcPath {
+ public:
+  explicit ProcPath(const std::string &root) : path_(root), root_size_(root.size()) {}
+
+ public:
+  const std::string &pid(int32_t pid, std::string_view file) {
+    path_.resize(root_size_);
+    append_(pid);
+    return append_(file);
+  }
+
+  const std::string &tid(int32_t pid, int32_t tid, std::string_view file) {
+    path_.resize(root_size_);
+    append_(pid);
+    path_.append("/task");
+    append_(tid);
+    return append_(file);
+  }
+
+  // The task directory of pid.
+  const std::string &tasks(int32_t pid) {
+    path_.resize(root_size_);
+    append_(pid);
+    return append_("task");
+  }
+
+ private:
+  void append_(int32_t number) {
+    char digits[16];
+    const auto result = std::to_chars(digits, digits + sizeof(digits), number);
+    path_.push_back('/');
+    path_.append(digits, result.ptr);
+  }
+
+  const std::string &append_(std::string_view name) {
+    path_.push_back('/');
+    path_.append(name);
+    return path_;
+  }
+
+ private:
+  std::string path_;
+  size_t root_size_;
+};
+
+// Collects the numeric subdirectories of dir, i.e. the pids of /proc or the tids of a task directory, into
+// ids. Reads the entries with getdents64 into a stack buffer, where opendir() would allocate one per call.
+inline bool list_ids(const std::string &dir, std::vector<int32_t> &ids) {
+  ids.clear();
+  const int32_t fd = ::open(dir.c_str(), O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+  if (fd < 0) {
+    return false;
+  }
+  // Records as the kernel lays them out: d_ino (8 bytes), d_off (8), d_reclen (2), d_type (1), d_name.
+  alignas(8) char buffer[8192];
+  long bytes = 0;
+  while ((bytes = syscall(SYS_getdents64, fd, buffer, sizeof(buffer))) > 0) {
+    for (long offset = 0; offset < bytes;) {
+      const char *record = buffer + offset;
+      uint16_t size = 0;
+      std::memcpy(&size, record + 16, sizeof(size));
+      offset += size;
+      uint64_t id = 0;
+      if (record[18] == DT_DIR && parse_number(std::string_view(record + 19), id) && id > 0 && id <= INT32_MAX) {
+        ids.push_back(static_cast<int32_t>(id));
+      }
+    }
+  }
+  ::close(fd);
+  return bytes == 0;
+}
+
+// A procfs file that stays open between samples and is re-read with pread() at offset 0.
+// procfs regenerates the content on every read, so one open() serves the whole lifetime of the task.
+class ProcFile {
+ public:
+  ProcFile() {}
+  ProcFile(const ProcFile &) = delete;
+  ProcFile &operator=(const ProcFile &) = delete;
+  ProcFile(ProcFile &&other) noexcept : fd_(other.fd_), buffer_(std::move(other.buffer_)) { other.fd_ = -1; }
+  ProcFile &operator=(ProcFile &&other) noexcept {
+    if (this != &other) {
+      close();
+      fd_ = other.fd_;
+      buffer_ = std::move(other.buffer_);
+      other.fd_ = -1;
+    }
+    return *this;
+  }
+  ~ProcFile() { close(); }
+
+ public:
+  // Calls of open() and read() on any ProcFile since process start, for self_stats.
+  static uint64_t opens() { return opens_.load(std::memory_order_relaxed); }
+  static uint64_t reads() { return reads_.load(std::memory_order_relaxed); }
+
+  bool open(const std::string &path) {
+    close();
+    opens_.fetch_add(1, std::memory_order_relaxed);
+    fd_ = ::open(path.c_str(), O_RDONLY | O_CLOEXEC);
+    return fd_ >= 0;
+  }
+
+  void close() {
+    if (fd_ >= 0) {
+      ::close(fd_);
+      fd_ = -1;
+    }
+  }
+
+  bool is_open() const { return fd_ >= 0; }
+
+  // Reads the whole file into the internal buffer, stripping the trailing newline.
+  // Returns false with errno set (ESRCH once the task has exited) on failure.
+  bool read() {
+    if (fd_ < 0) {
+      errno = EBADF;
+      return false;
+    }
+    reads_.fetch_add(1, std::memory_order_relaxed);
+    if (buffer_.size() < kInitialSize) {
+      buffer_.resize(kInitialSize);
+    }
+    size_t total = 0;
+    while (true) {
+      const auto bytes = ::pread(fd_, &buffer_[total], buffer_.size() - total, static_cast<off_t>(total));
+      if (bytes < 0) {
+        if (errno == EINTR) {
+          continue;
+        }
+        buffer_.clear();
+        return false;
+      }
+      total += static_cast<size_t>(bytes);
+      if (bytes == 0 || total < buffer_.size()) {
+        break;
+      }
+      buffer_.resize(buffer_.size() * 2);
+    }
+    buffer_.resize(total);
+    if (!buffer_.empty() && buffer_.back() == '\n') {
+      buffer_.pop_back();
+    }
+    return true;
+  }
+
+  const std::string &content() const { return buffer_; }
+
+ private:
+  static constexpr size_t kInitialSize = 1024;
+  static inline std::atomic<uint64_t> opens_{0};
+  static inline std::atomic<uint64_t> reads_{0};
+
+  int32_t fd_ = -1;
+  std::string buffer_;
+};
+
+// Open descriptor for one thread of a watched process.
+struct ProcTask {
+  uint64_t generation = 0;
+  ProcFile stat;
+  uint64_t cpu_user = 0;  // as of the previous sample, for thread policies
+  uint64_t cpu_system = 0;
+};
+
+// Open descriptors for one watched process. A descriptor stays bound to the task it was opened for and fails
+// with ESRCH once that task exits, which evicts the entry, so a recycled pid starts from a fresh entry.
+struct ProcEntry {
+  uint64_t starttime = 0;  // of the task whose stat was parsed last, see ProcfsCache::identify
+  uint64_t generation = 0;
+  ProcFile stat;
+  ProcFile statm;
+  ProcFile io;  // the files below are only opened for enabled process metrics
+  ProcFile status;
+  ProcFile smaps_rollup;
+  std::unordered_map<int32_t, ProcTask> tasks;
+  uint64_t other_cpu_user = 0;  // CPU time of the threads a thread policy left out, accumulated
+  uint64_t other_cpu_system = 0;
+};
+
+// Number of descriptors a ProcfsCache may keep open: the soft RLIMIT_NOFILE as the process has it (see
+// plotop's -F to raise it), less kReservedFiles for sockets, the spool and one-shot reads, and at most
+// kMaxOpenFiles.
+inline size_t open_file_budget() {
+  constexpr rlim_t kMaxOpenFiles = 65536;
+  constexpr rlim_t kReservedFiles = 256;
+  struct rlimit limit = {};
+  if (getrlimit(RLIMIT_NOFILE, &limit) != 0) {
+    return 512;
+  }
+  const rlim_t usable = std::min(limit.rlim_cur, kMaxOpenFiles + kReservedFiles);
+  return static_cast<size_t>(usable > 2 * kReservedFiles ? usable - kReservedFiles : usable / 2);
+}
+
+// The entry table is not synchronized: entry(), evict() and sweep() belong to one thread. Between begin()
+// and sweep() other threads may read, identify and manage the tasks of entries they were handed, as long as
+// each entry is used by one thread at a time.
+//
+// The cache keeps up to open_file_budget() descriptors open; beyond that, or once an open fails for lack of
+// descriptors, files are read one-shot. Concurrent readers may overshoot the budget by one descriptor each.
+class ProcfsCache {
+ public:
+  ProcfsCache() : max_open_files_(open_file_budget()) {}
+
+ public:
+  // Starts a new sample; entries not touched until sweep() are closed.
+  void begin() { ++generation_; }
+
+  ProcEntry &entry(int32_t pid) {
+    auto &entry = entries_[pid];
+    entry.generation = generation_;
+    return entry;
+  }
+
+  // Called after the stat of pid has been parsed. An open descriptor of a recycled pid fails and evicts the
+  // entry before this is reached, so a different starttime is only seen when that stat was read one-shot:
+  // the descriptors and thread state kept for the previous owner are dropped.
+  void identify(ProcEntry &entry, uint64_t starttime) {
+    if (entry.starttime != 0 && entry.starttime != starttime) {
+      open_files_ -= count_(entry) - (entry.stat.is_open() ? 1 : 0);
+      entry.statm.close();
+      entry.io.close();
+      entry.status.close();
+      entry.smaps_rollup.close();
+      entry.tasks.clear();
+      entry.other_cpu_user = 0;
+      entry.other_cpu_system = 0;
+    }
+    entry.starttime = starttime;
+  }
+
+  void evict(int32_t pid) {
+    const auto it = entries_.find(pid);
+    if (it == entries_.end()) {
+      return;
+    }
+    open_files_ -= count_(it->second);
+    entries_.erase(it);
+  }
+
+  ProcTask &task(ProcEntry &entry, int32_t tid) {
+    auto &task = entry.tasks[tid];
+    task.generation = generation_;
+    return task;
+  }
+
+  void evict_task(ProcEntry &entry, int32_t tid) {
+    const auto it = entry.tasks.find(tid);
+    if (it == entry.tasks.end()) {
+      return;
+    }
+    open_files_ -= it->second.stat.is_open() ? 1 : 0;
+    entry.tasks.erase(it);
+  }
+
+  // Closes the descriptors of threads that were not listed in this sample.
+  void sweep_tasks(ProcEntry &entry) {
+    for (auto it = entry.tasks.begin(); it != entry.tasks.end();) {
+      if (it->second.generation != generation_) {
+        open_files_ -= it->second.stat.is_open() ? 1 : 0;
+        it = entry.tasks.erase(it);
+      } else {
+        ++it;
+      }
+    }
+  }
+
+  void sweep() {
+    for (auto it = entries_.begin(); it != entries_.end();) {
+      if (it->second.generation != generation_) {
+        open_files_ -= count_(it->second);
+        it = entries_.erase(it);
+      } else {
+        ++it;
+      }
+    }
+  }
+
+  // Reads file, opening it at path first if needed. Returns an empty string on failure with
+  // errno set; ESRCH or ENOENT mean the task is gone.
+  const std::string &read(ProcFile &file, const std::string &path) {
+    if (!file.is_open()) {
+      if (open_files_ >= max_open_files_) {
+        return read_once_(path);
+      }
+      if (!file.open(path)) {
+        if (errno != EMFILE && errno != ENFILE) {
+          return empty_;
+        }
+        // Other descriptors of the process, or another cache, took the room: keep what is open.
+        max_open_files_ = open_files_.load();
+        return read_once_(path);
+      }
+      ++open_files_;
+    }
+    if (!file.read()) {
+      const int32_t error = errno;
+      file.close();
+      --open_files_;
+      errno = error;
+      return empty_;
+    }
+    return file.content();
+  }
+
+ private:
+  static size_t count_(const ProcEntry &entry) {
+    size_t count = 0;
+    for (const ProcFile *file : {&entry.stat, &entry.statm, &entry.io, &entry.status, &entry.smaps_rollup}) {
+      count += file->is_open() ? 1 : 0;
+    }
+    for (const auto &[tid, task] : entry.tasks) {
+      count += task.stat.is_open() ? 1 : 0;
+    }
+    return count;
+  }
+
+  // The result lives in a per-thread buffer, valid until the same thread reads once again.
+  const std::string &read_once_(const std::string &path) {
+    thread_local ProcFile spill;
+    if (!spill.open(path) || !spill.read()) {
+      spill.close();
+      return empty_;
+    }
+    spill.close();
+    return spill.content();
+  }
+
+ private:
+  uint64_t generation_ = 0;
+  std::atomic<size_t> open_files_{0};
+  std::atomic<size_t> max_open_files_;
+  std::unordered_map<int32_t, ProcEntry> entries_;
+  const std::string empty_;
+};
+
+#endif  // PLOTOP_PROCFS_H
@@ -0,0 +1,158 @@
+#include "reactor.h"
+
+#include <cerrno>
+#include <cstring>
+#include <sys/epoll.h>
+#include <sys/timerfd.h>
+#include <unistd.h>
+#include <unordered_map>
+
+#include "log.h"
+
+class Reactor::ImplReactor {
+  struct Entry {
+    Handler handler;
+    TimerHandler timer;
+  };
+
+ public:
+  ImplReactor() {
+    epoll_ = epoll_create1(EPOLL_CLOEXEC);
+    if (epoll_ < 0) {
+      Log::error("Failed to create epoll instance: ", std::strerror(errno));
+    }
+  }
+
+  ~ImplReactor() {
+    for (const auto &[fd, entry] : entries_) {
+      if (entry.timer) {
+        close(fd);
+      }
+    }
+    if (epoll_ >= 0) {
+      close(epoll_);
+    }
+  }
+
+ public:
+  bool ready() const { return epoll_ >= 0; }
+
+  void watch(int32_t fd, uint32_t events, Handler handler) {
+    entries_[fd] = {std::move(handler), nullptr};
+    control_(EPOLL_CTL_ADD, fd, events);
+  }
+
+  void modify(int32_t fd, uint32_t events) { control_(EPOLL_CTL_MOD, fd, events); }
+
+  void unwatch(int32_t fd) {
+    if (entries_.erase(fd) > 0) {
+      epoll_ctl(epoll_, EPOLL_CTL_DEL, fd, nullptr);
+    }
+  }
+
+  int32_t add_timer(TimerHandler handler) {
+    const int32_t fd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+    if (fd < 0) {
+      Log::error("Failed to create timer: ", std::strerror(errno));
+      throw std::runtime_error("Failed to create timer");
+    }
+    entries_[fd] = {nullptr, std::move(handler)};
+    control_(EPOLL_CTL_ADD, fd, READABLE);
+    return fd;
+  }
+
+  // steady_clock is CLOCK_MONOTONIC, so its time points can be handed to the timer as absolute times.
+  void arm_timer(int32_t timer, std::chrono::steady_clock::time_point first, std::chrono::nanoseconds period) {
+    struct itimerspec spec = {};
+    const auto at = std::chrono::duration_cast<std::chrono::nanoseconds>(first.time_since_epoch()).count();
+    spec.it_value.tv_sec = static_cast<time_t>(at / 1000000000);
+    spec.it_value.tv_nsec = static_cast<long>(at % 1000000000);
+    if (spec.it_value.tv_sec == 0 && spec.it_value.tv_nsec == 0) {
+      spec.it_value.tv_nsec = 1;  // zero would disarm
+    }
+    spec.it_interval.tv_sec = static_cast<time_t>(period.count() / 1000000000);
+    spec.it_interval.tv_nsec = static_cast<long>(period.count() % 1000000000);
+    if (timerfd_settime(timer, TFD_TIMER_ABSTIME, &spec, nullptr) < 0) {
+      Log::error("Failed to arm timer: ", std::strerror(errno));
+    }
+  }
+
+  void disarm_timer(int32_t timer) {
+    struct itimerspec spec = {};
+    timerfd_settime(timer, 0, &spec, nullptr);
+  }
+
+  void run() {
+    stopped_ = false;
+    struct epoll_event events[16];
+    while (!stopped_) {
+      const int32_t count = epoll_wait(epoll_, events, 16, -1);
+      if (count < 0) {
+        if (errno == EINTR) {
+          continue;
+        }
+        Log::error("epoll_wait failed: ", std::strerror(errno));
+        throw std::runtime_error("epoll_wait failed");
+      }
+      for (int32_t i = 0; i < count && !stopped_; ++i) {
+        dispatch_(events[i].data.fd, events[i].events);
+      }
+    }
+  }
+
+  void stop() { stopped_ = true; }
+
+ private:
+  void control_(int32_t op, int32_t fd, uint32_t events) {
+    struct epoll_event event = {};
+    event.events = ((events & READABLE) ? static_cast<uint32_t>(EPOLLIN) : 0u) |
+                   ((events & WRITABLE) ? static_cast<uint32_t>(EPOLLOUT) : 0u);
+    event.data.fd = fd;
+    if (epoll_ctl(epoll_, op, fd, &event) < 0) {
+      Log::error("epoll_ctl failed for fd ", fd, ": ", std::strerror(errno));
+    }
+  }
+
+  void dispatch_(int32_t fd, uint32_t events) {
+    // An earlier handler in this batch may have removed the entry; copy the handler because this one may.
+    const auto it = entries_.find(fd);
+    if (it == entries_.end()) {
+      return;
+    }
+    if (it->second.timer) {
+      uint64_t expirations = 0;
+      if (read(fd, &expirations, sizeof(expirations)) != sizeof(expirations)) {
+        return;  // re-armed or disarmed since the event was queued
+      }
+      auto handler = it->second.timer;
+      handler(expirations);
+      return;
+    }
+    // Errors and hang-ups are reported as readable and writable, so the handler finds out on its next call.
+    uint32_t ready = 0;
+    ready |= (events & (EPOLLIN | EPOLLERR | EPOLLHUP)) ? static_cast<uint32_t>(READABLE) : 0u;
+    ready |= (events & (EPOLLOUT | EPOLLERR | EPOLLHUP)) ? static_cast<uint32_t>(WRITABLE) : 0u;
+    auto handler = it->second.handler;
+    handler(ready);
+  }
+
+ private:
+  int32_t epoll_ = -1;
+  bool stopped_ = false;
+  std::unordered_map<int32_t, Entry> entries_;
+};
+
+Reactor::Reactor() : impl_(new ImplReactor()) {}
+Reactor::~Reactor() {}
+
+bool Reactor::ready() const { return impl_->ready(); }
+void Reactor::watch(int32_t fd, uint32_t events, Handler handler) { impl_->watch(fd, events, std::move(handler)); }
+void Reactor::modify(int32_t fd, uint32_t events) { impl_->modify(fd, events); }
+void Reactor::unwatch(int32_t fd) { impl_->unwatch(fd); }
+int32_t Reactor::add_timer(TimerHandler handler) { return impl_->add_timer(std::move(handler)); }
+void Reactor::arm_timer(int32_t timer, std::chrono::steady_clock::time_point first, std::chrono::nanoseconds period) {
+  impl_->arm_timer(timer, first, period);
+}
+void Reactor::disarm_timer(int32_t timer) { impl_->disarm_timer(timer); }
+void Reactor::run() { impl_->run(); }
+void Reactor::stop() { impl_->stop(); }
@@ -0,0 +1,435 @@
+#include "spool.h"
+
+#include <algorithm>
+#include <atomic>
+#include <cerrno>
+#include <cstddef>
+#include <cstring>
+#include <fcntl.h>
+#include <mutex>
+#include <random>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "log.h"
+
+namespace {
+
+constexpr char kSpoolMagic[8] = {'P', 'L', 'T', 'S', 'P', 'O', 'O', 'L'};
+constexpr uint32_t kSpoolVersion = 2;
+constexpr uint64_t kSchemaOffset = 4096;
+constexpr uint64_t kDataOffset = 65536;
+constexpr size_t kSchemaSlots = 4;
+constexpr uint64_t kSchemaSlotSize = (kDataOffset - kSchemaOffset) / kSchemaSlots;
+constexpr uint64_t kMinCapacity = 64 * 1024;
+constexpr uint32_t kWrapMarker = 0xffffffff;
+
+struct FileHeader {
+  char magic[8];
+  uint32_t version;
+  uint32_t reserved;
+  uint64_t capacity;
+  uint64_t session;
+};
+
+// Ring bounds. Two slots are written alternately and the valid one with the highest generation wins,
+// so a crash while publishing leaves the previous bounds intact.
+struct Slot {
+  uint64_t generation;
+  uint64_t next_seq;
+  uint64_t first_seq;
+  uint64_t head;
+  uint64_t tail;
+  uint64_t used;  // bytes from head to tail, including padding skipped at the end of the ring
+  uint64_t checksum;
+};
+
+// One of the last kSchemaSlots schemas records were encoded against, followed by its SCHEMA frame. Schema
+// ids count up from 1 and the schema with id n lives in slot n % kSchemaSlots.
+struct SchemaSlot {
+  uint64_t id;  // 0 while empty or being rewritten
+  uint64_t length;
+  uint64_t checksum;
+};
+
+constexpr uint64_t kMaxSchema = kSchemaSlotSize - sizeof(SchemaSlot);
+
+struct RecordHeader {
+  uint32_t length;
+  uint32_t checksum;
+  uint64_t seq;
+  uint64_t schema;  // id of the schema the frame was encoded against
+};
+
+constexpr uint64_t kSlotOffset = 64;
+
+uint64_t align_(uint64_t size) { return (size + 7) & ~static_cast<uint64_t>(7); }
+
+uint64_t fnv1a_(const void *data, size_t size, uint64_t hash = 1469598103934665603ull) {
+  const auto *bytes = static_cast<const unsigned char *>(data);
+  for (size_t i = 0; i < size; ++i) {
+    hash = (hash ^ bytes[i]) * 1099511628211ull;
+  }
+  return hash;
+}
+
+uint64_t slot_checksum_(const Slot &slot) { return fnv1a_(&slot, offsetof(Slot, checksum)); }
+
+uint32_t record_checksum_(uint64_t seq, uint64_t schema, std::string_view frame) {
+  const auto hash =
+      fnv1a_(frame.data(), frame.size(), fnv1a_(&schema, sizeof(schema), fnv1a_(&seq, sizeof(seq))));
+  return static_cast<uint32_t>(hash ^ (hash >> 32));
+}
+
+uint64_t schema_checksum_(uint64_t id, std::string_view schema) {
+  return fnv1a_(schema.data(), schema.size(), fnv1a_(&id, sizeof(id)));
+}
+
+}  // namespace
+
+class Spool::ImplSpool {
+ public:
+  ImplSpool(const std::string &path, uint64_t capacity) : capacity_(align_(std::max(capacity, kMinCapacity))) {
+    fd_ = ::open(path.c_str(), O_RDWR | O_CREAT | O_CLOEXEC, 0644);
+    if (fd_ < 0) {
+      Log::error("Failed to open spool ", path, ": ", std::strerror(errno));
+      return;
+    }
+
+    const uint64_t size = kDataOffset + capacity_;
+    struct stat st;
+    const bool fresh = ::fstat(fd_, &st) != 0 || static_cast<uint64_t>(st.st_size) != size;
+    // Reserve the blocks up front: a write through the mapping to a file the disk cannot back is a SIGBUS.
+    const int32_t error = ::posix_fallocate(fd_, 0, static_cast<off_t>(size));
+    if (error != 0) {
+      Log::error("Failed to allocate spool ", path, ": ", std::strerror(error));
+      return;
+    }
+    if (fresh && ::ftruncate(fd_, static_cast<off_t>(size)) != 0) {
+      Log::error("Failed to size spool ", path, ": ", std::strerror(errno));
+      return;
+    }
+
+    void *base = ::mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd_, 0);
+    if (base == MAP_FAILED) {
+      Log::error("Failed to map spool ", path, ": ", std::strerror(errno));
+      return;
+    }
+    base_ = static_cast<char *>(base);
+    size_ = size;
+
+    if (fresh || !load_()) {
+      initialize_();
+      Log::info("Created spool ", path, " of ", capacity_ / 1024, " KiB, session ", session_hex_());
+    } else {
+      Log::info("Resumed spool ", path, ", session ", session_hex_(), ", sequences ", state_.first_seq, " to ",
+                state_.next_seq - 1);
+    }
+  }
+
+  ~ImplSpool() {
+    if (base_) {
+      ::msync(base_, size_, MS_ASYNC);
+      ::munmap(base_, size_);
+    }
+    if (fd_ >= 0) {
+      ::close(fd_);
+    }
+  }
+
+ public:
+  bool ready() const { return base_ != nullptr; }
+
+  std::string session() const { return session_hex_(); }
+
+  uint64_t next_seq() const {
+    std::lock_guard<std::mutex> lock(mutex_);
+    return state_.next_seq;
+  }
+
+  uint64_t first_seq() const {
+    std::lock_guard<std::mutex> lock(mutex_);
+    return state_.first_seq;
+  }
+
+  uint64_t last_seq() const {
+    std::lock_guard<std::mutex> lock(mutex_);
+    return state_.next_seq - 1;
+  }
+
+  void append(uint64_t seq, std::string_view frame, std::string_view schema) {
+    if (!ready()) {
+      return;
+    }
+    std::lock_guard<std::mutex> lock(mutex_);
+    const uint64_t size = align_(sizeof(RecordHeader) + frame.size());
+    if (size > capacity_ / 2 || seq < state_.next_seq || schema.size() > kMaxSchema) {
+      Log::warning("Frame ", seq, " of ", frame.size(), " bytes not spooled");
+      return;
+    }
+    if (schema_id_ == 0 || schema != schemas_[schema_id_ % kSchemaSlots]) {
+      add_schema_(schema);
+    }
+
+    if (state_.used == 0) {
+      state_.head = state_.tail = 0;
+    }
+    const bool wrap = state_.tail + size > capacity_;
+    const uint64_t needed = size + (wrap ? capacity_ - state_.tail : 0);
+    while (capacity_ - state_.used < needed) {
+      evict_();
+    }
+    // Publish the eviction before overwriting the evicted bytes, so the bounds never cover a torn record.
+    publish_();
+
+    if (wrap) {
+      if (capacity_ - state_.tail >= sizeof(RecordHeader)) {
+        record_(state_.tail)->length = kWrapMarker;
+      }
+      state_.used += capacity_ - state_.tail;
+      state_.tail = 0;
+    }
+    auto *record = record_(state_.tail);
+    record->length = static_cast<uint32_t>(frame.size());
+    record->checksum = record_checksum_(seq, schema_id_, frame);
+    record->seq = seq;
+    record->schema = schema_id_;
+    std::memcpy(record + 1, frame.data(), frame.size());
+    if (state_.used == 0) {
+      state_.first_seq = seq;
+    }
+    state_.tail = (state_.tail + size) % capacity_;
+    state_.used += size;
+    state_.next_seq = seq + 1;
+    publish_();
+  }
+
+  bool read_from(uint64_t seq, std::string &frame, uint64_t &found, uint64_t &schema) {
+    if (!ready()) {
+      return false;
+    }
+    std::lock_guard<std::mutex> lock(mutex_);
+    // Replay reads forward, so resume from the last record returned unless it has been evicted since.
+    uint64_t offset = state_.head;
+    if (hint_seq_ >= state_.first_seq && hint_seq_ <= seq && hint_seq_ < state_.next_seq) {
+      offset = hint_offset_;
+    }
+    uint64_t walked = (offset + capacity_ - state_.head) % capacity_;
+    while (walked < state_.used) {
+      const auto *record = record_(offset);
+      if (capacity_ - offset < sizeof(RecordHeader) || record->length == kWrapMarker) {
+        walked += capacity_ - offset;
+        offset = 0;
+        continue;
+      }
+      const uint64_t size = align_(sizeof(RecordHeader) + record->length);
+      if (size > capacity_ - offset || size > state_.used - walked) {
+        Log::error("Spool record at ", offset, " is corrupt");
+        return false;
+      }
+      if (record->seq >= seq) {
+        const std::string_view payload(reinterpret_cast<const char *>(record + 1), record->length);
+        if (record_checksum_(record->seq, record->schema, payload) != record->checksum) {
+          Log::error("Spool record ", record->seq, " failed its checksum");
+          return false;
+        }
+        frame.assign(payload.data(), payload.size());
+        found = record->seq;
+        schema = record->schema;
+        hint_offset_ = offset;
+        hint_seq_ = record->seq;
+        return true;
+      }
+      walked += size;
+      offset = (offset + size) % capacity_;
+    }
+    return false;
+  }
+
+  bool schema(uint64_t id, std::string &schema) const {
+    std::lock_guard<std::mutex> lock(mutex_);
+    const size_t index = id % kSchemaSlots;
+    if (id == 0 || schema_ids_[index] != id) {
+      return false;
+    }
+    schema = schemas_[index];
+    return true;
+  }
+
+ private:
+  RecordHeader *record_(uint64_t offset) const {
+    return reinterpret_cast<RecordHeader *>(base_ + kDataOffset + offset);
+  }
+  FileHeader *header_() const { return reinterpret_cast<FileHeader *>(base_); }
+  Slot *slot_(size_t index) const { return reinterpret_cast<Slot *>(base_ + kSlotOffset) + index; }
+  SchemaSlot *schema_slot_(size_t index) const {
+    return reinterpret_cast<SchemaSlot *>(base_ + kSchemaOffset + index * kSchemaSlotSize);
+  }
+
+  // The record at head, past the padding at the end of the ring.
+  const RecordHeader *head_record_() const {
+    const auto *record = record_(state_.head);
+    if (capacity_ - state_.head < sizeof(RecordHeader) || record->length == kWrapMarker) {
+      return record_(0);
+    }
+    return record;
+  }
+
+  // Stores schema under the next id, in the slot of the oldest schema held. Records of that one are evicted
+  // and the eviction published first, so no record outlives its schema; a slot torn by a crash fails its
+  // checksum and is dropped with the records that were left to use it.
+  void add_schema_(std::string_view schema) {
+    const uint64_t id = schema_id_ + 1;
+    const size_t index = id % kSchemaSlots;
+    const uint64_t replaced = schema_ids_[index];
+    if (replaced != 0) {
+      const uint64_t first_seq = state_.first_seq;
+      while (state_.used > 0 && head_record_()->schema <= replaced) {
+        evict_();
+      }
+      if (state_.first_seq != first_seq) {
+        Log::warning("Dropped spooled samples ", first_seq, " to ", state_.first_seq - 1,
+                     ", encoded with a schema the spool no longer keeps");
+      }
+      publish_();
+    }
+
+    auto *slot = schema_slot_(index);
+    slot->id = 0;
+    std::atomic_thread_fence(std::memory_order_release);
+    std::memcpy(slot + 1, schema.data(), schema.size());
+    slot->length = schema.size();
+    slot->checksum = schema_checksum_(id, schema);
+    std::atomic_thread_fence(std::memory_order_release);
+    slot->id = id;
+    schema_ids_[index] = id;
+    schemas_[index].assign(schema.data(), schema.size());
+    schema_id_ = id;
+  }
+
+  void evict_() {
+    const auto *record = record_(state_.head);
+    uint64_t size = capacity_ - state_.head;
+    if (size >= sizeof(RecordHeader) && record->length != kWrapMarker) {
+      size = std::min(align_(sizeof(RecordHeader) + record->length), state_.used);
+    }
+    state_.head = (state_.head + size) % capacity_;
+    state_.used -= size;
+    if (state_.used == 0) {
+      state_.first_seq = state_.next_seq;
+      return;
+    }
+    const auto *next = record_(state_.head);
+    if (capacity_ - state_.head < sizeof(RecordHeader) || next->length == kWrapMarker) {
+      next = record_(0);
+    }
+    state_.first_seq = next->seq;
+  }
+
+  void publish_() {
+    state_.generation++;
+    state_.checksum = slot_checksum_(state_);
+    // Order the record bytes before the bounds that make them visible to a later reader of the file.
+    std::atomic_thread_fence(std::memory_order_release);
+    *slot_(state_.generation % 2) = state_;
+  }
+
+  bool load_() {
+    const auto *header = header_();
+    if (std::memcmp(header->magic, kSpoolMagic, sizeof(kSpoolMagic)) != 0 || header->version != kSpoolVersion ||
+        header->capacity != capacity_) {
+      return false;
+    }
+    const Slot *best = nullptr;
+    for (size_t i = 0; i < 2; ++i) {
+      const auto *slot = slot_(i);
+      if (slot_checksum_(*slot) != slot->checksum || slot->head >= capacity_ || slot->tail >= capacity_ ||
+          slot->used > capacity_ || slot->next_seq == 0) {
+        continue;
+      }
+      if (!best || slot->generation > best->generation) {
+        best = slot;
+      }
+    }
+    if (!best) {
+      return false;
+    }
+    state_ = *best;
+    session_ = header->session;
+    for (size_t i = 0; i < kSchemaSlots; ++i) {
+      const auto *slot = schema_slot_(i);
+      if (slot->id == 0 || slot->id % kSchemaSlots != i || slot->length > kMaxSchema) {
+        continue;
+      }
+      const std::string_view schema(reinterpret_cast<const char *>(slot + 1), slot->length);
+      if (schema_checksum_(slot->id, schema) == slot->checksum) {
+        schema_ids_[i] = slot->id;
+        schemas_[i].assign(schema.data(), schema.size());
+        schema_id_ = std::max(schema_id_, slot->id);
+      }
+    }
+    return true;
+  }
+
+  void initialize_() {
+    std::random_device random;
+    session_ = (static_cast<uint64_t>(random()) << 32) | random();
+
+    auto *header = header_();
+    std::memset(base_, 0, kDataOffset);
+    std::memcpy(header->magic, kSpoolMagic, sizeof(kSpoolMagic));
+    header->version = kSpoolVersion;
+    header->capacity = capacity_;
+    header->session = session_;
+    for (size_t i = 0; i < kSchemaSlots; ++i) {
+      schema_ids_[i] = 0;
+      schemas_[i].clear();
+    }
+    schema_id_ = 0;
+    state_ = {};
+    state_.next_seq = 1;
+    state_.first_seq = 1;
+    publish_();
+  }
+
+  std::string session_hex_() const {
+    static constexpr char hex[] = "0123456789abcdef";
+    std::string text(16, '0');
+    for (size_t i = 0; i < 16; ++i) {
+      text[15 - i] = hex[(session_ >> (4 * i)) & 0xf];
+    }
+    return text;
+  }
+
+ private:
+  const uint64_t capacity_;
+  int32_t fd_ = -1;
+  char *base_ = nullptr;
+  uint64_t size_ = 0;
+  uint64_t session_ = 0;
+
+  mutable std::mutex mutex_;
+  uint64_t schema_id_ = 0;  // of the schema frames are appended with, 0 before the first
+  uint64_t schema_ids_[kSchemaSlots] = {};
+  std::string schemas_[kSchemaSlots];
+  Slot state_ = {};
+  uint64_t hint_offset_ = 0;
+  uint64_t hint_seq_ = 0;
+};
+
+Spool::Spool(const std::string &path, uint64_t capacity) : impl_(new ImplSpool(path, capacity)) {}
+Spool::~Spool() {}
+
+bool Spool::ready() const { return impl_->ready(); }
+std::string Spool::session() const { return impl_->session(); }
+uint64_t Spool::next_seq() const { return impl_->next_seq(); }
+uint64_t Spool::first_seq() const { return impl_->first_seq(); }
+uint64_t Spool::last_seq() const { return impl_->last_seq(); }
+void Spool::append(uint64_t seq, std::string_view frame, std::string_view schema) {
+  impl_->append(seq, frame, schema);
+}
+bool Spool::read_from(uint64_t seq, std::string &frame, uint64_t &found, uint64_t &schema) {
+  return impl_->read_from(seq, frame, found, schema);
+}
+bool Spool::schema(uint64_t id, std::string &schema) const { return impl_->schema(id, schema); }
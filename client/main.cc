@@ -1,35 +1,135 @@
 #include <atomic>
+#include <cerrno>
 #include <chrono>
 #include <cstdint>
+#include <cstring>
 #include <list>
 #include <mutex>
 #include <sstream>
+#include <sys/resource.h>
 #include <thread>
+#include <vector>
 
 #include "cmdline.h"
 #include "internval.h"
 #include "network.h"
 #include "packet.h"
+#include "reactor.h"
+#include "schedule.h"
+#include "self_stats.h"
+#include "send_queue.h"
+#include "spool.h"
+#include "window.h"
 
 struct Arguments {
   std::string address;
   int32_t port;
   int32_t level;
-  int32_t duration;
+  double duration;
+  std::string wire;
+  int32_t keyframe;
+  int32_t queue;
+  std::string overflow;
+  std::string spool;
+  int32_t spool_size;
+  int32_t replay_rate;
+  int32_t batch;
+  int32_t batch_latency;
+  int32_t nodelay;
+  int32_t reactor;
+  std::string compression;
+  int32_t jobs;
+  int32_t events;
+  std::string threads;
+  std::string metrics;
+  std::string collectors;
+  std::string intervals;
+  std::string proc_root;
+  double self_stats;
+  int32_t cpu_percent;
+  int32_t max_files;
+  double window;
+  int32_t percentiles;
+};
+
+struct SenderOptions {
+  uint64_t replay_rate;  // bytes per second
+  size_t batch_bytes;
+  std::chrono::milliseconds batch_latency;
+};
+
+// When to flush the frames batched for one vectored write, and when to replay the next spooled sample; the
+// one policy behind sender_thread_ and the reactor.
+//
+// A batch is flushed right after a priority frame, once it holds batch_bytes, and otherwise batch_latency
+// after its first frame; with a latency of zero it is flushed as soon as the queue runs dry, so frames
+// already waiting share a write but none is held back. Spooled samples are replayed only while the queue is
+// idle, and paced to replay_rate bytes per second on top of that, so a long backlog never delays live samples.
+class BatchPolicy {
+ public:
+  using Clock = std::chrono::steady_clock;
+
+  explicit BatchPolicy(const SenderOptions &options) : options_(options) {}
+
+ public:
+  bool replay_due(Clock::time_point now) const { return now >= next_replay_; }
+
+  // Called once a spooled frame of the given size was added to the batch.
+  void replayed(Clock::time_point now, size_t bytes) {
+    next_replay_ = now + std::chrono::microseconds(bytes * 1000000 / options_.replay_rate);
+  }
+
+  // Whether the pending bytes are to be written now, after a frame was added to the batch or on a wake up
+  // with none; queue_idle means no frame is waiting to join the batch.
+  bool flush_due(Clock::time_point now, size_t pending, bool priority, bool queue_idle) {
+    if (pending == 0) {
+      flush_deadline_ = Clock::time_point::max();
+      return false;
+    }
+    if (flush_deadline_ == Clock::time_point::max()) {
+      flush_deadline_ = now + options_.batch_latency;
+    }
+    const bool due = now >= flush_deadline_ && (options_.batch_latency.count() > 0 || queue_idle);
+    return priority || due || pending >= options_.batch_bytes;
+  }
+
+  // Called after a flush with what it left pending, which a non-blocking socket may; those bytes stay due.
+  void flushed(size_t pending) {
+    if (pending == 0) {
+      flush_deadline_ = Clock::time_point::max();
+    }
+  }
+
+  // When to wake up next for a flush or, if some are pending, a replay; max for never.
+  Clock::time_point wake(bool replay_pending) const {
+    return replay_pending ? std::min(flush_deadline_, next_replay_) : flush_deadline_;
+  }
+
+ private:
+  SenderOptions options_;
+  Clock::time_point flush_deadline_ = Clock::time_point::max();
+  Clock::time_point next_replay_;
+};
+
+enum class SampleEncoding {
+  JSON,
+  BINARY,
+  DELTA,
 };
 
 struct FilterConfig {
   mutable std::mutex mutex;
-  std::list<int32_t> pids;
+  std::vector<int32_t> pids;
 
   void set(const std::list<int32_t> &new_pids) {
     std::lock_guard<std::mutex> lock(mutex);
-    pids = new_pids;
+    pids.assign(new_pids.begin(), new_pids.end());
   }
 
-  std::list<int32_t> get() const {
+  // Copies into out, which keeps its capacity from the previous call.
+  void get(std::vector<int32_t> &out) const {
     std::lock_guard<std::mutex> lock(mutex);
-    return pids;
+    out = pids;
   }
 };
 
@@ -54,8 +154,8 @@ static std::string extract_json_string_(const std::string &json, const std::stri
   return json.substr(quote_start + 1, quote_end - quote_start - 1);
 }
 
-static std::list<int32_t> extract_json_int_array_(const std::string &json, const std::string &key) {
-  std::list<int32_t> values;
+template <typename T> static std::list<T> extract_json_int_array_(const std::string &json, const std::string &key) {
+  std::list<T> values;
   const std::string pattern = "\"" + key + "\"";
   const auto pos = json.find(pattern);
   if (pos == std::string::npos) {
@@ -79,71 +179,266 @@ static std::list<int32_t> extract_json_int_array_(const std::string &json, const
       if (start == std::string::npos) {
         continue;
       }
-      values.push_back(static_cast<int32_t>(std::stoi(token.substr(start))));
+      values.push_back(static_cast<T>(std::stoll(token.substr(start))));
     } catch (const std::exception &) {
     }
   }
   return values;
 }
 
-static void send_process_list_(Network *network, Packet *packet) {
-  const auto processes = packet->get_process_list();
-  std::list<std::pair<int32_t, std::string>> process_pairs;
-  for (const auto &process : processes) {
-    process_pairs.emplace_back(process.pid, process.name);
+// Sequence ranges the server reported missing after a reconnect. The sender thread resends them from the
+// spool whenever the queue is idle. Each frame goes out after the schema it was spooled with, as a
+// REPLAY_SCHEMA frame whenever that changes, which the server decodes replayed frames against without
+// touching the schema of the live ones.
+struct ReplayState {
+  mutable std::mutex mutex;
+  std::list<std::pair<uint64_t, uint64_t>> ranges;
+  std::string held;     // a replayed frame waiting behind its schema
+  uint64_t schema = 0;  // spool id of the REPLAY_SCHEMA last sent on this connection
+  uint64_t replayed = 0;
+  uint64_t lost = 0;  // frames whose schema the spool no longer holds
+
+  void start(std::list<std::pair<uint64_t, uint64_t>> missing) {
+    std::lock_guard<std::mutex> lock(mutex);
+    ranges = std::move(missing);
+  }
+
+  bool pending() const {
+    std::lock_guard<std::mutex> lock(mutex);
+    return !held.empty() || !ranges.empty();
+  }
+
+  bool next(Spool *spool, std::string &frame) {
+    std::lock_guard<std::mutex> lock(mutex);
+    if (!held.empty()) {
+      frame.swap(held);
+      held.clear();
+      return true;
+    }
+    while (!ranges.empty()) {
+      auto &range = ranges.front();
+      uint64_t found = 0;
+      uint64_t id = 0;
+      if (range.first <= range.second && spool->read_from(range.first, frame, found, id) && found <= range.second) {
+        range.first = found + 1;
+        if (id != schema && !spool->schema(id, held)) {
+          ++lost;
+          continue;
+        }
+        frame[1] = static_cast<char>(WireKind::STATS_REPLAY);
+        ++replayed;
+        if (id != schema) {
+          schema = id;
+          frame.swap(held);
+          frame[1] = static_cast<char>(WireKind::REPLAY_SCHEMA);
+        }
+        return true;
+      }
+      ranges.pop_front();
+    }
+    if (replayed > 0) {
+      Log::info("Replayed ", replayed, " spooled samples");
+      replayed = 0;
+    }
+    if (lost > 0) {
+      Log::warning("Skipped ", lost, " spooled samples whose schema the spool no longer holds");
+      lost = 0;
+    }
+    return false;
+  }
+};
+
+// Serializes full process lists against deltas so the server never applies a delta to an older list.
+static std::mutex process_list_mutex_;
+
+static void send_process_list_(SendQueue *queue, Packet *packet) {
+  std::lock_guard<std::mutex> lock(process_list_mutex_);
+  queue->push_latest(Latest::PROCESSES, packet->to_process_list(packet->get_process_list()));
+}
+
+// A delta replacing one the link has not sent yet would lose the older changes, so that case sends the full
+// list instead.
+static void send_process_delta_(SendQueue *queue, Packet *packet) {
+  std::lock_guard<std::mutex> lock(process_list_mutex_);
+  ProcessDelta delta;
+  if (!packet->update_process_table(delta)) {
+    return;
+  }
+  if (queue->pending(Latest::PROCESSES)) {
+    queue->push_latest(Latest::PROCESSES, packet->to_process_list(packet->get_process_list()));
+    return;
+  }
+  std::string frames;
+  if (!delta.removed.empty()) {
+    frames = packet->to_process_removed(delta.removed);
+  }
+  if (!delta.added.empty()) {
+    frames += packet->to_process_added(delta.added);
+  }
+  queue->push_latest(Latest::PROCESSES, frames);
+}
+
+static constexpr uint64_t kHeartbeatMs = 30000;
+static constexpr uint64_t kServerTimeoutMs = 90000;
+
+// What the server's messages act on for one connection, in either threading mode.
+struct Connection {
+  Network *network;
+  SendQueue *queue;
+  Packet *packet;
+  FilterConfig *filter_config;
+  Spool *spool;
+  ReplayState *replay;
+  std::atomic<SampleEncoding> *encoding;
+};
+
+static uint64_t steady_ms_() {
+  return static_cast<uint64_t>(std::chrono::duration_cast<std::chrono::milliseconds>(
+                                   std::chrono::steady_clock::now().time_since_epoch())
+                                   .count());
+}
+
+static void handle_message_(const Connection &connection, const std::string &message) {
+  const std::string type = extract_json_string_(message, "type");
+  if (type == "filter") {
+    const auto pids = extract_json_int_array_<int32_t>(message, "pids");
+    connection.filter_config->set(pids);
+
+    std::ostringstream pid_stream;
+    pid_stream << "[";
+    for (auto it = pids.begin(); it != pids.end(); ++it) {
+      if (it != pids.begin()) {
+        pid_stream << ", ";
+      }
+      pid_stream << *it;
+    }
+    pid_stream << "]";
+    Log::info("Received filter, pids: ", pid_stream.str());
+
+    connection.queue->push_priority(connection.packet->to_filter_ack(connection.packet->count_running(pids)));
+  } else if (type == "hello_ack") {
+    const std::string protocol = extract_json_string_(message, "protocol");
+    Log::info("Server accepted sample encoding: ", protocol);
+    if (protocol == "delta") {
+      connection.encoding->store(SampleEncoding::DELTA);
+    } else if (protocol == "binary") {
+      connection.encoding->store(SampleEncoding::BINARY);
+    } else {
+      connection.encoding->store(SampleEncoding::JSON);
+    }
+    // Batches flushed from here on are compressed; the server decodes compressed and plain frames alike.
+    const std::string compression = extract_json_string_(message, "compression");
+    if (compression == "lz") {
+      Log::info("Server accepted stream compression: ", compression);
+      connection.network->set_compression(true);
+    }
+  } else if (type == "resume_ack") {
+    // Missing ranges come as a flat list of inclusive bounds: [first, last, first, last, ...].
+    const auto bounds = extract_json_int_array_<uint64_t>(message, "missing");
+    std::list<std::pair<uint64_t, uint64_t>> missing;
+    uint64_t count = 0;
+    for (auto it = bounds.begin(); it != bounds.end() && std::next(it) != bounds.end(); std::advance(it, 2)) {
+      missing.emplace_back(*it, *std::next(it));
+      count += *std::next(it) - *it + 1;
+    }
+    Log::info("Server is missing ", count, " spooled samples in ", missing.size(), " ranges");
+    if (connection.spool && !missing.empty()) {
+      connection.replay->start(std::move(missing));
+      connection.queue->wake();
+    }
+  } else if (type == "heartbeat") {
+    Log::debug("Received server heartbeat");
+  } else if (type == "request_process_list") {
+    Log::info("Received request_process_list, sending current process list");
+    send_process_list_(connection.queue, connection.packet);
+  } else if (type.empty()) {
+    Log::warning("Received message without type");
+  } else {
+    Log::warning("Received unknown message type: ", type);
+  }
+}
+
+// Encodes a sample in the connection's encoding, spools it and queues it together with summary, if any. The
+// schema goes out ahead of the first binary sample of each connection. Returns the time the encoding took.
+static std::chrono::nanoseconds push_sample_(const Connection &connection, const Stats &stats, bool &schema_sent,
+                                             int32_t keyframe, const std::string &summary) {
+  SendQueue *queue = connection.queue;
+  Packet *packet = connection.packet;
+  Spool *spool = connection.spool;
+  const auto encoding = connection.encoding->load();
+  if (encoding != SampleEncoding::JSON && !schema_sent) {
+    queue->push_priority(packet->to_schema());
+    schema_sent = true;
+  }
+  if (spool && encoding != SampleEncoding::BINARY) {
+    spool->append(stats.seq, packet->to_binary(stats), packet->to_schema());
+  }
+  // Deltas chain on each other: losing one invalidates the rest, so restart from a keyframe.
+  if (encoding == SampleEncoding::DELTA && queue->full()) {
+    queue->clear_samples();
+    packet->request_keyframe();
+  }
+  const auto start = std::chrono::steady_clock::now();
+  const std::string &frame = encoding == SampleEncoding::DELTA    ? packet->to_delta(stats, keyframe)
+                             : encoding == SampleEncoding::BINARY ? packet->to_binary(stats)
+                                                                  : packet->to_json(stats);
+  const auto encoded = std::chrono::steady_clock::now() - start;
+  if (spool && encoding == SampleEncoding::BINARY) {
+    spool->append(stats.seq, frame, packet->to_schema());
+  }
+  queue->push_sample(frame, summary);
+  return encoded;
+}
+
+// Returns the summary of the window the sample with sequence number seq closed, empty when windows are
+// disabled, and starts the next window.
+static std::string close_window_(SampleWindow *window, uint64_t seq, std::chrono::steady_clock::time_point now) {
+  std::string summary;
+  if (window->enabled()) {
+    summary = window->to_summary(seq, now);
+  }
+  window->reset(now);
+  return summary;
+}
+
+// Raises the soft RLIMIT_NOFILE to wanted, or to the hard limit if that is lower; never lowers it.
+static void raise_open_file_limit_(rlim_t wanted) {
+  struct rlimit limit = {};
+  if (getrlimit(RLIMIT_NOFILE, &limit) != 0) {
+    Log::warning("Failed to read the open file limit: ", std::strerror(errno));
+    return;
+  }
+  const rlim_t raised = limit.rlim_max == RLIM_INFINITY ? wanted : std::min(wanted, limit.rlim_max);
+  if (limit.rlim_cur != RLIM_INFINITY && limit.rlim_cur < raised) {
+    limit.rlim_cur = raised;
+    if (setrlimit(RLIMIT_NOFILE, &limit) != 0) {
+      Log::warning("Failed to raise the open file limit: ", std::strerror(errno));
+      return;
+    }
   }
-  network->send(packet->to_process_list(process_pairs));
-  packet->process_list_changed();
+  Log::info("Open file limit ", limit.rlim_cur);
 }
 
-static void receiver_thread_(Network *network, Packet *packet, FilterConfig *filter_config,
-                             std::atomic<bool> *stop_flag,
+// Reports the collector's footprint since the previous report.
+static void send_self_stats_(SendQueue *queue, Packet *packet, Network *network, SelfMonitor *monitor) {
+  SelfStats stats;
+  packet->collate_self(stats);
+  const auto batches = network->batch_statistics();
+  stats.frames = batches.frames;
+  stats.bytes = batches.bytes;
+  stats.wire_bytes = batches.wire_bytes;
+  stats.queue_depth = queue->depth();
+  monitor->report(stats);
+  queue->push_latest(Latest::SELF_STATS, packet->to_self_stats(stats));
+}
+
+static void receiver_thread_(Network *network, Connection connection, std::atomic<bool> *stop_flag,
                              std::atomic<uint64_t> *last_server_seen_ms) {
   while (!stop_flag->load()) {
     try {
       const std::string message = network->recv();
-      const std::string type = extract_json_string_(message, "type");
-      const auto now_ms = std::chrono::duration_cast<std::chrono::milliseconds>(
-                              std::chrono::steady_clock::now().time_since_epoch())
-                              .count();
-      last_server_seen_ms->store(static_cast<uint64_t>(now_ms));
-
-      if (type == "filter") {
-        const auto pids = extract_json_int_array_(message, "pids");
-        filter_config->set(pids);
-
-        std::ostringstream pid_stream;
-        pid_stream << "[";
-        for (auto it = pids.begin(); it != pids.end(); ++it) {
-          if (it != pids.begin()) {
-            pid_stream << ", ";
-          }
-          pid_stream << *it;
-        }
-        pid_stream << "]";
-        Log::info("Received filter, pids: ", pid_stream.str());
-
-        const auto current_processes = packet->get_process_list();
-        int32_t matched_count = 0;
-        for (const auto &process : current_processes) {
-          for (const auto pid : pids) {
-            if (process.pid == pid) {
-              ++matched_count;
-              break;
-            }
-          }
-        }
-        network->send(packet->to_filter_ack(matched_count));
-      } else if (type == "heartbeat") {
-        Log::debug("Received server heartbeat");
-      } else if (type == "request_process_list") {
-        Log::info("Received request_process_list, sending current process list");
-        send_process_list_(network, packet);
-      } else if (type.empty()) {
-        Log::warning("Received message without type");
-      } else {
-        Log::warning("Received unknown message type: ", type);
-      }
+      last_server_seen_ms->store(steady_ms_());
+      handle_message_(connection, message);
     } catch (const std::exception &e) {
       Log::error("Receiver thread error: ", e.what());
       stop_flag->store(true);
@@ -152,99 +447,662 @@ static void receiver_thread_(Network *network, Packet *packet, FilterConfig *fil
   }
 }
 
-static void heartbeat_thread_(Network *network, Packet *packet, std::atomic<bool> *stop_flag,
+// Also sends the self_stats reports every self_stats_ms, unless that is 0.
+static void heartbeat_thread_(SendQueue *queue, Packet *packet, Network *network, SelfMonitor *monitor,
+                              uint64_t self_stats_ms, std::atomic<bool> *stop_flag,
                               const std::atomic<uint64_t> *last_server_seen_ms) {
+  uint64_t next_heartbeat = 0;
+  uint64_t next_self_stats = steady_ms_() + self_stats_ms;
   while (!stop_flag->load()) {
     try {
-      const auto now_ms = std::chrono::duration_cast<std::chrono::milliseconds>(
-                              std::chrono::steady_clock::now().time_since_epoch())
-                              .count();
-      const auto last_seen = last_server_seen_ms->load();
-      if (last_seen > 0 && static_cast<uint64_t>(now_ms) > last_seen + 90000) {
-        Log::error("Server heartbeat timeout");
-        stop_flag->store(true);
-        break;
+      const auto now = steady_ms_();
+      if (now >= next_heartbeat) {
+        const auto last_seen = last_server_seen_ms->load();
+        if (last_seen > 0 && now > last_seen + kServerTimeoutMs) {
+          Log::error("Server heartbeat timeout");
+          stop_flag->store(true);
+          break;
+        }
+        queue->push_priority(packet->to_heartbeat());
+        next_heartbeat = now + kHeartbeatMs;
+      }
+      if (self_stats_ms > 0 && now >= next_self_stats) {
+        send_self_stats_(queue, packet, network, monitor);
+        next_self_stats = now + self_stats_ms;
       }
-      network->send(packet->to_heartbeat());
     } catch (const std::exception &e) {
       Log::error("Heartbeat thread error: ", e.what());
       stop_flag->store(true);
       break;
     }
 
-    for (int32_t i = 0; i < 300 && !stop_flag->load(); ++i) {
-      std::this_thread::sleep_for(std::chrono::milliseconds(100));
+    std::this_thread::sleep_for(std::chrono::milliseconds(100));
+  }
+}
+
+static void log_batch_statistics_(const BatchStatistics &batches) {
+  static constexpr const char *labels[BatchStatistics::kBuckets] = {"1", "2", "3-4", "5-8", "9-16", "17-32", "33+"};
+  std::ostringstream histogram;
+  for (size_t i = 0; i < BatchStatistics::kBuckets; ++i) {
+    histogram << (i > 0 ? ", " : "") << labels[i] << ": " << batches.histogram[i];
+  }
+  Log::info("Sent ", batches.frames, " frames, ", batches.bytes, " bytes (", batches.wire_bytes, " on the wire) in ",
+            batches.flushes, " writes; frames per write ", histogram.str());
+}
+
+// The only thread writing to the socket, so a slow link blocks nothing but this thread. Frames are batched
+// into one vectored write and spooled samples replayed as BatchPolicy decides.
+static void sender_thread_(Network *network, SendQueue *queue, Spool *spool, ReplayState *replay,
+                           SenderOptions options, std::atomic<bool> *stop_flag) {
+  std::string frame;
+  BatchPolicy batch(options);
+  while (true) {
+    bool priority = false;
+    const bool popped = queue->pop_until(frame, batch.wake(replay->pending()), &priority);
+    if (!popped && queue->closed()) {
+      break;
+    }
+    try {
+      const auto now = std::chrono::steady_clock::now();
+      if (popped) {
+        network->write(frame);
+      } else if (batch.replay_due(now) && replay->next(spool, frame)) {
+        batch.replayed(now, frame.size());
+        network->write(frame);
+      }
+      if (batch.flush_due(now, network->pending(), priority, queue->depth() == 0)) {
+        network->flush();
+        batch.flushed(network->pending());
+      }
+    } catch (const std::exception &e) {
+      Log::error("Sender thread error: ", e.what());
+      stop_flag->store(true);
+      break;
     }
   }
 }
 
+// Reactor mode: sampling, heartbeats, socket reads and writes, replay and reconnects all run on one
+// thread, multiplexed by epoll over a non-blocking socket and timerfds, instead of the sampling, receiver,
+// heartbeat and sender threads of the default mode. The packet and its procfs descriptors outlive
+// reconnects. Frames wait in the send queue while the socket is full, so its drop policy applies as usual.
+class ReactorCollector {
+ public:
+  ReactorCollector(const Arguments &args, const PacketOptions &packet_options, const SenderOptions &options,
+                   DropPolicy drop_policy, const GroupSchedule &schedule, Spool *spool, uint64_t sequence)
+      : args_(args), options_(options), drop_policy_(drop_policy), interval_(schedule.tick()), schedule_(schedule),
+        spool_(spool), sequence_(sequence),
+        self_stats_period_(static_cast<int64_t>(args.self_stats * 1000 + 0.5)),
+        window_(std::chrono::milliseconds(static_cast<int64_t>(args.window * 1000 + 0.5)), args.percentiles != 0),
+        packet_(new Packet(packet_options)), encoding_(SampleEncoding::JSON), batch_(options) {}
+
+ public:
+  void run() {
+    if (!reactor_.ready()) {
+      throw std::runtime_error("Reactor unavailable");
+    }
+    sample_timer_ = reactor_.add_timer([this](uint64_t expirations) { on_sample_(expirations); });
+    heartbeat_timer_ = reactor_.add_timer([this](uint64_t) { on_heartbeat_(); });
+    wake_timer_ = reactor_.add_timer([this](uint64_t) { pump_(); });
+    retry_timer_ = reactor_.add_timer([this](uint64_t) { connect_(); });
+    self_stats_timer_ = reactor_.add_timer([this](uint64_t) { on_self_stats_(); });
+    if (spool_) {
+      start_sampling_();
+    }
+    connect_();
+    reactor_.run();
+  }
+
+ private:
+  Connection connection_() {
+    return {network_.get(), queue_.get(), packet_.get(), &filter_config_, spool_, replay_.get(), &encoding_};
+  }
+
+  void start_sampling_() {
+    deadline_ = std::chrono::steady_clock::now() + interval_;
+    reactor_.arm_timer(sample_timer_, deadline_, interval_);
+  }
+
+  void connect_() {
+    network_.reset(new Network(args_.address, args_.port, false));
+    if (!network_->ready()) {
+      network_.reset();
+      retry_();
+      return;
+    }
+    fd_ = network_->fd();
+    events_ = Reactor::WRITABLE;
+    reactor_.watch(fd_, events_, [this](uint32_t events) { on_socket_(events); });
+    if (!network_->connecting()) {
+      on_connected_();
+    }
+  }
+
+  void on_connected_() {
+    Log::info("Connected to ", args_.address, ":", args_.port);
+    retry_ms_ = 100;
+    network_->set_nodelay(args_.nodelay != 0);
+    connected_ = true;
+    queue_.reset(new SendQueue(static_cast<size_t>(args_.queue), drop_policy_));
+    replay_.reset(new ReplayState());
+    encoding_.store(SampleEncoding::JSON);
+    schema_sent_ = false;
+    filter_config_.set({});
+    packet_->request_keyframe();
+    schedule_.reset();
+    last_server_seen_ms_ = 0;
+    batch_ = BatchPolicy(options_);
+
+    if (args_.wire != "json" || args_.compression != "none") {
+      queue_->push_priority(packet_->to_hello(args_.wire, args_.compression));
+    }
+    if (spool_) {
+      queue_->push_priority(packet_->to_resume(spool_->session(), spool_->first_seq(), spool_->last_seq()));
+    }
+    ProcessDelta initial;
+    packet_->update_process_table(initial);
+    send_process_list_(queue_.get(), packet_.get());
+    queue_->push_priority(packet_->to_heartbeat());
+    reactor_.arm_timer(heartbeat_timer_, std::chrono::steady_clock::now() + std::chrono::milliseconds(kHeartbeatMs),
+                       std::chrono::milliseconds(kHeartbeatMs));
+    monitor_.connected();
+    if (self_stats_period_.count() > 0) {
+      reactor_.arm_timer(self_stats_timer_, std::chrono::steady_clock::now() + self_stats_period_, self_stats_period_);
+    }
+    if (!spool_) {
+      start_sampling_();
+    }
+    pump_();
+  }
+
+  void disconnect_() {
+    if (connected_) {
+      log_batch_statistics_(network_->batch_statistics());
+    }
+    reactor_.unwatch(fd_);
+    network_.reset();
+    queue_.reset();
+    replay_.reset();
+    connected_ = false;
+    reactor_.disarm_timer(heartbeat_timer_);
+    reactor_.disarm_timer(self_stats_timer_);
+    reactor_.disarm_timer(wake_timer_);
+    if (!spool_) {
+      reactor_.disarm_timer(sample_timer_);
+    }
+    retry_();
+  }
+
+  void retry_() {
+    Log::info("Retrying ", ++retry_count_, " times");
+    reactor_.arm_timer(retry_timer_, std::chrono::steady_clock::now() + std::chrono::milliseconds(retry_ms_));
+    retry_ms_ = std::min(retry_ms_ * 2, static_cast<uint64_t>(5000));
+  }
+
+  void on_socket_(uint32_t events) {
+    try {
+      if (network_->connecting()) {
+        if (!network_->finish_connect()) {
+          disconnect_();
+          return;
+        }
+        on_connected_();
+        return;
+      }
+      if (events & Reactor::READABLE) {
+        while (network_->poll(message_)) {
+          last_server_seen_ms_ = steady_ms_();
+          handle_message_(connection_(), message_);
+        }
+      }
+      if ((events & Reactor::WRITABLE) && network_->blocked()) {
+        network_->flush();
+      }
+    } catch (const std::exception &e) {
+      Log::error("Connection error: ", e.what());
+      disconnect_();
+      return;
+    }
+    pump_();
+  }
+
+  void on_sample_(uint64_t expirations) {
+    // The timer keeps the absolute schedule; more than one expiration means ticks were missed.
+    const auto now = std::chrono::steady_clock::now();
+    const auto deadline = deadline_ + interval_ * static_cast<int64_t>(expirations - 1);
+    deadline_ = deadline + interval_;
+    if (expirations > 1) {
+      overruns_++;
+      Log::debug("Sampling overrun, skipped ", expirations - 1, " ticks");
+    }
+    ticks_ += expirations;
+    const uint32_t due = schedule_.due(ticks_);
+    if (due == 0) {
+      return;
+    }
+    const uint32_t groups = window_.groups(due, now);
+
+    auto &stats = stats_;
+    stats.jitter_us = std::chrono::duration_cast<std::chrono::microseconds>(now - deadline).count();
+    stats.overruns = overruns_;
+    try {
+      filter_config_.get(pids_);
+      if (!connected_) {
+        stats.dropped_samples = 0;
+        stats.coalesced_samples = 0;
+        const auto start = std::chrono::steady_clock::now();
+        packet_->collate(stats, pids_, groups);
+        window_.add(stats);
+        const auto collated = std::chrono::steady_clock::now();
+        if (window_.closing()) {
+          stats.seq = sequence_++;
+          spool_->append(stats.seq, packet_->to_binary(stats), packet_->to_schema());
+          window_.reset(now);
+        }
+        monitor_.record_tick(collated - start, std::chrono::steady_clock::now() - collated);
+        return;
+      }
+      if ((groups & kGroupProcesses) && window_.closing()) {
+        send_process_delta_(queue_.get(), packet_.get());
+      }
+      stats.dropped_samples = queue_->dropped();
+      stats.coalesced_samples = queue_->coalesced();
+      const auto start = std::chrono::steady_clock::now();
+      packet_->collate(stats, pids_, groups);
+      window_.add(stats);
+      const auto collated = std::chrono::steady_clock::now() - start;
+      if (!window_.closing()) {
+        monitor_.record_tick(collated, std::chrono::nanoseconds(0));
+        return;
+      }
+      stats.seq = sequence_++;
+      const std::string summary = close_window_(&window_, stats.seq, now);
+      monitor_.record_tick(collated, push_sample_(connection_(), stats, schema_sent_, args_.keyframe, summary));
+    } catch (const std::exception &e) {
+      Log::error("Sampling error: ", e.what());
+    }
+    pump_();
+  }
+
+  void on_self_stats_() {
+    if (!connected_) {
+      return;
+    }
+    send_self_stats_(queue_.get(), packet_.get(), network_.get(), &monitor_);
+    pump_();
+  }
+
+  void on_heartbeat_() {
+    if (!connected_) {
+      return;
+    }
+    if (last_server_seen_ms_ > 0 && steady_ms_() > last_server_seen_ms_ + kServerTimeoutMs) {
+      Log::error("Server heartbeat timeout");
+      disconnect_();
+      return;
+    }
+    queue_->push_priority(packet_->to_heartbeat());
+    pump_();
+  }
+
+  // Moves frames from the queue into the network batch while the socket keeps up, flushing as BatchPolicy
+  // decides, then arms the wake timer for the next flush deadline or replay slot.
+  void pump_() {
+    if (!connected_) {
+      return;
+    }
+    try {
+      const auto now = std::chrono::steady_clock::now();
+      const auto never = std::chrono::steady_clock::time_point::max();
+      while (!network_->blocked()) {
+        bool priority = false;
+        if (queue_->try_pop(frame_, &priority)) {
+          network_->write(frame_);
+        } else if (spool_ && batch_.replay_due(now) && replay_->next(spool_, frame_)) {
+          batch_.replayed(now, frame_.size());
+          network_->write(frame_);
+        } else {
+          break;
+        }
+        if (batch_.flush_due(now, network_->pending(), priority, queue_->depth() == 0)) {
+          network_->flush();
+          batch_.flushed(network_->pending());
+        }
+      }
+      // Woken up with nothing new to add: the batch may have reached its deadline.
+      if (!network_->blocked() && batch_.flush_due(now, network_->pending(), false, true)) {
+        network_->flush();
+        batch_.flushed(network_->pending());
+      }
+
+      const auto wake = network_->blocked() ? never : batch_.wake(replay_->pending());
+      if (wake != never) {
+        reactor_.arm_timer(wake_timer_, wake);
+      } else {
+        reactor_.disarm_timer(wake_timer_);
+      }
+      const uint32_t events = Reactor::READABLE | (network_->blocked() ? static_cast<uint32_t>(Reactor::WRITABLE) : 0u);
+      if (events != events_) {
+        events_ = events;
+        reactor_.modify(fd_, events_);
+      }
+    } catch (const std::exception &e) {
+      Log::error("Connection error: ", e.what());
+      disconnect_();
+    }
+  }
+
+ private:
+  const Arguments &args_;
+  const SenderOptions options_;
+  const DropPolicy drop_policy_;
+  const std::chrono::milliseconds interval_;
+  GroupSchedule schedule_;
+  Spool *spool_;
+  uint64_t sequence_;
+
+  Reactor reactor_;
+  int32_t sample_timer_ = -1;
+  int32_t heartbeat_timer_ = -1;
+  int32_t wake_timer_ = -1;
+  int32_t retry_timer_ = -1;
+  int32_t self_stats_timer_ = -1;
+  const std::chrono::milliseconds self_stats_period_;
+  SelfMonitor monitor_;
+  SampleWindow window_;
+  std::chrono::steady_clock::time_point deadline_;
+  uint64_t overruns_ = 0;
+  uint64_t ticks_ = 0;
+  uint64_t retry_ms_ = 100;
+  uint64_t retry_count_ = 0;
+
+  std::unique_ptr<Packet> packet_;
+  FilterConfig filter_config_;
+  std::vector<int32_t> pids_;  // of filter_config_, copied per sample
+  Stats stats_;                // reused by every sample
+  std::atomic<SampleEncoding> encoding_;
+  std::unique_ptr<Network> network_;
+  int32_t fd_ = -1;
+  uint32_t events_ = 0;
+  bool connected_ = false;
+  std::unique_ptr<SendQueue> queue_;
+  std::unique_ptr<ReplayState> replay_;
+  bool schema_sent_ = false;
+  uint64_t last_server_seen_ms_ = 0;
+  BatchPolicy batch_;
+  std::string message_;
+  std::string frame_;
+};
+
 int32_t main(int32_t argc, char **argv) {
   Arguments args;
   Cmdline cmdline;
   cmdline.add_argument('i', "ip", args.address, "127.0.0.1", "Server IP address");
   cmdline.add_argument('p', "port", args.port, 28081, "Server TCP port");
   cmdline.add_argument('l', "level", args.level, 2, "Log level: 0=ERROR, 1=INFO, 2=DEBUG");
-  cmdline.add_argument('d', "duration", args.duration, 3, "Sampling interval in seconds");
+  cmdline.add_argument('d', "duration", args.duration, 3.0, "Sampling interval in seconds, down to 0.01");
+  cmdline.add_argument('w', "wire", args.wire, "json", "Sample encoding to request: json, binary or delta");
+  cmdline.add_argument('k', "keyframe", args.keyframe, 30, "Samples between full keyframes in delta encoding");
+  cmdline.add_argument('q', "queue", args.queue, 8, "Samples buffered while the network is slow");
+  cmdline.add_argument('o', "overflow", args.overflow, "oldest",
+                       "When the sample buffer is full: oldest (drop it) or coalesce (replace the newest)");
+  cmdline.add_argument('s', "spool", args.spool, "",
+                       "File that keeps samples across disconnects and restarts for replay, empty to disable");
+  cmdline.add_argument('S', "spool-size", args.spool_size, 16, "Spool size in MiB");
+  cmdline.add_argument('r', "replay-rate", args.replay_rate, 256, "Spool replay rate limit in KiB/s");
+  cmdline.add_argument('b', "batch", args.batch, 16384, "Bytes of pending frames that trigger a write");
+  cmdline.add_argument('L', "batch-latency", args.batch_latency, 0,
+                       "Milliseconds a frame may wait for others to share its write, 0 to wait for none");
+  cmdline.add_argument('n', "nodelay", args.nodelay, 1, "Disable Nagle's algorithm on the connection: 1 or 0");
+  cmdline.add_argument('z', "compression", args.compression, "none",
+                       "Stream compression to request: none or lz");
+  cmdline.add_argument('j', "jobs", args.jobs, 1,
+                       "Threads reading procfs for each sample, 0 for one per CPU; helps with many threads");
+  cmdline.add_argument('e', "events", args.events, 1,
+                       "1 to follow process starts and exits through the kernel (needs CAP_NET_ADMIN), 0 to poll");
+  cmdline.add_argument('t', "threads", args.threads, "all",
+                       "Threads to report: all, changed, top:N or cap:N, then optional ,name=policy overrides");
+  cmdline.add_argument('m', "metrics", args.metrics, "",
+                       "Extra per-process metrics, comma separated: faults, io, switches, smaps or all");
+  cmdline.add_argument('c', "collectors", args.collectors, "",
+                       "System collectors, comma separated: pressure, loadavg, vmstat or all");
+  cmdline.add_argument('g', "intervals", args.intervals, "",
+                       "Per-group intervals in seconds overriding -d, e.g. cpu=0.1,processes=2,threads=10; groups: "
+                       "cpu, memory, processes, threads, collectors");
+  cmdline.add_argument('P', "proc-root", args.proc_root, kProcRoot,
+                       "Root of the procfs to sample, e.g. a tree recorded by scripts/capture_procfs.py");
+  cmdline.add_argument('T', "self-stats", args.self_stats, 10.0,
+                       "Seconds between reports of plotop's own CPU, memory and sampling cost, 0 to disable");
+  cmdline.add_argument('u', "cpu-percent", args.cpu_percent, 0,
+                       "1 to send per-core shares of CPU time computed on the device instead of raw counters");
+  cmdline.add_argument('W', "window", args.window, 0.0,
+                       "Seconds of samples folded into one summary of min/avg/max per core and process, sent with "
+                       "the last sample of each window; 0 sends every sample");
+  cmdline.add_argument('Q', "percentiles", args.percentiles, 0,
+                       "1 to add p50, p90 and p99 CPU shares to the window summaries");
+  cmdline.add_argument('F', "max-files", args.max_files, 0,
+                       "Raise the open file limit to this many, at most the hard limit, so more procfs files stay "
+                       "open between samples; 0 keeps the limit plotop was started with");
+  cmdline.add_argument('R', "reactor", args.reactor, 0,
+                       "1 to run everything on one epoll thread instead of one thread per task");
 
   if (!cmdline.parse(argc, argv)) {
     return 0;
   }
   Log::set_level(static_cast<Log::Level>(args.level));
+  if (args.duration < 0.01) {
+    Log::warning("Sampling interval ", args.duration, "s is below the 10 ms minimum, using 0.01");
+    args.duration = 0.01;
+  }
+  if (args.self_stats != 0 && args.self_stats < 1) {
+    Log::warning("Self stats interval ", args.self_stats, "s is below the 1 s minimum, using 10");
+    args.self_stats = 10;
+  }
+  const int32_t cpus = std::max(static_cast<int32_t>(std::thread::hardware_concurrency()), 1);
+  if (args.jobs <= 0 || args.jobs > cpus) {
+    args.jobs = cpus;
+  }
+  if (args.jobs > 1) {
+    Log::info("Reading procfs with ", args.jobs, " threads");
+  }
+  if (args.max_files > 0) {
+    raise_open_file_limit_(static_cast<rlim_t>(args.max_files));
+  }
+  PacketOptions packet_options;
+  packet_options.scan_threads = static_cast<size_t>(args.jobs);
+  packet_options.proc_events = args.events != 0;
+  packet_options.proc_root = args.proc_root;
+  packet_options.cpu_percent = args.cpu_percent != 0;
+  if (!packet_options.threads.parse(args.threads)) {
+    Log::warning("Invalid thread policy ", args.threads, ", reporting all threads");
+  }
+  if (!parse_process_metrics(args.metrics, packet_options.metrics)) {
+    Log::warning("Invalid process metrics ", args.metrics, ", collecting none");
+  }
+  if (!CollectorRegistry::parse(args.collectors, packet_options.collectors)) {
+    Log::warning("Invalid collectors ", args.collectors, ", running none");
+  }
+  GroupSchedule group_schedule(std::chrono::milliseconds(static_cast<int64_t>(args.duration * 1000 + 0.5)));
+  if (!group_schedule.parse(args.intervals)) {
+    Log::warning("Invalid group intervals ", args.intervals, ", sampling every group every ", args.duration, "s");
+  }
+  const auto interval_ms = group_schedule.tick();
+  if (args.window != 0 && std::chrono::duration<double>(args.window) < interval_ms) {
+    Log::warning("Window ", args.window, "s is shorter than the ", interval_ms.count(),
+                 " ms sampling tick, sending every sample");
+    args.window = 0;
+  }
+  if (args.window > 0) {
+    Log::info("Summarizing samples over ", args.window, "s windows");
+  }
+  const std::chrono::milliseconds window_ms(static_cast<int64_t>(args.window * 1000 + 0.5));
+  if (!args.intervals.empty()) {
+    for (size_t group = 0; group < GroupSchedule::kGroups; ++group) {
+      Log::info("Sampling ", GroupSchedule::kNames[group], " every ", group_schedule.period(group).count(), " ms");
+    }
+    Log::info("Sampling on a shared ", interval_ms.count(), " ms tick");
+  }
+  const auto drop_policy = args.overflow == "coalesce" ? DropPolicy::COALESCE : DropPolicy::DROP_OLDEST;
+  SenderOptions sender_options;
+  sender_options.replay_rate = static_cast<uint64_t>(std::max(args.replay_rate, 1)) * 1024;
+  sender_options.batch_bytes = static_cast<size_t>(std::max(args.batch, 1));
+  sender_options.batch_latency = std::chrono::milliseconds(std::max(args.batch_latency, 0));
+
+  std::unique_ptr<Spool> spool;
+  if (!args.spool.empty()) {
+    spool.reset(new Spool(args.spool, static_cast<uint64_t>(std::max(args.spool_size, 1)) << 20));
+    if (!spool->ready()) {
+      Log::error("Spool disabled");
+      spool.reset();
+    }
+  }
+  // Sequence numbers continue across reconnects and, with a spool, across restarts.
+  uint64_t sequence = spool ? spool->next_seq() : 1;
+  // While disconnected, samples keep going into the spool with the last filter the server set.
+  std::vector<int32_t> offline_pids;
+  Stats offline_stats;
+  SampleWindow offline_window(window_ms, args.percentiles != 0);
+  std::unique_ptr<Interval> offline;
+  GroupSchedule offline_schedule = group_schedule;
+
+  if (args.reactor) {
+    ReactorCollector collector(args, packet_options, sender_options, drop_policy, group_schedule, spool.get(),
+                               sequence);
+    collector.run();
+    return 0;
+  }
 
   static uint64_t retry_count = 0;
   uint64_t retry_ms = 100;
+  SelfMonitor self_monitor;
+  const auto self_stats_ms = static_cast<uint64_t>(args.self_stats * 1000 + 0.5);
 
+  // Collectors keep their files and previous values across reconnects; only the delta chain restarts.
+  std::unique_ptr<Packet> packet(new Packet(packet_options));
   do {
-    std::unique_ptr<Packet> packet(new Packet());
     std::unique_ptr<Network> network(new Network(args.address, args.port));
     if (network->ready()) {
       retry_ms = 100;
+      network->set_nodelay(args.nodelay != 0);
+      self_monitor.connected();
+      offline.reset();
+      packet->request_keyframe();
 
       FilterConfig filter_config;
       std::atomic<bool> stop_flag(false);
       std::atomic<uint64_t> last_server_seen_ms(0);
+      std::atomic<SampleEncoding> encoding(SampleEncoding::JSON);
+      bool schema_sent = false;
+      SendQueue queue(static_cast<size_t>(args.queue), drop_policy);
+      ReplayState replay;
 
       try {
-        if (packet->process_list_changed()) {
-          send_process_list_(network.get(), packet.get());
+        if (args.wire != "json" || args.compression != "none") {
+          queue.push_priority(packet->to_hello(args.wire, args.compression));
+        }
+        if (spool) {
+          queue.push_priority(packet->to_resume(spool->session(), spool->first_seq(), spool->last_seq()));
         }
+        ProcessDelta initial;
+        packet->update_process_table(initial);
+        send_process_list_(&queue, packet.get());
 
-        std::thread receiver(receiver_thread_, network.get(), packet.get(), &filter_config, &stop_flag,
-                             &last_server_seen_ms);
-        std::thread heartbeat(heartbeat_thread_, network.get(), packet.get(), &stop_flag, &last_server_seen_ms);
+        const Connection connection = {network.get(), &queue,   packet.get(), &filter_config,
+                                       spool.get(),   &replay, &encoding};
+        std::thread sender(sender_thread_, network.get(), &queue, spool.get(), &replay, sender_options, &stop_flag);
+        std::thread receiver(receiver_thread_, network.get(), connection, &stop_flag, &last_server_seen_ms);
+        std::thread heartbeat(heartbeat_thread_, &queue, packet.get(), network.get(), &self_monitor, self_stats_ms,
+                              &stop_flag, &last_server_seen_ms);
 
-        Interval interval(args.duration, [&]() {
+        // Every connection starts with a complete sample.
+        GroupSchedule connection_schedule = group_schedule;
+        SampleWindow window(window_ms, args.percentiles != 0);
+        Stats stats;
+        std::vector<int32_t> pids;
+        Interval interval(interval_ms, [&](const IntervalStatistics &schedule) {
           if (stop_flag.load()) {
             throw std::runtime_error("Stopped");
           }
+          const uint32_t due = connection_schedule.due(schedule.ticks + schedule.skipped);
+          if (due == 0) {
+            return;
+          }
+          const auto now = std::chrono::steady_clock::now();
+          const uint32_t groups = window.groups(due, now);
 
-          try {
-            if (packet->process_list_changed()) {
-              send_process_list_(network.get(), packet.get());
+          if ((groups & kGroupProcesses) && window.closing()) {
+            try {
+              send_process_delta_(&queue, packet.get());
+            } catch (const std::exception &e) {
+              Log::error("Failed to send process list: ", e.what());
             }
-          } catch (const std::exception &e) {
-            Log::error("Failed to send process list: ", e.what());
           }
 
-          Stats stats;
-          const auto pids = filter_config.get();
-          packet->collate(stats, pids);
-          network->send(packet->to_json(stats));
+          stats.jitter_us = schedule.jitter_us;
+          stats.overruns = schedule.overruns;
+          stats.dropped_samples = queue.dropped();
+          stats.coalesced_samples = queue.coalesced();
+          filter_config.get(pids);
+          const auto start = std::chrono::steady_clock::now();
+          packet->collate(stats, pids, groups);
+          window.add(stats);
+          const auto collated = std::chrono::steady_clock::now() - start;
+          if (!window.closing()) {
+            self_monitor.record_tick(collated, std::chrono::nanoseconds(0));
+            return;
+          }
+          stats.seq = sequence++;
+          const std::string summary = close_window_(&window, stats.seq, now);
+          self_monitor.record_tick(collated, push_sample_(connection, stats, schema_sent, args.keyframe, summary));
         });
 
         interval.wait();
         stop_flag.store(true);
+        queue.close();
 
+        if (sender.joinable()) {
+          sender.join();
+        }
         if (receiver.joinable()) {
           receiver.join();
         }
         if (heartbeat.joinable()) {
           heartbeat.join();
         }
+        log_batch_statistics_(network->batch_statistics());
       } catch (const std::exception &e) {
         Log::error("Connection error: ", e.what());
         stop_flag.store(true);
       }
+      filter_config.get(offline_pids);
+    }
+
+    if (spool && !offline) {
+      offline_schedule.reset();
+      offline.reset(new Interval(interval_ms, [&](const IntervalStatistics &schedule) {
+        const uint32_t due = offline_schedule.due(schedule.ticks + schedule.skipped);
+        if (due == 0) {
+          return;
+        }
+        // Summaries are not spooled; the samples closing each window are.
+        const auto now = std::chrono::steady_clock::now();
+        const uint32_t groups = offline_window.groups(due, now);
+        auto &stats = offline_stats;
+        stats.jitter_us = schedule.jitter_us;
+        stats.overruns = schedule.overruns;
+        stats.dropped_samples = 0;
+        stats.coalesced_samples = 0;
+        const auto start = std::chrono::steady_clock::now();
+        packet->collate(stats, offline_pids, groups);
+        offline_window.add(stats);
+        const auto collated = std::chrono::steady_clock::now();
+        if (offline_window.closing()) {
+          stats.seq = sequence++;
+          spool->append(stats.seq, packet->to_binary(stats), packet->to_schema());
+          offline_window.reset(now);
+        }
+        self_monitor.record_tick(collated - start, std::chrono::steady_clock::now() - collated);
+      }));
     }
 
     Log::info("Retrying ", ++retry_count, " times");
@@ -1,18 +1,54 @@
 #ifndef PLOTOP_NETWORK_H
 #define PLOTOP_NETWORK_H
 
+#include <cstdint>
 #include <memory>
 #include <string>
 
+// How many frames each flush carried, to tune the batching thresholds against.
+struct BatchStatistics {
+  static constexpr size_t kBuckets = 7;
+
+  uint64_t flushes;
+  uint64_t frames;
+  uint64_t bytes;
+  uint64_t wire_bytes;  // after compression
+  uint64_t histogram[kBuckets];  // flushes of 1, 2, 3-4, 5-8, 9-16, 17-32 and 33+ frames
+};
+
 class Network {
  public:
-  Network(const std::string &address, int32_t port);
+  // A non-blocking network connects in the background (see connecting()) and its flush() and poll() return
+  // instead of waiting on the socket; it is meant to be driven by a Reactor.
+  Network(const std::string &address, int32_t port, bool blocking = true);
   ~Network();
 
  public:
   void send(const std::string &data);
+  // Takes the contents of data into the pending batch, leaving data with a spare buffer; nothing reaches
+  // the socket until flush().
+  void write(std::string &data);
+  // Sends the pending batch with a single vectored write, retrying partial writes. Returns false when a
+  // non-blocking socket is full; the rest goes out on the next flush().
+  bool flush();
+  // Bytes written but not yet sent.
+  size_t pending() const;
+  // Whether the last flush() stopped on a full socket.
+  bool blocked() const;
+  void set_nodelay(bool enabled);
+  // Compresses every batch flushed from now on into one COMPRESSED frame, sharing a window across batches.
+  void set_compression(bool enabled);
+  // Never waits for a write in progress, so any thread may read it while the socket is stalled.
+  BatchStatistics batch_statistics() const;
   std::string recv();
+  // Non-blocking counterpart of recv(): false once no complete message is buffered and the socket has
+  // nothing more to read.
+  bool poll(std::string &message);
   bool ready() const;
+  bool connecting() const;
+  // Completes a background connect once the socket reports writable; false if it failed.
+  bool finish_connect();
+  int32_t fd() const;
 
  private:
   class ImplNetwork;
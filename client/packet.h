@@ -1,13 +1,21 @@
 #ifndef PLOTOP_PACKET_H
 #define PLOTOP_PACKET_H
 
+#include <algorithm>
 #include <chrono>
 #include <list>
 #include <memory>
 #include <string>
+#include <string_view>
+#include <utility>
+#include <vector>
 
+#include "collector.h"
 #include "jsonify.h"
 #include "log.h"
+#include "self_stats.h"
+#include "thread_policy.h"
+#include "wire.h"
 
 struct Thread {
   int32_t tid;
@@ -15,140 +23,783 @@ struct Thread {
   uint64_t cpu_user;
   uint64_t cpu_system;
 };
+// Optional per-process metric groups. Each costs its own reads and is only collected, serialized and
+// listed in the wire schema when enabled in PacketOptions::metrics.
+enum ProcessMetric : uint32_t {
+  kMetricFaults = 1 << 0,            // minor and major page faults, from stat
+  kMetricIo = 1 << 1,                // bytes read from and written to storage, from io
+  kMetricContextSwitches = 1 << 2,   // voluntary and involuntary context switches, from status
+  kMetricSmaps = 1 << 3,             // proportional set size and swap in kB, from smaps_rollup
+};
+
+// Parses a comma separated list of "faults", "io", "switches", "smaps" or "all"; empty enables none.
+inline bool parse_process_metrics(std::string_view text, uint32_t &metrics) {
+  uint32_t result = 0;
+  while (!text.empty()) {
+    const auto comma = text.find(',');
+    const auto name = text.substr(0, comma);
+    text.remove_prefix(comma == std::string_view::npos ? text.size() : comma + 1);
+    if (name == "faults") {
+      result |= kMetricFaults;
+    } else if (name == "io") {
+      result |= kMetricIo;
+    } else if (name == "switches") {
+      result |= kMetricContextSwitches;
+    } else if (name == "smaps") {
+      result |= kMetricSmaps;
+    } else if (name == "all") {
+      result |= kMetricFaults | kMetricIo | kMetricContextSwitches | kMetricSmaps;
+    } else {
+      return false;
+    }
+  }
+  metrics = result;
+  return true;
+}
+
 struct Process {
   int32_t pid;
   std::string name;
   uint64_t memory;
   uint64_t cpu_user;
   uint64_t cpu_system;
-  std::list<Thread> threads;
+  std::vector<Thread> threads;  // sorted by tid
+  bool has_threads = true;  // false in samples without the threads group; threads is empty then
+  uint32_t metrics = 0;  // ProcessMetric groups present below; zero where the file could not be read
+  uint64_t minor_faults = 0;
+  uint64_t major_faults = 0;
+  uint64_t read_bytes = 0;
+  uint64_t write_bytes = 0;
+  uint64_t voluntary_switches = 0;
+  uint64_t involuntary_switches = 0;
+  uint64_t pss = 0;
+  uint64_t swap = 0;
 };
+// A process that exited since the previous sample, with the CPU time it used over its whole life.
+struct ExitedProcess {
+  int32_t pid;
+  std::string name;
+  uint64_t cpu_user;
+  uint64_t cpu_system;
+};
+struct MemInfo {
+  uint64_t total;
+  uint64_t free;
+  uint64_t available;
+  uint64_t buffers;
+  uint64_t cached;
+  uint64_t swap_cached;
+  uint64_t swap_total;
+  uint64_t swap_free;
+  uint64_t dirty;
+  uint64_t writeback;
+  uint64_t shmem;
+  uint64_t slab;
+  uint64_t slab_reclaimable;
+};
+// Parts of a sample that are collected on their own schedule. A sample carries the groups that were due,
+// and the server merges such partial samples into the last complete one.
+enum SampleGroup : uint32_t {
+  kGroupCpu = 1 << 0,         // processor_frequency and the per-core cpu_* counters
+  kGroupMemory = 1 << 1,      // the *_memory and swap_* fields
+  kGroupProcesses = 1 << 2,   // processes and exited, without threads unless kGroupThreads is set too
+  kGroupThreads = 1 << 3,     // the threads of each process
+  kGroupCollectors = 1 << 4,  // the fields of the enabled collectors
+  kGroupAll = (1 << 5) - 1,
+};
+// Meant to be kept and passed to every collate(): the containers are refilled in place, so once they have
+// grown to the size of a sample, collecting one allocates nothing.
 struct Stats {
-  std::list<uint64_t> processor_frequency;
-  std::list<uint64_t> cpu_user;
-  std::list<uint64_t> cpu_system;
-  std::list<uint64_t> cpu_idle;
-  std::list<uint64_t> cpu_iowait;
-  std::list<uint64_t> cpu_irq;
-  std::list<uint64_t> cpu_softirq;
-  uint64_t total_memory;
-  uint64_t free_memory;
-  std::list<Process> processes;
+  uint32_t groups = kGroupAll;  // SampleGroup parts present; the fields of the others are left empty
+  std::vector<uint64_t> processor_frequency;
+  std::vector<uint64_t> cpu_user;
+  std::vector<uint64_t> cpu_system;
+  std::vector<uint64_t> cpu_idle;
+  std::vector<uint64_t> cpu_iowait;
+  std::vector<uint64_t> cpu_irq;
+  std::vector<uint64_t> cpu_softirq;
+  // With PacketOptions::cpu_percent the cpu group carries, instead of the counters above, the share of
+  // the time elapsed since the previous sample that each line spent in each state, in hundredths of a
+  // percent. Index 0 is all cores together, as with the counters; user includes nice.
+  bool cpu_percent = false;
+  uint64_t cpu_elapsed = 0;  // clock ticks summed over all cores since the previous sample
+  std::vector<uint64_t> cpu_user_percent;
+  std::vector<uint64_t> cpu_system_percent;
+  std::vector<uint64_t> cpu_iowait_percent;
+  std::vector<uint64_t> cpu_irq_percent;
+  std::vector<uint64_t> cpu_softirq_percent;
+  std::vector<uint64_t> cpu_steal_percent;
+  MemInfo memory;
+  std::vector<Process> processes;     // sorted by pid
+  std::vector<ExitedProcess> exited;  // sorted by pid
+  std::vector<Collected> collected;  // one entry per enabled collector, always in the same order
+  uint64_t seq;
+  int64_t jitter_us;
+  uint64_t overruns;
+  uint64_t dropped_samples;
+  uint64_t coalesced_samples;
 };
 
-inline Jsonify &to_jsonify(Jsonify &jsonify, const Thread &thread) {
-  jsonify["tid"] = thread.tid;
-  jsonify["priority"] = thread.priority;
-  jsonify["cpu_user"] = thread.cpu_user;
-  jsonify["cpu_system"] = thread.cpu_system;
-  return jsonify;
+inline int64_t timestamp_ms() {
+  const auto ts = std::chrono::steady_clock::now();
+  return std::chrono::duration_cast<std::chrono::milliseconds>(ts.time_since_epoch()).count();
 }
 
-inline Jsonify &to_jsonify(Jsonify &jsonify, const Process &process) {
-  jsonify["pid"] = process.pid;
-  jsonify["name"] = process.name;
-  jsonify["memory"] = process.memory;
-  jsonify["cpu_user"] = process.cpu_user;
-  jsonify["cpu_system"] = process.cpu_system;
-  jsonify["threads"] = process.threads;
-  return jsonify;
+inline JsonWriter &to_jsonify(JsonWriter &jsonify, const Thread &thread) {
+  jsonify.begin_object();
+  jsonify.field("tid", thread.tid);
+  jsonify.field("priority", thread.priority);
+  jsonify.field("cpu_user", thread.cpu_user);
+  jsonify.field("cpu_system", thread.cpu_system);
+  return jsonify.end_object();
 }
 
-inline Jsonify &to_jsonify(Jsonify &jsonify, const Stats &stats) {
-  const auto ts = std::chrono::steady_clock::now();
-  const auto ts_ms = std::chrono::duration_cast<std::chrono::milliseconds>(ts.time_since_epoch()).count();
-  jsonify["timestamp"] = ts_ms;
-  jsonify["processor_frequency"] = stats.processor_frequency;
-  jsonify["cpu_user"] = stats.cpu_user;
-  jsonify["cpu_system"] = stats.cpu_system;
-  jsonify["cpu_idle"] = stats.cpu_idle;
-  jsonify["cpu_iowait"] = stats.cpu_iowait;
-  jsonify["cpu_irq"] = stats.cpu_irq;
-  jsonify["cpu_softirq"] = stats.cpu_softirq;
-  jsonify["total_memory"] = stats.total_memory;
-  jsonify["free_memory"] = stats.free_memory;
-  jsonify["processes"] = stats.processes;
+inline JsonWriter &to_jsonify(JsonWriter &jsonify, const Process &process) {
+  jsonify.begin_object();
+  jsonify.field("pid", process.pid);
+  jsonify.field("name", process.name);
+  jsonify.field("memory", process.memory);
+  jsonify.field("cpu_user", process.cpu_user);
+  jsonify.field("cpu_system", process.cpu_system);
+  if (process.has_threads) {
+    jsonify.field("threads", process.threads);
+  }
+  if (process.metrics & kMetricFaults) {
+    jsonify.field("minor_faults", process.minor_faults);
+    jsonify.field("major_faults", process.major_faults);
+  }
+  if (process.metrics & kMetricIo) {
+    jsonify.field("read_bytes", process.read_bytes);
+    jsonify.field("write_bytes", process.write_bytes);
+  }
+  if (process.metrics & kMetricContextSwitches) {
+    jsonify.field("voluntary_switches", process.voluntary_switches);
+    jsonify.field("involuntary_switches", process.involuntary_switches);
+  }
+  if (process.metrics & kMetricSmaps) {
+    jsonify.field("pss", process.pss);
+    jsonify.field("swap", process.swap);
+  }
+  return jsonify.end_object();
+}
+
+inline JsonWriter &to_jsonify(JsonWriter &jsonify, const ExitedProcess &process) {
+  jsonify.begin_object();
+  jsonify.field("pid", process.pid);
+  jsonify.field("name", process.name);
+  jsonify.field("cpu_user", process.cpu_user);
+  jsonify.field("cpu_system", process.cpu_system);
+  return jsonify.end_object();
+}
+
+// Members of a stats object, shared by to_jsonify and Packet::to_json which prepends the message type.
+inline JsonWriter &to_jsonify_fields(JsonWriter &jsonify, const Stats &stats) {
+  jsonify.field("timestamp", timestamp_ms());
+  jsonify.field("seq", stats.seq);
+  jsonify.field("jitter_us", stats.jitter_us);
+  jsonify.field("overruns", stats.overruns);
+  jsonify.field("dropped_samples", stats.dropped_samples);
+  jsonify.field("coalesced_samples", stats.coalesced_samples);
+  jsonify.field("groups", stats.groups);
+  if ((stats.groups & kGroupCpu) && stats.cpu_percent) {
+    jsonify.field("processor_frequency", stats.processor_frequency);
+    jsonify.field("cpu_elapsed", stats.cpu_elapsed);
+    jsonify.field("cpu_user_percent", stats.cpu_user_percent);
+    jsonify.field("cpu_system_percent", stats.cpu_system_percent);
+    jsonify.field("cpu_iowait_percent", stats.cpu_iowait_percent);
+    jsonify.field("cpu_irq_percent", stats.cpu_irq_percent);
+    jsonify.field("cpu_softirq_percent", stats.cpu_softirq_percent);
+    jsonify.field("cpu_steal_percent", stats.cpu_steal_percent);
+  } else if (stats.groups & kGroupCpu) {
+    jsonify.field("processor_frequency", stats.processor_frequency);
+    jsonify.field("cpu_user", stats.cpu_user);
+    jsonify.field("cpu_system", stats.cpu_system);
+    jsonify.field("cpu_idle", stats.cpu_idle);
+    jsonify.field("cpu_iowait", stats.cpu_iowait);
+    jsonify.field("cpu_irq", stats.cpu_irq);
+    jsonify.field("cpu_softirq", stats.cpu_softirq);
+  }
+  if (stats.groups & kGroupMemory) {
+    jsonify.field("total_memory", stats.memory.total);
+    jsonify.field("free_memory", stats.memory.free);
+    jsonify.field("available_memory", stats.memory.available);
+    jsonify.field("buffers_memory", stats.memory.buffers);
+    jsonify.field("cached_memory", stats.memory.cached);
+    jsonify.field("swap_cached_memory", stats.memory.swap_cached);
+    jsonify.field("swap_total", stats.memory.swap_total);
+    jsonify.field("swap_free", stats.memory.swap_free);
+    jsonify.field("dirty_memory", stats.memory.dirty);
+    jsonify.field("writeback_memory", stats.memory.writeback);
+    jsonify.field("shared_memory", stats.memory.shmem);
+    jsonify.field("slab_memory", stats.memory.slab);
+    jsonify.field("slab_reclaimable_memory", stats.memory.slab_reclaimable);
+  }
+  if (stats.groups & kGroupProcesses) {
+    jsonify.field("processes", stats.processes);
+    jsonify.field("exited", stats.exited);
+  }
+  if (stats.groups & kGroupCollectors) {
+    for (const auto &collected : stats.collected) {
+      jsonify.field(collected.spec->name, collected);
+    }
+  }
   return jsonify;
 }
 
+inline JsonWriter &to_jsonify(JsonWriter &jsonify, const Stats &stats) {
+  jsonify.begin_object();
+  to_jsonify_fields(jsonify, stats);
+  return jsonify.end_object();
+}
+
+// Binary encoding of the same structures. The field order must match wire_schema(), which the server
+// uses to decode positional samples back into the JSON layout above. Types: "u" unsigned varint,
+// "i" zigzag varint, "c" cumulative counter (unsigned in keyframes, zigzag difference in deltas),
+// "s" length-prefixed string, "<type>[]" count-prefixed array. The first field of a record is its key.
+// A third element names the SampleGroup of a field; it is only present when the stats "groups" field has
+// that group's bit, per "groups" below.
+static constexpr const char *kWireSchemaHead =
+    R"({"version":8,)"
+    R"("groups":{"cpu":1,"memory":2,"processes":4,"threads":8,"collectors":16},)"
+    R"("thread":[["tid","i"],["priority","i"],["cpu_user","c"],["cpu_system","c"]],)"
+    R"("process":[["pid","i"],["name","s"],["memory","u"],["cpu_user","c"],["cpu_system","c"],)"
+    R"(["threads","thread[]","threads"])";
+
+// Process fields of each enabled metric group, appended in ProcessMetric order.
+static constexpr std::pair<uint32_t, const char *> kWireProcessMetrics[] = {
+    {kMetricFaults, R"(,["minor_faults","c"],["major_faults","c"])"},
+    {kMetricIo, R"(,["read_bytes","c"],["write_bytes","c"])"},
+    {kMetricContextSwitches, R"(,["voluntary_switches","c"],["involuntary_switches","c"])"},
+    {kMetricSmaps, R"(,["pss","u"],["swap","u"])"},
+};
+
+static constexpr const char *kWireSchemaExited =
+    R"(],)"
+    R"("exited":[["pid","i"],["name","s"],["cpu_user","u"],["cpu_system","u"]],)";
+
+// Collector records go between the exited and stats records, and a field per collector ends the stats.
+static constexpr const char *kWireSchemaStats =
+    R"("stats":[["timestamp","i"],["seq","u"],["jitter_us","i"],["overruns","u"],)"
+    R"(["dropped_samples","u"],["coalesced_samples","u"],["groups","u"],)"
+    R"(["processor_frequency","u[]","cpu"],)";
+
+// The cpu fields of the stats record, raw counters or, with PacketOptions::cpu_percent, shares.
+static constexpr const char *kWireSchemaCpuCounters =
+    R"(["cpu_user","c[]","cpu"],["cpu_system","c[]","cpu"],)"
+    R"(["cpu_idle","c[]","cpu"],["cpu_iowait","c[]","cpu"],["cpu_irq","c[]","cpu"],["cpu_softirq","c[]","cpu"],)";
+static constexpr const char *kWireSchemaCpuPercent =
+    R"(["cpu_elapsed","u","cpu"],["cpu_user_percent","u[]","cpu"],["cpu_system_percent","u[]","cpu"],)"
+    R"(["cpu_iowait_percent","u[]","cpu"],["cpu_irq_percent","u[]","cpu"],["cpu_softirq_percent","u[]","cpu"],)"
+    R"(["cpu_steal_percent","u[]","cpu"],)";
+
+static constexpr const char *kWireSchemaStatsTail =
+    R"(["total_memory","u","memory"],["free_memory","u","memory"],["available_memory","u","memory"],)"
+    R"(["buffers_memory","u","memory"],["cached_memory","u","memory"],["swap_cached_memory","u","memory"],)"
+    R"(["swap_total","u","memory"],["swap_free","u","memory"],["dirty_memory","u","memory"],)"
+    R"(["writeback_memory","u","memory"],["shared_memory","u","memory"],["slab_memory","u","memory"],)"
+    R"(["slab_reclaimable_memory","u","memory"],)"
+    R"(["processes","process[]","processes"],["exited","exited[]","processes"])";
+
+inline std::string wire_schema(uint32_t metrics, bool cpu_percent,
+                               const std::vector<const CollectorSpec *> &collectors) {
+  std::string schema(kWireSchemaHead);
+  for (const auto &[metric, fields] : kWireProcessMetrics) {
+    if (metrics & metric) {
+      schema.append(fields);
+    }
+  }
+  schema.append(kWireSchemaExited);
+  for (const auto *spec : collectors) {
+    append_wire_record(schema, *spec).append(",");
+  }
+  schema.append(kWireSchemaStats);
+  schema.append(cpu_percent ? kWireSchemaCpuPercent : kWireSchemaCpuCounters);
+  schema.append(kWireSchemaStatsTail);
+  for (const auto *spec : collectors) {
+    schema.append(",[\"").append(spec->name).append("\",\"").append(spec->name).append("\",\"collectors\"]");
+  }
+  return schema.append("]}");
+}
+
+inline WireWriter &to_wire(WireWriter &wire, const Thread &thread) {
+  wire.write(thread.tid);
+  wire.write(thread.priority);
+  wire.write(thread.cpu_user);
+  wire.write(thread.cpu_system);
+  return wire;
+}
+
+// Fields of the enabled metric groups, counters as differences when previous is given.
+inline void to_wire_metrics(WireWriter &wire, const Process &process, const Process *previous) {
+  const auto counter = [&](uint64_t value, uint64_t Process::*member) {
+    if (previous) {
+      wire.write_delta(value, previous->*member);
+    } else {
+      wire.write(value);
+    }
+  };
+  if (process.metrics & kMetricFaults) {
+    counter(process.minor_faults, &Process::minor_faults);
+    counter(process.major_faults, &Process::major_faults);
+  }
+  if (process.metrics & kMetricIo) {
+    counter(process.read_bytes, &Process::read_bytes);
+    counter(process.write_bytes, &Process::write_bytes);
+  }
+  if (process.metrics & kMetricContextSwitches) {
+    counter(process.voluntary_switches, &Process::voluntary_switches);
+    counter(process.involuntary_switches, &Process::involuntary_switches);
+  }
+  if (process.metrics & kMetricSmaps) {
+    wire.write(process.pss);
+    wire.write(process.swap);
+  }
+}
+
+inline WireWriter &to_wire(WireWriter &wire, const Process &process) {
+  wire.write(process.pid);
+  wire.write(process.name);
+  wire.write(process.memory);
+  wire.write(process.cpu_user);
+  wire.write(process.cpu_system);
+  if (process.has_threads) {
+    wire.write(process.threads);
+  }
+  to_wire_metrics(wire, process, nullptr);
+  return wire;
+}
+
+inline WireWriter &to_wire(WireWriter &wire, const ExitedProcess &process) {
+  wire.write(process.pid);
+  wire.write(process.name);
+  wire.write(process.cpu_user);
+  wire.write(process.cpu_system);
+  return wire;
+}
+
+inline int64_t wire_key(const Thread &thread) { return thread.tid; }
+inline int64_t wire_key(const Process &process) { return process.pid; }
+inline int64_t wire_key(const ExitedProcess &process) { return process.pid; }
+
+inline bool wire_equal(const Thread &a, const Thread &b) {
+  return a.tid == b.tid && a.priority == b.priority && a.cpu_user == b.cpu_user && a.cpu_system == b.cpu_system;
+}
+
+inline bool wire_equal(const Process &a, const Process &b) {
+  if (a.pid != b.pid || a.memory != b.memory || a.cpu_user != b.cpu_user || a.cpu_system != b.cpu_system ||
+      a.name != b.name || (a.has_threads && a.threads.size() != b.threads.size())) {
+    return false;
+  }
+  if (a.minor_faults != b.minor_faults || a.major_faults != b.major_faults || a.read_bytes != b.read_bytes ||
+      a.write_bytes != b.write_bytes || a.voluntary_switches != b.voluntary_switches ||
+      a.involuntary_switches != b.involuntary_switches || a.pss != b.pss || a.swap != b.swap) {
+    return false;
+  }
+  return !a.has_threads || std::equal(a.threads.begin(), a.threads.end(), b.threads.begin(),
+                                     [](const Thread &x, const Thread &y) { return wire_equal(x, y); });
+}
+
+inline bool wire_equal(const ExitedProcess &a, const ExitedProcess &b) {
+  return a.pid == b.pid && a.cpu_user == b.cpu_user && a.cpu_system == b.cpu_system && a.name == b.name;
+}
+
+inline WireWriter &to_wire_delta(WireWriter &wire, const Thread &thread, const Thread &previous) {
+  wire.write(thread.tid);
+  wire.write(thread.priority);
+  wire.write_delta(thread.cpu_user, previous.cpu_user);
+  wire.write_delta(thread.cpu_system, previous.cpu_system);
+  return wire;
+}
+
+inline WireWriter &to_wire_delta(WireWriter &wire, const Process &process, const Process &previous) {
+  wire.write(process.pid);
+  wire.write(process.name);
+  wire.write(process.memory);
+  wire.write_delta(process.cpu_user, previous.cpu_user);
+  wire.write_delta(process.cpu_system, previous.cpu_system);
+  if (process.has_threads) {
+    wire.write_records_delta(process.threads, previous.threads);
+  }
+  to_wire_metrics(wire, process, &previous);
+  return wire;
+}
+
+// Exited processes hold no counters, so a changed record is written whole.
+inline WireWriter &to_wire_delta(WireWriter &wire, const ExitedProcess &process, const ExitedProcess &) {
+  return to_wire(wire, process);
+}
+
+// Memory fields of a sample; gauges, so keyframes and deltas encode them alike.
+inline WireWriter &to_wire(WireWriter &wire, const MemInfo &memory) {
+  wire.write(memory.total);
+  wire.write(memory.free);
+  wire.write(memory.available);
+  wire.write(memory.buffers);
+  wire.write(memory.cached);
+  wire.write(memory.swap_cached);
+  wire.write(memory.swap_total);
+  wire.write(memory.swap_free);
+  wire.write(memory.dirty);
+  wire.write(memory.writeback);
+  wire.write(memory.shmem);
+  wire.write(memory.slab);
+  wire.write(memory.slab_reclaimable);
+  return wire;
+}
+
+// Shares of the cpu group; gauges, so keyframes and deltas encode them alike.
+inline WireWriter &to_wire_cpu_percent(WireWriter &wire, const Stats &stats) {
+  wire.write(stats.cpu_elapsed);
+  wire.write(stats.cpu_user_percent);
+  wire.write(stats.cpu_system_percent);
+  wire.write(stats.cpu_iowait_percent);
+  wire.write(stats.cpu_irq_percent);
+  wire.write(stats.cpu_softirq_percent);
+  wire.write(stats.cpu_steal_percent);
+  return wire;
+}
+
+inline WireWriter &to_wire(WireWriter &wire, const Stats &stats) {
+  wire.write(timestamp_ms());
+  wire.write(stats.seq);
+  wire.write(stats.jitter_us);
+  wire.write(stats.overruns);
+  wire.write(stats.dropped_samples);
+  wire.write(stats.coalesced_samples);
+  wire.write(stats.groups);
+  if ((stats.groups & kGroupCpu) && stats.cpu_percent) {
+    wire.write(stats.processor_frequency);
+    to_wire_cpu_percent(wire, stats);
+  } else if (stats.groups & kGroupCpu) {
+    wire.write(stats.processor_frequency);
+    wire.write(stats.cpu_user);
+    wire.write(stats.cpu_system);
+    wire.write(stats.cpu_idle);
+    wire.write(stats.cpu_iowait);
+    wire.write(stats.cpu_irq);
+    wire.write(stats.cpu_softirq);
+  }
+  if (stats.groups & kGroupMemory) {
+    wire.write(stats.memory);
+  }
+  if (stats.groups & kGroupProcesses) {
+    wire.write(stats.processes);
+    wire.write(stats.exited);
+  }
+  if (stats.groups & kGroupCollectors) {
+    for (const auto &collected : stats.collected) {
+      to_wire(wire, collected);
+    }
+  }
+  return wire;
+}
+
+// previous holds the last values of every group in stats (see Packet::to_delta).
+inline WireWriter &to_wire_delta(WireWriter &wire, const Stats &stats, const Stats &previous) {
+  wire.write(timestamp_ms());
+  wire.write(stats.seq);
+  wire.write(stats.jitter_us);
+  wire.write(stats.overruns);
+  wire.write(stats.dropped_samples);
+  wire.write(stats.coalesced_samples);
+  wire.write(stats.groups);
+  if ((stats.groups & kGroupCpu) && stats.cpu_percent) {
+    wire.write(stats.processor_frequency);
+    to_wire_cpu_percent(wire, stats);
+  } else if (stats.groups & kGroupCpu) {
+    wire.write(stats.processor_frequency);
+    wire.write_delta(stats.cpu_user, previous.cpu_user);
+    wire.write_delta(stats.cpu_system, previous.cpu_system);
+    wire.write_delta(stats.cpu_idle, previous.cpu_idle);
+    wire.write_delta(stats.cpu_iowait, previous.cpu_iowait);
+    wire.write_delta(stats.cpu_irq, previous.cpu_irq);
+    wire.write_delta(stats.cpu_softirq, previous.cpu_softirq);
+  }
+  if (stats.groups & kGroupMemory) {
+    wire.write(stats.memory);
+  }
+  if (stats.groups & kGroupProcesses) {
+    wire.write_records_delta(stats.processes, previous.processes);
+    wire.write_records_delta(stats.exited, previous.exited);
+  }
+  if (stats.groups & kGroupCollectors) {
+    for (size_t i = 0; i < stats.collected.size(); ++i) {
+      to_wire_delta(wire, stats.collected[i], previous.collected[i]);
+    }
+  }
+  return wire;
+}
+
 struct ProcessInfo {
   int32_t pid;
   std::string name;
 };
 
-inline Jsonify &to_jsonify(Jsonify &jsonify, const ProcessInfo &item) {
-  jsonify["pid"] = item.pid;
-  jsonify["name"] = item.name;
-  return jsonify;
+inline JsonWriter &to_jsonify(JsonWriter &jsonify, const ProcessInfo &item) {
+  jsonify.begin_object();
+  jsonify.field("pid", item.pid);
+  jsonify.field("name", item.name);
+  return jsonify.end_object();
 }
 
+static constexpr const char *kProcRoot = "/proc";
+
+// Collection settings fixed for the lifetime of a Packet.
+struct PacketOptions {
+  size_t scan_threads = 1;   // > 1 spreads the per-process procfs reads of collate() over that many threads
+  bool proc_events = false;  // follow process starts and exits through the kernel where permitted
+  ThreadPolicies threads;
+  uint32_t metrics = 0;  // ProcessMetric groups to collect
+  std::vector<std::string> collectors;  // CollectorRegistry names, sampled in this order
+  std::string proc_root = kProcRoot;    // procfs to read, e.g. a tree recorded by scripts/capture_procfs.py
+  bool cpu_percent = false;             // send per-core shares of CPU time instead of raw counters
+};
+
+// Difference between two generations of the process table.
+struct ProcessDelta {
+  std::list<ProcessInfo> added;
+  std::list<int32_t> removed;
+};
+
 class Packet {
  public:
-  Packet();
+  explicit Packet(const PacketOptions &options = PacketOptions());
   ~Packet();
 
  public:
-  void collate(Stats &, const std::list<int32_t> &);
+  // Collects the given SampleGroup parts into stats and sets stats.groups.
+  void collate(Stats &, const std::vector<int32_t> &, uint32_t groups = kGroupAll);
+  // Fills in the CPU time, RSS and procfs file counters of the collector itself, as totals since it
+  // started. Unlike collate() it may be called from any thread.
+  void collate_self(SelfStats &) const;
 
  public:
-  std::string to_json(const Stats &stats) const {
-    const auto ts = std::chrono::steady_clock::now();
-    const auto ts_ms = std::chrono::duration_cast<std::chrono::milliseconds>(ts.time_since_epoch()).count();
-    Jsonify jsonify;
-    jsonify["type"] = "stats";
-    jsonify["timestamp"] = ts_ms;
-    jsonify["processor_frequency"] = stats.processor_frequency;
-    jsonify["cpu_user"] = stats.cpu_user;
-    jsonify["cpu_system"] = stats.cpu_system;
-    jsonify["cpu_idle"] = stats.cpu_idle;
-    jsonify["cpu_iowait"] = stats.cpu_iowait;
-    jsonify["cpu_irq"] = stats.cpu_irq;
-    jsonify["cpu_softirq"] = stats.cpu_softirq;
-    jsonify["total_memory"] = stats.total_memory;
-    jsonify["free_memory"] = stats.free_memory;
-    jsonify["processes"] = stats.processes;
-    return jsonify.to_string() + "\n";
+  // Serializes into a buffer owned by the packet and reused across samples; only the sampling
+  // thread may call it, and the result is valid until the next call.
+  const std::string &to_json(const Stats &stats) {
+    sample_buffer_.clear();
+    JsonWriter jsonify(sample_buffer_);
+    jsonify.begin_object();
+    jsonify.field("type", "stats");
+    to_jsonify_fields(jsonify, stats);
+    jsonify.end_object();
+    sample_buffer_.push_back('\n');
+    return sample_buffer_;
   }
 
-  std::string to_heartbeat() const {
-    const auto ts = std::chrono::steady_clock::now();
-    const auto ts_ms = std::chrono::duration_cast<std::chrono::milliseconds>(ts.time_since_epoch()).count();
-    Jsonify jsonify;
-    jsonify["type"] = "heartbeat";
-    jsonify["timestamp"] = ts_ms;
-    return jsonify.to_string() + "\n";
-  }
-
-  std::string to_process_list(const std::list<std::pair<int32_t, std::string>> &processes) const {
-    const auto ts = std::chrono::steady_clock::now();
-    const auto ts_ms = std::chrono::duration_cast<std::chrono::milliseconds>(ts.time_since_epoch()).count();
-    std::list<ProcessInfo> items;
-    for (const auto &process : processes) {
-      items.push_back({process.first, process.second});
+  // Binary counterpart of to_json(), same buffer and threading rules.
+  const std::string &to_binary(const Stats &stats) {
+    sample_buffer_.clear();
+    const auto frame = WireWriter::begin_frame(sample_buffer_, WireKind::STATS);
+    WireWriter wire(sample_buffer_);
+    to_wire(wire, stats);
+    WireWriter::end_frame(sample_buffer_, frame);
+    return sample_buffer_;
+  }
+
+  // Delta-encoded sample against the last values of each group it carries. A keyframe (plain STATS frame)
+  // goes out first, every keyframe_interval samples, whenever the number of cores changes and whenever a
+  // group was not part of the last keyframe.
+  const std::string &to_delta(const Stats &stats, int32_t keyframe_interval) {
+    const bool keyframe = (stats.groups & ~previous_groups_) != 0 || since_keyframe_ + 1 >= keyframe_interval ||
+                          ((stats.groups & kGroupCpu) && stats.cpu_user.size() != previous_.cpu_user.size()) ||
+                          ((stats.groups & kGroupCollectors) && stats.collected.size() != previous_.collected.size());
+    if (keyframe) {
+      to_binary(stats);
+      since_keyframe_ = 0;
+    } else {
+      sample_buffer_.clear();
+      const auto frame = WireWriter::begin_frame(sample_buffer_, WireKind::STATS_DELTA);
+      WireWriter wire(sample_buffer_);
+      to_wire_delta(wire, stats, previous_);
+      WireWriter::end_frame(sample_buffer_, frame);
+      ++since_keyframe_;
     }
-    Jsonify jsonify;
-    jsonify["type"] = "process_list";
-    jsonify["timestamp"] = ts_ms;
-    jsonify["processes"] = items;
-    return jsonify.to_string() + "\n";
+    remember_(stats, keyframe);
+    return sample_buffer_;
+  }
+
+  // Makes the next to_delta() call emit a keyframe.
+  void request_keyframe() { previous_groups_ = 0; }
+
+  // The SCHEMA frame binary and delta samples are encoded against, fixed once the collectors initialized.
+  const std::string &to_schema() const { return schema_; }
+
+  // Announces the sample encoding and stream compression this collector would like; the server answers
+  // with hello_ack naming what it accepted.
+  std::string to_hello(const std::string &protocol, const std::string &compression) const {
+    std::string json;
+    JsonWriter jsonify(json);
+    jsonify.begin_object();
+    jsonify.field("type", "hello");
+    jsonify.field("timestamp", timestamp_ms());
+    jsonify.field("protocol", protocol);
+    jsonify.field("compression", compression);
+    jsonify.field("version", 1);
+    jsonify.end_object();
+    return json + "\n";
+  }
+
+  // Offers the spooled range [first_seq, last_seq] of a session; the server answers with resume_ack
+  // listing the sequence ranges it is missing.
+  std::string to_resume(const std::string &session, uint64_t first_seq, uint64_t last_seq) const {
+    std::string json;
+    JsonWriter jsonify(json);
+    jsonify.begin_object();
+    jsonify.field("type", "resume");
+    jsonify.field("timestamp", timestamp_ms());
+    jsonify.field("session", session);
+    jsonify.field("first_seq", first_seq);
+    jsonify.field("last_seq", last_seq);
+    jsonify.end_object();
+    return json + "\n";
+  }
+
+  std::string to_heartbeat() const {
+    std::string json;
+    JsonWriter jsonify(json);
+    jsonify.begin_object();
+    jsonify.field("type", "heartbeat");
+    jsonify.field("timestamp", timestamp_ms());
+    jsonify.end_object();
+    return json + "\n";
+  }
+
+  std::string to_process_list(const std::list<ProcessInfo> &processes) const {
+    std::string json;
+    JsonWriter jsonify(json);
+    jsonify.begin_object();
+    jsonify.field("type", "process_list");
+    jsonify.field("timestamp", timestamp_ms());
+    jsonify.field("processes", processes);
+    jsonify.end_object();
+    return json + "\n";
+  }
+
+  std::string to_process_added(const std::list<ProcessInfo> &processes) const {
+    std::string json;
+    JsonWriter jsonify(json);
+    jsonify.begin_object();
+    jsonify.field("type", "process_added");
+    jsonify.field("timestamp", timestamp_ms());
+    jsonify.field("processes", processes);
+    jsonify.end_object();
+    return json + "\n";
+  }
+
+  std::string to_process_removed(const std::list<int32_t> &pids) const {
+    std::string json;
+    JsonWriter jsonify(json);
+    jsonify.begin_object();
+    jsonify.field("type", "process_removed");
+    jsonify.field("timestamp", timestamp_ms());
+    jsonify.field("pids", pids);
+    jsonify.end_object();
+    return json + "\n";
+  }
+
+  std::string to_self_stats(const SelfStats &stats) const {
+    std::string json;
+    JsonWriter jsonify(json);
+    jsonify.begin_object();
+    jsonify.field("type", "self_stats");
+    jsonify.field("timestamp", timestamp_ms());
+    jsonify.field("period_ms", stats.period_ms);
+    jsonify.field("cpu_user_us", stats.cpu_user_us);
+    jsonify.field("cpu_system_us", stats.cpu_system_us);
+    jsonify.field("rss_kb", stats.rss_kb);
+    jsonify.field("ticks", stats.ticks);
+    jsonify.field("collate_us", stats.collate);
+    jsonify.field("encode_us", stats.encode);
+    jsonify.field("file_opens", stats.file_opens);
+    jsonify.field("file_reads", stats.file_reads);
+    jsonify.field("frames", stats.frames);
+    jsonify.field("bytes", stats.bytes);
+    jsonify.field("wire_bytes", stats.wire_bytes);
+    jsonify.field("queue_depth", stats.queue_depth);
+    jsonify.field("reconnects", stats.reconnects);
+    jsonify.end_object();
+    return json + "\n";
   }
 
   std::string to_filter_ack(int32_t matched_count) const {
-    const auto ts = std::chrono::steady_clock::now();
-    const auto ts_ms = std::chrono::duration_cast<std::chrono::milliseconds>(ts.time_since_epoch()).count();
-    Jsonify jsonify;
-    jsonify["type"] = "filter_ack";
-    jsonify["timestamp"] = ts_ms;
-    jsonify["matched_count"] = matched_count;
-    return jsonify.to_string() + "\n";
+    std::string json;
+    JsonWriter jsonify(json);
+    jsonify.begin_object();
+    jsonify.field("type", "filter_ack");
+    jsonify.field("timestamp", timestamp_ms());
+    jsonify.field("matched_count", matched_count);
+    jsonify.end_object();
+    return json + "\n";
   }
 
   std::list<ProcessInfo> get_process_list() const;
-  bool process_list_changed() const;
+  int32_t count_running(const std::list<int32_t> &pids) const;
+  bool update_process_table(ProcessDelta &delta);
+
+ private:
+  static std::string schema_frame_(uint32_t metrics, bool cpu_percent,
+                                   const std::vector<const CollectorSpec *> &collectors) {
+    std::string schema;
+    const auto frame = WireWriter::begin_frame(schema, WireKind::SCHEMA);
+    schema.append(wire_schema(metrics, cpu_percent, collectors));
+    WireWriter::end_frame(schema, frame);
+    return schema;
+  }
+
+  // Folds the groups of stats into the delta baseline, the way the server's decoder does. A keyframe
+  // starts the baseline over. Processes sampled without threads keep the threads of their last sample.
+  // Everything is copy-assigned into containers kept from earlier samples, so this allocates nothing once
+  // they have grown.
+  void remember_(const Stats &stats, bool keyframe) {
+    previous_groups_ = (keyframe ? 0 : previous_groups_) | stats.groups;
+    previous_.groups = stats.groups;
+    if (stats.groups & kGroupCpu) {
+      previous_.processor_frequency = stats.processor_frequency;
+      previous_.cpu_user = stats.cpu_user;
+      previous_.cpu_system = stats.cpu_system;
+      previous_.cpu_idle = stats.cpu_idle;
+      previous_.cpu_iowait = stats.cpu_iowait;
+      previous_.cpu_irq = stats.cpu_irq;
+      previous_.cpu_softirq = stats.cpu_softirq;
+    }
+    if (stats.groups & kGroupMemory) {
+      previous_.memory = stats.memory;
+    }
+    if (stats.groups & kGroupProcesses) {
+      processes_ = stats.processes;
+      if (!(stats.groups & kGroupThreads)) {
+        // Both lists are sorted by pid.
+        auto it = previous_.processes.begin();
+        for (auto &process : processes_) {
+          while (it != previous_.processes.end() && it->pid < process.pid) {
+            ++it;
+          }
+          if (it != previous_.processes.end() && it->pid == process.pid) {
+            process.threads.swap(it->threads);
+          }
+        }
+      }
+      previous_.processes.swap(processes_);
+      previous_.exited = stats.exited;
+    }
+    if (stats.groups & kGroupCollectors) {
+      previous_.collected = stats.collected;
+    }
+  }
 
  private:
   class ImplPacket;
   std::unique_ptr<ImplPacket> impl_;
+  const uint32_t metrics_;
+  const bool cpu_percent_;
+  std::vector<const CollectorSpec *> collectors_;  // of the collectors that initialized
+  const std::string schema_;
+  std::string sample_buffer_;
+  Stats previous_;
+  uint32_t previous_groups_ = 0;  // groups with values in previous_ the server also has
+  int32_t since_keyframe_ = 0;
+  std::vector<Process> processes_;  // scratch for remember_()
 };
 
 #endif  // PLOTOP_PACKET_H
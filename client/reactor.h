@@ -0,0 +1,46 @@
+#ifndef PLOTOP_REACTOR_H
+#define PLOTOP_REACTOR_H
+
+#include <chrono>
+#include <cstdint>
+#include <functional>
+#include <memory>
+
+// Single-threaded event loop over file descriptors and timers. Callbacks run on the thread calling run()
+// and may watch, unwatch and re-arm anything, including themselves.
+class Reactor {
+ public:
+  enum Events : uint32_t {
+    READABLE = 1,
+    WRITABLE = 2,
+  };
+  using Handler = std::function<void(uint32_t events)>;
+  using TimerHandler = std::function<void(uint64_t expirations)>;
+
+ public:
+  Reactor();
+  ~Reactor();
+
+ public:
+  bool ready() const;
+
+  void watch(int32_t fd, uint32_t events, Handler handler);
+  void modify(int32_t fd, uint32_t events);
+  void unwatch(int32_t fd);
+
+  // Timers start disarmed. A periodic timer keeps its schedule on its own; when the loop falls behind the
+  // handler gets the number of expirations since it last ran.
+  int32_t add_timer(TimerHandler handler);
+  void arm_timer(int32_t timer, std::chrono::steady_clock::time_point first,
+                 std::chrono::nanoseconds period = std::chrono::nanoseconds(0));
+  void disarm_timer(int32_t timer);
+
+  void run();
+  void stop();
+
+ private:
+  class ImplReactor;
+  std::unique_ptr<ImplReactor> impl_;
+};
+
+#endif  // PLOTOP_REACTOR_H
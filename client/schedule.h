@@ -0,0 +1,129 @@
+#ifndef PLOTOP_SCHEDULE_H
+#define PLOTOP_SCHEDULE_H
+
+#include <algorithm>
+#include <array>
+#include <chrono>
+#include <cstdint>
+#include <exception>
+#include <numeric>
+#include <string>
+#include <string_view>
+
+#include "packet.h"
+
+// Sampling periods of the SampleGroup parts, all driven by one timer. The timer ticks at the greatest
+// common divisor of the periods, and each tick reports the groups whose period has come round, so e.g.
+// cpu every 100 ms, processes every 2 s and threads every 10 s share a single 100 ms tick.
+//
+// Periods whose divisor would be finer than kMinPeriod are rounded to multiples of it, so the timer never
+// wakes more often than that for ticks with nothing due: cpu every 101 ms next to a 3 s default samples cpu
+// every 100 ms on a 100 ms tick rather than ticking every millisecond.
+//
+// Ticks are numbered by deadline, missed ones included, and a group that missed its tick runs on the next
+// one, so an overrun delays groups rather than dropping them.
+class GroupSchedule {
+ public:
+  static constexpr size_t kGroups = 5;
+  static constexpr const char *kNames[kGroups] = {"cpu", "memory", "processes", "threads", "collectors"};
+  static constexpr std::chrono::milliseconds kMinPeriod{10};
+  static_assert((1u << kGroups) - 1 == kGroupAll, "one name per SampleGroup bit");
+
+ public:
+  explicit GroupSchedule(std::chrono::milliseconds interval) {
+    periods_.fill(interval);
+    update_();
+  }
+
+ public:
+  // Parses comma separated "group=seconds" overrides of the default interval, e.g. "cpu=0.1,threads=10".
+  bool parse(std::string_view text) {
+    auto periods = periods_;
+    while (!text.empty()) {
+      const auto comma = text.find(',');
+      const auto item = text.substr(0, comma);
+      text.remove_prefix(comma == std::string_view::npos ? text.size() : comma + 1);
+
+      const auto equals = item.find('=');
+      size_t group = kGroups;
+      for (size_t i = 0; i < kGroups && equals != std::string_view::npos; ++i) {
+        group = item.substr(0, equals) == kNames[i] ? i : group;
+      }
+      if (group == kGroups) {
+        return false;
+      }
+      double seconds = 0;
+      try {
+        size_t used = 0;
+        const std::string value(item.substr(equals + 1));
+        seconds = std::stod(value, &used);
+        if (used != value.size()) {
+          return false;
+        }
+      } catch (const std::exception &) {
+        return false;
+      }
+      const auto period = std::chrono::milliseconds(static_cast<int64_t>(seconds * 1000 + 0.5));
+      if (period < kMinPeriod) {
+        return false;
+      }
+      periods[group] = period;
+    }
+    periods_ = periods;
+    update_();
+    return true;
+  }
+
+  // Period of the shared tick.
+  std::chrono::milliseconds tick() const { return tick_; }
+
+  std::chrono::milliseconds period(size_t group) const { return periods_[group]; }
+
+  // Makes every group due at the next tick, e.g. so a new connection starts with a complete sample.
+  void reset() { next_.fill(0); }
+
+  // Groups due at the given tick, counted from 1. Ticks must not go backwards.
+  uint32_t due(uint64_t tick) {
+    uint32_t groups = 0;
+    for (size_t i = 0; i < kGroups; ++i) {
+      if (tick >= next_[i]) {
+        groups |= 1u << i;
+        next_[i] = (tick / ticks_[i] + 1) * ticks_[i];
+      }
+    }
+    return groups;
+  }
+
+ private:
+  void update_() {
+    int64_t tick = gcd_();
+    if (tick < kMinPeriod.count()) {
+      const int64_t unit = kMinPeriod.count();
+      for (auto &period : periods_) {
+        period = std::chrono::milliseconds(std::max<int64_t>((period.count() + unit / 2) / unit, 1) * unit);
+      }
+      tick = gcd_();
+    }
+    tick_ = std::chrono::milliseconds(tick);
+    for (size_t i = 0; i < kGroups; ++i) {
+      ticks_[i] = static_cast<uint64_t>(periods_[i].count() / tick);
+    }
+    reset();
+  }
+
+  int64_t gcd_() const {
+    int64_t tick = periods_[0].count();
+    for (const auto &period : periods_) {
+      tick = std::gcd(tick, period.count());
+    }
+    return tick;
+  }
+
+ private:
+  std::array<std::chrono::milliseconds, kGroups> periods_;
+  std::chrono::milliseconds tick_;
+  std::array<uint64_t, kGroups> ticks_;  // period in ticks
+  std::array<uint64_t, kGroups> next_;   // first tick the group is due again
+};
+
+#endif  // PLOTOP_SCHEDULE_H
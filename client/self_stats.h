@@ -0,0 +1,134 @@
+#ifndef PLOTOP_SELF_STATS_H
+#define PLOTOP_SELF_STATS_H
+
+#include <algorithm>
+#include <array>
+#include <chrono>
+#include <cstdint>
+#include <mutex>
+
+#include "jsonify.h"
+
+// Latency distribution over power-of-two buckets of microseconds. Recording costs a few instructions, and
+// percentiles come out as the upper bound of their bucket, within a factor of two, which is plenty to
+// tell a 2 ms collate from a 20 ms one.
+class LatencyHistogram {
+ public:
+  static constexpr size_t kBuckets = 32;  // bucket i holds latencies below 2^i us
+
+ public:
+  void record(std::chrono::nanoseconds latency) {
+    const auto us = static_cast<uint64_t>(std::max<int64_t>(latency.count() / 1000, 0));
+    size_t bucket = 0;
+    while (bucket + 1 < kBuckets && us >= (uint64_t(1) << bucket)) {
+      ++bucket;
+    }
+    ++buckets_[bucket];
+    ++count_;
+    max_us_ = std::max(max_us_, us);
+  }
+
+  uint64_t count() const { return count_; }
+  uint64_t max_us() const { return max_us_; }
+
+  // Upper bound in us of the bucket holding the given share (0..1) of the latencies, at most max_us().
+  uint64_t percentile_us(double share) const {
+    const auto rank = static_cast<uint64_t>(share * static_cast<double>(count_) + 0.5);
+    uint64_t seen = 0;
+    for (size_t bucket = 0; bucket < kBuckets; ++bucket) {
+      seen += buckets_[bucket];
+      if (seen >= rank && seen > 0) {
+        return std::min(uint64_t(1) << bucket, max_us_);
+      }
+    }
+    return max_us_;
+  }
+
+ private:
+  std::array<uint64_t, kBuckets> buckets_ = {};
+  uint64_t count_ = 0;
+  uint64_t max_us_ = 0;
+};
+
+inline JsonWriter &to_jsonify(JsonWriter &jsonify, const LatencyHistogram &histogram) {
+  jsonify.begin_object();
+  jsonify.field("p50", histogram.percentile_us(0.5));
+  jsonify.field("p99", histogram.percentile_us(0.99));
+  jsonify.field("max", histogram.max_us());
+  return jsonify.end_object();
+}
+
+// The collector's own footprint over one report period. Counters are for the period, rss_kb,
+// queue_depth and reconnects as of its end.
+struct SelfStats {
+  uint64_t period_ms = 0;
+  uint64_t cpu_user_us = 0;
+  uint64_t cpu_system_us = 0;
+  uint64_t rss_kb = 0;
+  uint64_t ticks = 0;
+  LatencyHistogram collate;  // Packet::collate()
+  LatencyHistogram encode;   // to_json(), to_binary() or to_delta() of the sample
+  uint64_t file_opens = 0;   // procfs files opened and read, by every sampling thread
+  uint64_t file_reads = 0;
+  uint64_t frames = 0;  // written to the socket
+  uint64_t bytes = 0;
+  uint64_t wire_bytes = 0;  // after compression
+  uint64_t queue_depth = 0;
+  uint64_t reconnects = 0;
+};
+
+// Gathers SelfStats across threads: the sampling thread records every tick, and whichever thread sends
+// the report fills in the process-wide totals and turns them into per-period values. One uncontended lock
+// per tick is all it adds to the hot path.
+class SelfMonitor {
+ public:
+  void record_tick(std::chrono::nanoseconds collate, std::chrono::nanoseconds encode) {
+    std::lock_guard<std::mutex> lock(mutex_);
+    ++window_.ticks;
+    window_.collate.record(collate);
+    window_.encode.record(encode);
+  }
+
+  // A new connection starts its socket counters at zero.
+  void connected() {
+    std::lock_guard<std::mutex> lock(mutex_);
+    window_.reconnects += connections_++ > 0 ? 1 : 0;
+    last_.frames = 0;
+    last_.bytes = 0;
+    last_.wire_bytes = 0;
+  }
+
+  // Takes totals since process start (socket ones since connected()) in stats and replaces them with the
+  // values of the period since the previous report, together with the ticks recorded in it.
+  void report(SelfStats &stats) {
+    std::lock_guard<std::mutex> lock(mutex_);
+    const auto now = std::chrono::steady_clock::now();
+    const SelfStats totals = stats;
+    stats.period_ms =
+        static_cast<uint64_t>(std::chrono::duration_cast<std::chrono::milliseconds>(now - last_report_).count());
+    stats.cpu_user_us -= last_.cpu_user_us;
+    stats.cpu_system_us -= last_.cpu_system_us;
+    stats.file_opens -= last_.file_opens;
+    stats.file_reads -= last_.file_reads;
+    stats.frames -= last_.frames;
+    stats.bytes -= last_.bytes;
+    stats.wire_bytes -= last_.wire_bytes;
+    stats.ticks = window_.ticks;
+    stats.collate = window_.collate;
+    stats.encode = window_.encode;
+    stats.reconnects = window_.reconnects;
+    last_ = totals;
+    last_report_ = now;
+    window_ = {};
+    window_.reconnects = stats.reconnects;
+  }
+
+ private:
+  std::mutex mutex_;
+  SelfStats window_;  // ticks and latencies since the last report
+  SelfStats last_;    // totals as of the last report
+  std::chrono::steady_clock::time_point last_report_ = std::chrono::steady_clock::now();
+  uint64_t connections_ = 0;
+};
+
+#endif  // PLOTOP_SELF_STATS_H
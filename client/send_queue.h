@@ -0,0 +1,236 @@
+#ifndef PLOTOP_SEND_QUEUE_H
+#define PLOTOP_SEND_QUEUE_H
+
+#include <chrono>
+#include <condition_variable>
+#include <cstdint>
+#include <deque>
+#include <mutex>
+#include <string>
+#include <vector>
+
+// What happens to a new sample when the sample lane is full.
+enum class DropPolicy {
+  DROP_OLDEST,  // discard the oldest pending sample
+  COALESCE,     // replace the newest pending sample; cumulative counters make the newer one a superset
+};
+
+// Messages that a newer one of the same kind makes obsolete, so at most one of each waits to be sent.
+enum class Latest {
+  PROCESSES,   // full process list or the added/removed delta since the previous one
+  SELF_STATS,  // the collector's own footprint
+};
+constexpr size_t kLatestKinds = static_cast<size_t>(Latest::SELF_STATS) + 1;
+
+// Hands frames from the sampling and control threads to a dedicated sender thread.
+//
+// Samples go through a bounded ring of reusable buffers; pushing never blocks and never allocates once the
+// buffers have grown. Heartbeats, acks and other one-off control messages use a first-in first-out priority
+// lane that is always drained first; replaceable messages wait in one slot per kind right behind it, so a
+// stalled link holds the latest process list and report rather than every one since. The lock only guards
+// buffer swaps, never a network write, so a congested link can delay samples but not the sampler.
+class SendQueue {
+ public:
+  SendQueue(size_t capacity, DropPolicy policy) : ring_(capacity > 0 ? capacity : 1), policy_(policy) {}
+
+ public:
+  bool full() const {
+    std::lock_guard<std::mutex> lock(mutex_);
+    return count_ == ring_.size();
+  }
+
+  // trailer, if not empty, shares the sample's slot, so a drop or coalesce takes or keeps both together.
+  void push_sample(const std::string &frame, const std::string &trailer = std::string()) {
+    {
+      std::lock_guard<std::mutex> lock(mutex_);
+      if (closed_) {
+        return;
+      }
+      if (count_ == ring_.size()) {
+        if (policy_ == DropPolicy::COALESCE) {
+          ring_[(head_ + count_ - 1) % ring_.size()].assign(frame).append(trailer);
+          ++coalesced_;
+          return;
+        }
+        head_ = (head_ + 1) % ring_.size();
+        --count_;
+        ++dropped_;
+      }
+      ring_[(head_ + count_) % ring_.size()].assign(frame).append(trailer);
+      ++count_;
+    }
+    cv_.notify_one();
+  }
+
+  void push_priority(std::string frame) {
+    {
+      std::lock_guard<std::mutex> lock(mutex_);
+      if (closed_) {
+        return;
+      }
+      priority_.push_back(std::move(frame));
+    }
+    cv_.notify_one();
+  }
+
+  // Puts frame in the slot of its kind, replacing the one still waiting there, if any.
+  void push_latest(Latest kind, const std::string &frame) {
+    {
+      std::lock_guard<std::mutex> lock(mutex_);
+      if (closed_) {
+        return;
+      }
+      Slot &slot = latest_[static_cast<size_t>(kind)];
+      slot.frame.assign(frame);
+      slot.pending = true;
+    }
+    cv_.notify_one();
+  }
+
+  // Whether a frame of this kind still waits to be sent. Only the sender clears it, so a false answer holds
+  // until the caller pushes one.
+  bool pending(Latest kind) const {
+    std::lock_guard<std::mutex> lock(mutex_);
+    return latest_[static_cast<size_t>(kind)].pending;
+  }
+
+  // Discards every pending sample, e.g. when the frames depend on each other and one had to go.
+  void clear_samples() {
+    std::lock_guard<std::mutex> lock(mutex_);
+    dropped_ += count_;
+    count_ = 0;
+  }
+
+  // Blocks until a frame is available and swaps it into frame; returns false once closed.
+  bool pop(std::string &frame) {
+    while (!pop_until(frame, std::chrono::steady_clock::time_point::max())) {
+      if (closed()) {
+        return false;
+      }
+    }
+    return true;
+  }
+
+  // Like pop(), but also returns false at deadline or after wake(), so the caller can do background work
+  // while the queue is idle; closed() tells these apart from the end of the queue. priority, if given, is
+  // set when the frame came from the priority lane.
+  bool pop_until(std::string &frame, std::chrono::steady_clock::time_point deadline, bool *priority = nullptr) {
+    std::unique_lock<std::mutex> lock(mutex_);
+    const auto ready = [this]() {
+      return closed_ || woken_ || !priority_.empty() || latest_count_() > 0 || count_ > 0;
+    };
+    if (deadline == std::chrono::steady_clock::time_point::max()) {
+      cv_.wait(lock, ready);
+    } else if (!cv_.wait_until(lock, deadline, ready)) {
+      return false;
+    }
+    woken_ = false;
+    return take_(frame, priority);
+  }
+
+  // Never blocks; for callers that learn about new frames some other way, like an event loop.
+  bool try_pop(std::string &frame, bool *priority = nullptr) {
+    std::lock_guard<std::mutex> lock(mutex_);
+    return take_(frame, priority);
+  }
+
+  void wake() {
+    {
+      std::lock_guard<std::mutex> lock(mutex_);
+      woken_ = true;
+    }
+    cv_.notify_all();
+  }
+
+  bool closed() const {
+    std::lock_guard<std::mutex> lock(mutex_);
+    return closed_;
+  }
+
+  void close() {
+    {
+      std::lock_guard<std::mutex> lock(mutex_);
+      closed_ = true;
+    }
+    cv_.notify_all();
+  }
+
+  uint64_t dropped() const {
+    std::lock_guard<std::mutex> lock(mutex_);
+    return dropped_;
+  }
+
+  uint64_t coalesced() const {
+    std::lock_guard<std::mutex> lock(mutex_);
+    return coalesced_;
+  }
+
+  size_t depth() const {
+    std::lock_guard<std::mutex> lock(mutex_);
+    return count_ + priority_.size() + latest_count_();
+  }
+
+ private:
+  struct Slot {
+    std::string frame;
+    bool pending = false;
+  };
+
+  size_t latest_count_() const {
+    size_t count = 0;
+    for (const auto &slot : latest_) {
+      count += slot.pending ? 1 : 0;
+    }
+    return count;
+  }
+
+  bool take_(std::string &frame, bool *priority) {
+    if (closed_) {
+      return false;
+    }
+    if (!priority_.empty()) {
+      frame.swap(priority_.front());
+      priority_.pop_front();
+      if (priority) {
+        *priority = true;
+      }
+      return true;
+    }
+    for (auto &slot : latest_) {
+      if (slot.pending) {
+        frame.swap(slot.frame);
+        slot.pending = false;
+        if (priority) {
+          *priority = true;
+        }
+        return true;
+      }
+    }
+    if (count_ == 0) {
+      return false;
+    }
+    if (priority) {
+      *priority = false;
+    }
+    frame.swap(ring_[head_]);
+    head_ = (head_ + 1) % ring_.size();
+    --count_;
+    return true;
+  }
+
+ private:
+  mutable std::mutex mutex_;
+  std::condition_variable cv_;
+  std::vector<std::string> ring_;
+  size_t head_ = 0;
+  size_t count_ = 0;
+  std::deque<std::string> priority_;
+  Slot latest_[kLatestKinds];
+  DropPolicy policy_;
+  bool closed_ = false;
+  bool woken_ = false;
+  uint64_t dropped_ = 0;
+  uint64_t coalesced_ = 0;
+};
+
+#endif  // PLOTOP_SEND_QUEUE_H
@@ -0,0 +1,47 @@
+#ifndef PLOTOP_SPOOL_H
+#define PLOTOP_SPOOL_H
+
+#include <cstdint>
+#include <memory>
+#include <string>
+#include <string_view>
+
+// Fixed-size, memory-mapped ring of outgoing sample frames, each stored under its sequence number.
+// When the ring is full the oldest frames are overwritten. The file survives collector crashes and
+// restarts: the ring bounds live in two checksummed header slots written alternately, and every record
+// carries its own checksum, so a torn write loses at most the record being written.
+//
+// The session identifies the spool file to the server; together with the sequence numbers it lets a
+// reconnecting collector resend only the frames the server has not seen.
+//
+// Frames are positional binary, so every record names the SCHEMA frame it was encoded against and the file
+// keeps the last few of those: replay resends each frame with its own schema, whatever the collector runs
+// with by then. Installing a schema beyond those drops the records of the oldest one.
+class Spool {
+ public:
+  Spool(const std::string &path, uint64_t capacity);
+  ~Spool();
+
+ public:
+  bool ready() const;
+  std::string session() const;
+  // Sequence number the next appended frame should carry.
+  uint64_t next_seq() const;
+  // Oldest and newest sequence numbers held; first_seq() > last_seq() when empty.
+  uint64_t first_seq() const;
+  uint64_t last_seq() const;
+
+  // Spools frame, encoded against the SCHEMA frame schema.
+  void append(uint64_t seq, std::string_view frame, std::string_view schema);
+  // Copies the oldest frame with a sequence number >= seq into frame, and the id of its schema into schema;
+  // false when there is none.
+  bool read_from(uint64_t seq, std::string &frame, uint64_t &found, uint64_t &schema);
+  // Copies the SCHEMA frame with the given id into schema; false when it is no longer held.
+  bool schema(uint64_t id, std::string &schema) const;
+
+ private:
+  class ImplSpool;
+  std::unique_ptr<ImplSpool> impl_;
+};
+
+#endif  // PLOTOP_SPOOL_H
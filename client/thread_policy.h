@@ -0,0 +1,90 @@
+#ifndef PLOTOP_THREAD_POLICY_H
+#define PLOTOP_THREAD_POLICY_H
+
+#include <cstddef>
+#include <cstdint>
+#include <functional>
+#include <map>
+#include <string>
+#include <string_view>
+
+// Which threads of a process go into a sample. Every thread is still read, since its CPU time is what
+// the choice is made on, but only the chosen ones are reported.
+struct ThreadPolicy {
+  enum Mode : uint8_t {
+    ALL,      // every thread
+    CHANGED,  // threads that used CPU since the previous sample
+    TOP,      // the limit threads that used the most CPU since the previous sample
+    CAP,      // like TOP, with the CPU time of all other threads summed up in a thread with tid 0
+  };
+
+  Mode mode = ALL;
+  size_t limit = 0;
+
+  // Parses "all", "changed", "top:N" or "cap:N".
+  static bool parse(std::string_view text, ThreadPolicy &policy) {
+    if (text == "all" || text == "changed") {
+      policy = {text == "all" ? ALL : CHANGED, 0};
+      return true;
+    }
+    const auto colon = text.find(':');
+    const auto mode = text.substr(0, colon);
+    if (colon == std::string_view::npos || (mode != "top" && mode != "cap")) {
+      return false;
+    }
+    size_t limit = 0;
+    const auto digits = text.substr(colon + 1);
+    for (const char c : digits) {
+      if (c < '0' || c > '9') {
+        return false;
+      }
+      limit = limit * 10 + static_cast<size_t>(c - '0');
+    }
+    if (digits.empty() || limit == 0) {
+      return false;
+    }
+    policy = {mode == "top" ? TOP : CAP, limit};
+    return true;
+  }
+};
+
+// A default thread policy and overrides for processes by name (the comm in /proc/<pid>/stat).
+class ThreadPolicies {
+ public:
+  // Parses a policy optionally followed by ",name=policy" overrides, e.g. "changed,java=top:10".
+  bool parse(std::string_view text) {
+    ThreadPolicy fallback;
+    std::map<std::string, ThreadPolicy, std::less<>> overrides;
+    bool first = true;
+    while (!text.empty() || first) {
+      const auto comma = text.find(',');
+      const auto item = text.substr(0, comma);
+      text.remove_prefix(comma == std::string_view::npos ? text.size() : comma + 1);
+
+      const auto equals = item.rfind('=');
+      if (first && equals == std::string_view::npos) {
+        if (!ThreadPolicy::parse(item, fallback)) {
+          return false;
+        }
+      } else if (equals == std::string_view::npos || equals == 0 ||
+                 !ThreadPolicy::parse(item.substr(equals + 1), overrides[std::string(item.substr(0, equals))])) {
+        return false;
+      }
+      first = false;
+    }
+    fallback_ = fallback;
+    overrides_.swap(overrides);
+    return true;
+  }
+
+  const ThreadPolicy &get(std::string_view name) const {
+    const auto it = overrides_.find(name);
+    return it != overrides_.end() ? it->second : fallback_;
+  }
+
+ private:
+  ThreadPolicy fallback_;
+  std::map<std::string, ThreadPolicy, std::less<>> overrides_;
+};
+
+#endif  // PLOTOP_THREAD_POLICY_H
@@ -0,0 +1,323 @@
+#ifndef PLOTOP_WINDOW_H
+#define PLOTOP_WINDOW_H
+
+#include <algorithm>
+#include <array>
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+#include <limits>
+#include <string>
+#include <vector>
+
+#include "jsonify.h"
+#include "packet.h"
+
+// Minimum, mean and maximum of the values seen in a window.
+struct WindowStat {
+  uint64_t min = std::numeric_limits<uint64_t>::max();
+  uint64_t max = 0;
+  uint64_t sum = 0;
+  uint64_t count = 0;
+
+  void add(uint64_t value) {
+    min = std::min(min, value);
+    max = std::max(max, value);
+    sum += value;
+    ++count;
+  }
+
+  uint64_t mean() const { return count > 0 ? (sum + count / 2) / count : 0; }
+};
+
+inline JsonWriter &to_jsonify(JsonWriter &jsonify, const WindowStat &stat) {
+  jsonify.begin_object();
+  jsonify.field("min", stat.count > 0 ? stat.min : 0);
+  jsonify.field("avg", stat.mean());
+  jsonify.field("max", stat.max);
+  return jsonify.end_object();
+}
+
+// Distribution of shares in hundredths of a percent over 1% buckets, for percentiles of a window. Shares
+// above 100% fall into the last bucket.
+class ShareHistogram {
+ public:
+  static constexpr size_t kBuckets = 101;
+
+ public:
+  void add(uint64_t share) { ++buckets_[std::min<uint64_t>(share / 100, kBuckets - 1)]; }
+
+  // Upper bound in hundredths of a percent of the bucket holding the given share (0..1) of the values, at
+  // most max.
+  uint64_t percentile(double share, uint64_t count, uint64_t max) const {
+    const auto rank = static_cast<uint64_t>(share * static_cast<double>(count) + 0.5);
+    uint64_t seen = 0;
+    for (size_t bucket = 0; bucket < kBuckets; ++bucket) {
+      seen += buckets_[bucket];
+      if (seen >= rank && seen > 0) {
+        return std::min<uint64_t>((bucket + 1) * 100, max);
+      }
+    }
+    return max;
+  }
+
+ private:
+  std::array<uint32_t, kBuckets> buckets_ = {};
+};
+
+// A share with its window statistics and, when percentiles are enabled, its distribution.
+struct WindowShare {
+  WindowStat stat;
+  ShareHistogram histogram;
+};
+
+// Folds every sample of a reporting window into one summary per core and per process: the CPU share of
+// each core, the CPU share of the whole machine each process used, and memory. Samples are taken at the
+// tick rate but only the one closing a window is sent, followed by the summary, so short spikes remain
+// visible at the bandwidth and log size of the window rate.
+//
+// Accumulators are fixed-size per core and per process and are refilled in place, so once they have grown
+// to the size of a window folding a sample allocates nothing. A process that exits during a window is
+// still reported with that window.
+class SampleWindow {
+ public:
+  // A zero window disables it: every sample closes its own window and nothing is accumulated.
+  SampleWindow(std::chrono::milliseconds window, bool percentiles) : window_(window), percentiles_(percentiles) {}
+
+ public:
+  bool enabled() const { return window_.count() > 0; }
+  bool closing() const { return closing_; }
+
+  // Groups to collate at this tick: those due and, when it closes the window, every group due during it, so
+  // the sample sent carries all of them.
+  uint32_t groups(uint32_t due, std::chrono::steady_clock::time_point now) {
+    if (!enabled()) {
+      closing_ = true;
+      return due;
+    }
+    if (start_ == std::chrono::steady_clock::time_point()) {
+      start_ = now;
+    }
+    groups_ |= due;
+    closing_ = now - start_ >= window_;
+    return closing_ ? groups_ : due;
+  }
+
+  void add(const Stats &stats) {
+    if (!enabled()) {
+      return;
+    }
+    ++samples_;
+    if (stats.groups & kGroupCpu) {
+      add_cpu_(stats);
+    }
+    if (stats.groups & kGroupMemory) {
+      available_memory_.add(stats.memory.available);
+      free_memory_.add(stats.memory.free);
+    }
+    if (stats.groups & kGroupProcesses) {
+      add_processes_(stats.processes);
+    }
+  }
+
+  // The summary of the window closed by the sample with the given sequence number.
+  std::string to_summary(uint64_t seq, std::chrono::steady_clock::time_point now) const {
+    std::string json;
+    JsonWriter jsonify(json);
+    jsonify.begin_object();
+    jsonify.field("type", "summary");
+    jsonify.field("timestamp", timestamp_ms());
+    jsonify.field("seq", seq);
+    jsonify.field("window_ms", std::chrono::duration_cast<std::chrono::milliseconds>(now - start_).count());
+    jsonify.field("samples", samples_);
+    jsonify.key("cpu");
+    jsonify.begin_array();
+    for (size_t i = 0; i < cores_; ++i) {
+      share_(jsonify, core_shares_[i]);
+    }
+    jsonify.end_array();
+    jsonify.field("available_memory", available_memory_);
+    jsonify.field("free_memory", free_memory_);
+    jsonify.key("processes");
+    jsonify.begin_array();
+    for (size_t i = 0; i < process_count_; ++i) {
+      const auto &process = processes_[i];
+      if (process.memory.count == 0) {
+        continue;
+      }
+      jsonify.begin_object();
+      jsonify.field("pid", process.pid);
+      jsonify.field("name", process.name);
+      jsonify.key("cpu");
+      share_(jsonify, process.cpu);
+      jsonify.field("memory", process.memory);
+      jsonify.end_object();
+    }
+    jsonify.end_array();
+    jsonify.end_object();
+    return json + "\n";
+  }
+
+  // Starts the next window at now. The counters of the last sample stay, so the next one has a baseline.
+  void reset(std::chrono::steady_clock::time_point now) {
+    start_ = now;
+    groups_ = 0;
+    samples_ = 0;
+    for (auto &share : core_shares_) {
+      share = {};
+    }
+    available_memory_ = {};
+    free_memory_ = {};
+    size_t kept = 0;
+    for (size_t i = 0; i < process_count_; ++i) {
+      if (processes_[i].present) {
+        processes_[i].cpu = {};
+        processes_[i].memory = {};
+        std::swap(processes_[kept++], processes_[i]);
+      }
+    }
+    process_count_ = kept;
+  }
+
+ private:
+  struct ProcessWindow {
+    int32_t pid = 0;
+    std::string name;
+    bool present = false;      // in the last sample with processes
+    uint64_t cpu_time = 0;     // cpu_user + cpu_system as of that sample
+    uint64_t cpu_clock = 0;    // cpu_clock_ as of that sample
+    bool has_baseline = false;
+    WindowShare cpu;
+    WindowStat memory;
+  };
+
+  void share_(JsonWriter &jsonify, const WindowShare &share) const {
+    jsonify.begin_object();
+    jsonify.field("min", share.stat.count > 0 ? share.stat.min : 0);
+    jsonify.field("avg", share.stat.mean());
+    jsonify.field("max", share.stat.max);
+    if (percentiles_) {
+      jsonify.field("p50", share.histogram.percentile(0.5, share.stat.count, share.stat.max));
+      jsonify.field("p90", share.histogram.percentile(0.9, share.stat.count, share.stat.max));
+      jsonify.field("p99", share.histogram.percentile(0.99, share.stat.count, share.stat.max));
+    }
+    jsonify.end_object();
+  }
+
+  void add_share_(WindowShare &share, uint64_t value) {
+    share.stat.add(value);
+    if (percentiles_) {
+      share.histogram.add(value);
+    }
+  }
+
+  // Busy share of each line since the previous sample, in hundredths of a percent: straight from the
+  // sample with PacketOptions::cpu_percent, otherwise from the difference of the counters. Also advances
+  // cpu_clock_, the clock ticks elapsed over all cores, which process shares are measured against.
+  void add_cpu_(const Stats &stats) {
+    const size_t lines = stats.cpu_percent ? stats.cpu_user_percent.size() : stats.cpu_user.size();
+    if (lines != cores_) {
+      cores_ = lines;
+      core_shares_.resize(lines);
+      has_cpu_baseline_ = false;
+    }
+    if (stats.cpu_percent) {
+      for (size_t i = 0; i < lines; ++i) {
+        add_share_(core_shares_[i], stats.cpu_user_percent[i] + stats.cpu_system_percent[i] +
+                                        stats.cpu_iowait_percent[i] + stats.cpu_irq_percent[i] +
+                                        stats.cpu_softirq_percent[i] + stats.cpu_steal_percent[i]);
+      }
+      cpu_clock_ += stats.cpu_elapsed;
+      return;
+    }
+
+    const auto total_of = [&](size_t i) {
+      return stats.cpu_user[i] + stats.cpu_system[i] + stats.cpu_idle[i] + stats.cpu_iowait[i] + stats.cpu_irq[i] +
+             stats.cpu_softirq[i];
+    };
+    last_totals_.resize(lines);
+    last_idle_.resize(lines);
+    for (size_t i = 0; i < lines; ++i) {
+      const uint64_t total = total_of(i);
+      if (has_cpu_baseline_ && total > last_totals_[i]) {
+        const uint64_t elapsed = total - last_totals_[i];
+        const uint64_t idle = std::min(stats.cpu_idle[i] - std::min(last_idle_[i], stats.cpu_idle[i]), elapsed);
+        add_share_(core_shares_[i], ((elapsed - idle) * 10000 + elapsed / 2) / elapsed);
+      }
+      if (i == 0 && has_cpu_baseline_) {
+        cpu_clock_ += total - std::min(last_totals_[0], total);
+      }
+      last_totals_[i] = total;
+      last_idle_[i] = stats.cpu_idle[i];
+    }
+    has_cpu_baseline_ = lines > 0;
+  }
+
+  // Both lists are sorted by pid; the slots are rebuilt in scratch_ as their union and swapped back. The
+  // vectors only grow, and the slots past process_count_ are spares that keep their buffers.
+  void add_processes_(const std::vector<Process> &processes) {
+    if (scratch_.size() < process_count_ + processes.size()) {
+      scratch_.resize(process_count_ + processes.size());
+    }
+    size_t count = 0;
+    auto slot = processes_.begin();
+    const auto end = processes_.begin() + static_cast<std::ptrdiff_t>(process_count_);
+    for (const auto &process : processes) {
+      for (; slot != end && slot->pid < process.pid; ++slot) {
+        slot->present = false;
+        std::swap(scratch_[count++], *slot);
+      }
+      auto &window = scratch_[count++];
+      const bool known = slot != end && slot->pid == process.pid && slot->name == process.name;
+      if (slot != end && slot->pid == process.pid) {
+        std::swap(window, *slot++);
+      }
+      if (!known) {
+        window.pid = process.pid;
+        window.name = process.name;
+        window.has_baseline = false;
+        window.cpu = {};
+        window.memory = {};
+      }
+      const uint64_t cpu_time = process.cpu_user + process.cpu_system;
+      if (window.has_baseline && cpu_clock_ > window.cpu_clock) {
+        const uint64_t used = cpu_time - std::min(window.cpu_time, cpu_time);
+        add_share_(window.cpu, (used * 10000 + (cpu_clock_ - window.cpu_clock) / 2) / (cpu_clock_ - window.cpu_clock));
+      }
+      window.present = true;
+      window.cpu_time = cpu_time;
+      window.cpu_clock = cpu_clock_;
+      window.has_baseline = true;
+      window.memory.add(process.memory);
+    }
+    for (; slot != end; ++slot) {
+      slot->present = false;
+      std::swap(scratch_[count++], *slot);
+    }
+    processes_.swap(scratch_);
+    process_count_ = count;
+  }
+
+ private:
+  const std::chrono::milliseconds window_;
+  const bool percentiles_;
+  std::chrono::steady_clock::time_point start_;
+  bool closing_ = true;
+  uint32_t groups_ = 0;  // due during the window
+  uint64_t samples_ = 0;
+
+  size_t cores_ = 0;  // lines, the aggregate included
+  std::vector<WindowShare> core_shares_;
+  std::vector<uint64_t> last_totals_;
+  std::vector<uint64_t> last_idle_;
+  bool has_cpu_baseline_ = false;
+  uint64_t cpu_clock_ = 0;
+  WindowStat available_memory_;
+  WindowStat free_memory_;
+
+  std::vector<ProcessWindow> processes_;  // the first process_count_, sorted by pid
+  std::vector<ProcessWindow> scratch_;
+  size_t process_count_ = 0;
+};
+
+#endif  // PLOTOP_WINDOW_H
@@ -0,0 +1,171 @@
+#ifndef PLOTOP_WIRE_H
+#define PLOTOP_WIRE_H
+
+#include <cstdint>
+#include <list>
+#include <string>
+#include <string_view>
+#include <type_traits>
+#include <vector>
+
+// Compact binary framing, negotiated per connection. A frame is
+//   0xB1 | kind (1 byte) | payload length (uint32, little endian) | payload
+// and can be interleaved with newline-delimited JSON messages, which always start with '{'.
+// Payloads are positional: the field order is announced once per connection by a schema frame.
+//
+// STATS_DELTA frames encode a sample against the previous one: counters ("c" in the schema) are sent
+// as zigzag differences, and record arrays list removed keys followed by only the records that changed,
+// each flagged as new (full record) or updated (fields against the previous record with that key).
+// STATS_REPLAY frames are STATS frames resent from the spool after a reconnect; they never take part in
+// the delta chain and are decoded against the last REPLAY_SCHEMA frame, the SCHEMA they were spooled with,
+// which leaves the schema of the live frames alone. A COMPRESSED frame carries one LzCompressor block (see
+// compress.h) which decompresses to any number of complete JSON lines and frames.
+enum class WireKind : uint8_t {
+  SCHEMA = 1,
+  STATS = 2,
+  STATS_DELTA = 3,
+  STATS_REPLAY = 4,
+  COMPRESSED = 5,
+  REPLAY_SCHEMA = 6,
+};
+
+static constexpr uint8_t kWireMagic = 0xB1;
+static constexpr size_t kWireHeaderSize = 6;
+
+// Appends LEB128 varints to a caller-owned buffer. Unsigned integers are written as-is, signed integers
+// zigzag-encoded, strings and containers are prefixed by their length, and any other type is written by
+// an ADL-found to_wire(WireWriter &, const T &) overload.
+class WireWriter {
+ public:
+  explicit WireWriter(std::string &out) : out_(out) {}
+
+ public:
+  WireWriter &write_unsigned(uint64_t value) {
+    while (value >= 0x80) {
+      out_.push_back(static_cast<char>((value & 0x7f) | 0x80));
+      value >>= 7;
+    }
+    out_.push_back(static_cast<char>(value));
+    return *this;
+  }
+
+  WireWriter &write_signed(int64_t value) {
+    return write_unsigned((static_cast<uint64_t>(value) << 1) ^ static_cast<uint64_t>(value >> 63));
+  }
+
+  WireWriter &write_string(std::string_view value) {
+    write_unsigned(value.size());
+    out_.append(value.data(), value.size());
+    return *this;
+  }
+
+  template <typename T> WireWriter &write(const T &value) {
+    if constexpr (std::is_integral_v<T> && std::is_signed_v<T>) {
+      write_signed(value);
+    } else if constexpr (std::is_integral_v<T>) {
+      write_unsigned(value);
+    } else if constexpr (std::is_convertible_v<const T &, std::string_view>) {
+      write_string(value);
+    } else {
+      to_wire(*this, value);
+    }
+    return *this;
+  }
+
+  template <typename T> WireWriter &write(const std::list<T> &values) { return write_array_(values); }
+  template <typename T> WireWriter &write(const std::vector<T> &values) { return write_array_(values); }
+
+  // Difference of a cumulative counter; zigzag so a counter that went backwards still round-trips.
+  WireWriter &write_delta(uint64_t value, uint64_t previous) {
+    return write_signed(static_cast<int64_t>(value - previous));
+  }
+
+  // Element-wise differences of a counter array. Missing previous elements count as zero.
+  WireWriter &write_delta(const std::vector<uint64_t> &values, const std::vector<uint64_t> &previous) {
+    write_unsigned(values.size());
+    auto it = previous.begin();
+    for (const auto value : values) {
+      write_delta(value, it != previous.end() ? *it++ : 0);
+    }
+    return *this;
+  }
+
+  // Records are matched on wire_key(), and both containers must be sorted by it, so that one merge walk
+  // pairs them without building an index. Unchanged ones (wire_equal) are omitted, changed ones are written
+  // by to_wire_delta(WireWriter &, const T &, const T &), new ones in full by to_wire().
+  template <typename C> WireWriter &write_records_delta(const C &values, const C &previous) {
+    using T = typename C::value_type;
+    // Calls f(value, previous) for every pair with the same key, value or previous being null if the
+    // key is only on one side.
+    const auto walk = [&](auto &&f) {
+      auto it = previous.begin();
+      for (const auto &value : values) {
+        for (; it != previous.end() && wire_key(*it) < wire_key(value); ++it) {
+          f(nullptr, &*it);
+        }
+        if (it != previous.end() && wire_key(*it) == wire_key(value)) {
+          f(&value, &*it++);
+        } else {
+          f(&value, nullptr);
+        }
+      }
+      for (; it != previous.end(); ++it) {
+        f(nullptr, &*it);
+      }
+    };
+
+    size_t removed = 0;
+    size_t changed = 0;
+    walk([&](const T *value, const T *last) {
+      removed += value ? 0 : 1;
+      changed += value && (!last || !wire_equal(*value, *last)) ? 1 : 0;
+    });
+    write_unsigned(removed);
+    walk([&](const T *value, const T *last) {
+      if (!value) {
+        write_signed(wire_key(*last));
+      }
+    });
+    write_unsigned(changed);
+    walk([&](const T *value, const T *last) {
+      if (value && !last) {
+        write_unsigned(1);
+        write(*value);
+      } else if (value && !wire_equal(*value, *last)) {
+        write_unsigned(0);
+        to_wire_delta(*this, *value, *last);
+      }
+    });
+    return *this;
+  }
+
+  // Starts a frame of the given kind in out; the length is filled in by end_frame().
+  static size_t begin_frame(std::string &out, WireKind kind) {
+    const size_t start = out.size();
+    out.push_back(static_cast<char>(kWireMagic));
+    out.push_back(static_cast<char>(kind));
+    out.append(4, '\0');
+    return start;
+  }
+
+  static void end_frame(std::string &out, size_t start) {
+    const uint32_t length = static_cast<uint32_t>(out.size() - start - kWireHeaderSize);
+    for (size_t i = 0; i < 4; ++i) {
+      out[start + 2 + i] = static_cast<char>((length >> (8 * i)) & 0xff);
+    }
+  }
+
+ private:
+  template <typename C> WireWriter &write_array_(const C &values) {
+    write_unsigned(values.size());
+    for (const auto &value : values) {
+      write(value);
+    }
+    return *this;
+  }
+
+ private:
+  std::string &out_;
+};
+
+#endif  // PLOTOP_WIRE_H
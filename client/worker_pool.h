@@ -0,0 +1,177 @@
+#ifndef PLOTOP_WORKER_POOL_H
+#define PLOTOP_WORKER_POOL_H
+
+#include <condition_variable>
+#include <cstdint>
+#include <functional>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+// Fixed set of threads that runs one batch of indexed tasks at a time; the calling thread takes part as
+// worker 0. Each worker starts on its own contiguous slice of the indices and, once that is done, steals
+// half of what is left in the fullest slice, so a few expensive tasks (processes with thousands of threads)
+// do not leave the other workers idle.
+//
+// Tasks get their worker number so they can write into per-worker or per-index storage without locking.
+class WorkerPool {
+ public:
+  using Task = std::function<void(size_t index, size_t worker)>;
+
+ public:
+  explicit WorkerPool(size_t workers) : slices_(workers > 0 ? workers : 1) {
+    for (size_t worker = 1; worker < slices_.size(); ++worker) {
+      threads_.emplace_back(&WorkerPool::loop_, this, worker);
+    }
+  }
+
+  ~WorkerPool() {
+    {
+      std::lock_guard<std::mutex> lock(mutex_);
+      stop_ = true;
+    }
+    start_.notify_all();
+    for (auto &thread : threads_) {
+      thread.join();
+    }
+  }
+
+  WorkerPool(const WorkerPool &) = delete;
+  WorkerPool &operator=(const WorkerPool &) = delete;
+
+ public:
+  size_t size() const { return slices_.size(); }
+
+  // Calls task once for every index in [0, count) and returns when all calls have returned. task must not
+  // throw.
+  void run(size_t count, const Task &task) {
+    if (slices_.size() == 1 || count < 2) {
+      for (size_t index = 0; index < count; ++index) {
+        task(index, 0);
+      }
+      return;
+    }
+
+    const size_t workers = slices_.size();
+    for (size_t worker = 0; worker < workers; ++worker) {
+      std::lock_guard<std::mutex> lock(slices_[worker].mutex);
+      slices_[worker].begin = count * worker / workers;
+      slices_[worker].end = count * (worker + 1) / workers;
+    }
+    {
+      std::lock_guard<std::mutex> lock(mutex_);
+      task_ = &task;
+      busy_ = workers - 1;
+      ++batch_;
+    }
+    start_.notify_all();
+
+    work_(0, task);
+
+    std::unique_lock<std::mutex> lock(mutex_);
+    done_.wait(lock, [this]() { return busy_ == 0; });
+    task_ = nullptr;
+  }
+
+ private:
+  struct Slice {
+    std::mutex mutex;
+    size_t begin = 0;
+    size_t end = 0;
+  };
+
+  void loop_(size_t worker) {
+    uint64_t seen = 0;
+    while (true) {
+      const Task *task;
+      {
+        std::unique_lock<std::mutex> lock(mutex_);
+        start_.wait(lock, [&]() { return stop_ || batch_ != seen; });
+        if (stop_) {
+          return;
+        }
+        seen = batch_;
+        task = task_;
+      }
+
+      work_(worker, *task);
+
+      {
+        std::lock_guard<std::mutex> lock(mutex_);
+        --busy_;
+      }
+      done_.notify_one();
+    }
+  }
+
+  void work_(size_t worker, const Task &task) {
+    size_t index;
+    while (next_(worker, index) || steal_(worker, index)) {
+      task(index, worker);
+    }
+  }
+
+  bool next_(size_t worker, size_t &index) {
+    auto &slice = slices_[worker];
+    std::lock_guard<std::mutex> lock(slice.mutex);
+    if (slice.begin == slice.end) {
+      return false;
+    }
+    index = slice.begin++;
+    return true;
+  }
+
+  // Moves the back half of the fullest other slice into this worker's slice and takes its first index.
+  bool steal_(size_t worker, size_t &index) {
+    while (true) {
+      size_t victim = worker;
+      size_t most = 0;
+      for (size_t other = 0; other < slices_.size(); ++other) {
+        if (other == worker) {
+          continue;
+        }
+        std::lock_guard<std::mutex> lock(slices_[other].mutex);
+        const size_t left = slices_[other].end - slices_[other].begin;
+        if (left > most) {
+          most = left;
+          victim = other;
+        }
+      }
+      if (victim == worker) {
+        return false;
+      }
+
+      size_t begin;
+      size_t end;
+      {
+        std::lock_guard<std::mutex> lock(slices_[victim].mutex);
+        const size_t left = slices_[victim].end - slices_[victim].begin;
+        if (left == 0) {
+          continue;  // drained since it was picked, look again
+        }
+        end = slices_[victim].end;
+        begin = end - (left + 1) / 2;
+        slices_[victim].end = begin;
+      }
+      std::lock_guard<std::mutex> lock(slices_[worker].mutex);
+      slices_[worker].begin = begin + 1;
+      slices_[worker].end = end;
+      index = begin;
+      return true;
+    }
+  }
+
+ private:
+  std::vector<Slice> slices_;
+  std::vector<std::thread> threads_;
+
+  std::mutex mutex_;
+  std::condition_variable start_;
+  std::condition_variable done_;
+  const Task *task_ = nullptr;
+  uint64_t batch_ = 0;
+  size_t busy_ = 0;
+  bool stop_ = false;
+};
+
+#endif  // PLOTOP_WORKER_POOL_H
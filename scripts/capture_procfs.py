@@ -0,0 +1,191 @@
+#!/usr/bin/env python3
+"""Record the parts of procfs the client reads into a directory, for `plotop -P` and `make bench`.
+
+Snapshot the running system:
+
+    scripts/capture_procfs.py build/procfs
+
+or generate a deterministic tree of a given size:
+
+    scripts/capture_procfs.py --synthetic --processes 10000 --threads 100000 build/procfs
+"""
+
+import argparse
+import os
+import random
+import shutil
+import sys
+
+# Read once per sample.
+SYSTEM_FILES = [
+    "stat",
+    "meminfo",
+    "loadavg",
+    "vmstat",
+    "pressure/cpu",
+    "pressure/memory",
+    "pressure/io",
+]
+# Read per process, all but stat only with the matching -m metric.
+PROCESS_FILES = ["stat", "statm", "status", "io", "smaps_rollup"]
+THREAD_FILES = ["stat"]
+
+
+def _write(path: str, content: bytes) -> None:
+    os.makedirs(os.path.dirname(path), exist_ok=True)
+    with open(path, "wb") as f:
+        f.write(content)
+
+
+def _read(path: str):
+    try:
+        with open(path, "rb") as f:
+            return f.read()
+    except OSError:
+        # Gone since the listing, or not readable without privileges.
+        return None
+
+
+def capture(source: str, out: str) -> int:
+    for name in SYSTEM_FILES:
+        content = _read(os.path.join(source, name))
+        if content is not None:
+            _write(os.path.join(out, name), content)
+
+    processes = 0
+    for pid in sorted((e for e in os.listdir(source) if e.isdigit()), key=int):
+        stat = _read(os.path.join(source, pid, "stat"))
+        if stat is None:
+            continue
+        processes += 1
+        for name in PROCESS_FILES:
+            content = stat if name == "stat" else _read(os.path.join(source, pid, name))
+            if content is not None:
+                _write(os.path.join(out, pid, name), content)
+        try:
+            tids = os.listdir(os.path.join(source, pid, "task"))
+        except OSError:
+            continue
+        for tid in tids:
+            for name in THREAD_FILES:
+                content = _read(os.path.join(source, pid, "task", tid, name))
+                if content is not None:
+                    _write(os.path.join(out, pid, "task", tid, name), content)
+    return processes
+
+
+def _stat_line(pid: int, comm: str, ppid: int, rng: random.Random, threads: int) -> bytes:
+    # 52 fields as in proc_pid_stat(5); the ones the client reads vary, the rest are plausible constants.
+    fields = [
+        "S", ppid, pid, pid, 0, -1, 4194560,
+        rng.randrange(1 << 20), 0, rng.randrange(1 << 10), 0,  # minflt cminflt majflt cmajflt
+        rng.randrange(1 << 24), rng.randrange(1 << 22), 0, 0,  # utime stime cutime cstime
+        20, 0, threads, 0, rng.randrange(1 << 30),  # priority nice num_threads itrealvalue starttime
+        rng.randrange(1 << 34), rng.randrange(1 << 18), 18446744073709551615,
+        1, 1, 0, 0, 0, 0, 0, 4096, 0, 0, 0, 0, 17, rng.randrange(64), 0, 0, 0, 0, 0,
+        0, 0, 0, 0, 0, 0, 0, 0,
+    ]
+    return f"{pid} ({comm}) {' '.join(str(f) for f in fields)}\n".encode()
+
+
+def _synthetic_system(out: str, cpus: int, rng: random.Random) -> None:
+    lines = []
+    for cpu in ["cpu"] + [f"cpu{i}" for i in range(cpus)]:
+        scale = cpus if cpu == "cpu" else 1
+        values = [rng.randrange(1 << 24) * scale for _ in range(10)]
+        values[8:] = [0, 0]
+        lines.append(f"{cpu} {' '.join(str(v) for v in values)}")
+    lines += ["intr 0", "ctxt 123456789", "btime 1700000000", "processes 1234567"]
+    _write(os.path.join(out, "stat"), ("\n".join(lines) + "\n").encode())
+
+    meminfo = [
+        ("MemTotal", 16 << 20), ("MemFree", 4 << 20), ("MemAvailable", 10 << 20), ("Buffers", 1 << 18),
+        ("Cached", 5 << 20), ("SwapCached", 0), ("SwapTotal", 2 << 20), ("SwapFree", 2 << 20),
+        ("Shmem", 1 << 18), ("SReclaimable", 1 << 19),
+    ]
+    _write(os.path.join(out, "meminfo"), "".join(f"{k + ':':<16}{v:>8} kB\n" for k, v in meminfo).encode())
+    _write(os.path.join(out, "loadavg"), b"1.25 0.98 0.75 3/1234 56789\n")
+    vmstat = ["pgpgin", "pgpgout", "pswpin", "pswpout", "pgfault", "pgmajfault", "pgscan_kswapd",
+              "pgscan_direct", "pgsteal_kswapd", "pgsteal_direct", "oom_kill"]
+    # The real file has about 170 lines, most of which the collector skips.
+    vmstat += [f"nr_unused_{i}" for i in range(160)]
+    _write(os.path.join(out, "vmstat"), "".join(f"{k} {rng.randrange(1 << 32)}\n" for k in vmstat).encode())
+    for resource in ["cpu", "memory", "io"]:
+        _write(os.path.join(out, "pressure", resource),
+               b"some avg10=0.12 avg60=0.34 avg300=0.56 total=1234567\n"
+               b"full avg10=0.00 avg60=0.01 avg300=0.02 total=23456\n")
+
+
+def synthesize(out: str, processes: int, threads: int, cpus: int, seed: int) -> int:
+    rng = random.Random(seed)
+    _synthetic_system(out, cpus, rng)
+
+    # Every process has its main thread; the others go mostly to a few large processes, as on a device
+    # where a browser or a VM owns most of them.
+    extra = [0] * processes
+    order = list(range(processes))
+    rng.shuffle(order)
+    for _ in range(max(threads - processes, 0)):
+        rank = min(int(rng.paretovariate(1.2)) - 1, processes - 1) if rng.random() < 0.7 else rng.randrange(processes)
+        extra[order[rank]] += 1
+    next_tid = processes + 1
+    # Some names that trip up naive parsers of the comm field.
+    names = ["init", "kworker/0:1", "Web Content", "(sd-pam)", "app_process64", "surfaceflinger"]
+    for index in range(processes):
+        pid = index + 1
+        comm = names[index % len(names)] if index < 64 else f"proc{pid}"
+        count = 1 + extra[index]
+        base = os.path.join(out, str(pid))
+        _write(os.path.join(base, "stat"), _stat_line(pid, comm, max(pid // 2, 1) if pid > 1 else 0, rng, count))
+        size = rng.randrange(1 << 14, 1 << 20)
+        _write(os.path.join(base, "statm"), f"{size} {size // 4} {size // 16} 1 0 {size // 2} 0\n".encode())
+        _write(os.path.join(base, "status"),
+               f"Name:\t{comm[:15]}\nState:\tS (sleeping)\nTgid:\t{pid}\nPid:\t{pid}\nPPid:\t1\n"
+               f"Threads:\t{count}\nvoluntary_ctxt_switches:\t{rng.randrange(1 << 20)}\n"
+               f"nonvoluntary_ctxt_switches:\t{rng.randrange(1 << 16)}\n".encode())
+        _write(os.path.join(base, "io"),
+               f"rchar: {rng.randrange(1 << 32)}\nwchar: {rng.randrange(1 << 32)}\nsyscr: 0\nsyscw: 0\n"
+               f"read_bytes: {rng.randrange(1 << 30)}\nwrite_bytes: {rng.randrange(1 << 30)}\n"
+               f"cancelled_write_bytes: 0\n".encode())
+        _write(os.path.join(base, "smaps_rollup"),
+               f"00400000-7fffffff000 ---p 00000000 00:00 0  [rollup]\nRss:  {size} kB\n"
+               f"Pss:  {size // 2} kB\nSwap:  {size // 8} kB\n".encode())
+        tids = [pid] + list(range(next_tid, next_tid + extra[index]))
+        next_tid += extra[index]
+        for tid in tids:
+            _write(os.path.join(base, "task", str(tid), "stat"), _stat_line(tid, comm[:15], 1, rng, count))
+    return processes
+
+
+def main() -> int:
+    parser = argparse.ArgumentParser(description=__doc__, formatter_class=argparse.RawDescriptionHelpFormatter)
+    parser.add_argument("out", help="directory to write, must not exist")
+    parser.add_argument("--source", default="/proc", help="procfs to snapshot (default: /proc)")
+    parser.add_argument("--synthetic", action="store_true", help="generate a tree instead of snapshotting")
+    parser.add_argument("--processes", type=int, default=1000, help="synthetic processes (default: 1000)")
+    parser.add_argument("--threads", type=int, default=10000,
+                        help="synthetic threads in all, main threads included (default: 10000)")
+    parser.add_argument("--cpus", type=int, default=8, help="synthetic CPUs (default: 8)")
+    parser.add_argument("--seed", type=int, default=1, help="synthetic random seed (default: 1)")
+    args = parser.parse_args()
+
+    if os.path.exists(args.out):
+        print(f"{args.out} already exists", file=sys.stderr)
+        return 1
+    # Written next to the target and renamed, so an interrupted run leaves no partial tree behind.
+    partial = args.out.rstrip("/") + ".partial"
+    shutil.rmtree(partial, ignore_errors=True)
+    if args.synthetic:
+        if args.processes < 1:
+            print("--processes must be at least 1", file=sys.stderr)
+            return 1
+        processes = synthesize(partial, args.processes, args.threads, args.cpus, args.seed)
+    else:
+        processes = capture(args.source, partial)
+    os.rename(partial, args.out)
+    print(f"Recorded {processes} processes into {args.out}")
+    return 0
+
+
+if __name__ == "__main__":
+    sys.exit(main())
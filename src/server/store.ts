@@ -10,10 +10,63 @@ export interface ClientState {
   socket: any;
   hasProcessList: boolean;
   lastProcessList: any;
+  // Last complete sample, which partial samples are merged into.
+  lastStats: any;
+  // Last self_stats report of the collector.
+  lastSelfStats: any;
+  // Last window summary of the collector, when it samples with --window.
+  lastSummary: any;
+  session: string;
+  received: SequenceRanges;
 }
 
 export const clients = new Map<string, ClientState>();
 
+const MAX_SEQUENCE_RANGES = 256;
+
+// Sample sequence numbers received from one collector session, kept as sorted inclusive ranges.
+export class SequenceRanges {
+  private ranges: [number, number][] = [];
+
+  add(seq: number) {
+    let i = this.ranges.length;
+    while (i > 0 && this.ranges[i - 1][0] > seq) i--;
+    const before = i > 0 ? this.ranges[i - 1] : null;
+    const after = i < this.ranges.length ? this.ranges[i] : null;
+    if (before && seq <= before[1]) return;
+    if (before && seq === before[1] + 1) {
+      before[1] = seq;
+      if (after && after[0] === seq + 1) {
+        before[1] = after[1];
+        this.ranges.splice(i, 1);
+      }
+    } else if (after && after[0] === seq + 1) {
+      after[0] = seq;
+    } else {
+      this.ranges.splice(i, 0, [seq, seq]);
+      if (this.ranges.length > MAX_SEQUENCE_RANGES) {
+        // Forget the oldest gap rather than grow without bound.
+        this.ranges[1][0] = this.ranges[0][0];
+        this.ranges.shift();
+      }
+    }
+  }
+
+  // Ranges within [first, last] not received yet, flattened to [first, last, first, last, ...].
+  missing(first: number, last: number): number[] {
+    const result: number[] = [];
+    let next = first;
+    for (const [from, to] of this.ranges) {
+      if (to < next) continue;
+      if (from > last) break;
+      if (from > next) result.push(next, from - 1);
+      next = to + 1;
+    }
+    if (next <= last) result.push(next, last);
+    return result;
+  }
+}
+
 let clientIdCounter = 0;
 
 export class AsyncMessageQueue {
@@ -63,6 +116,11 @@ export function getOrCreateClient(ip: string): ClientState {
       socket: null,
       hasProcessList: false,
       lastProcessList: {},
+      lastStats: null,
+      lastSelfStats: null,
+      lastSummary: null,
+      session: '',
+      received: new SequenceRanges(),
     };
     clients.set(ip, client);
   }
@@ -2,7 +2,16 @@ import * as net from 'net';
 import * as fs from 'fs';
 import * as path from 'path';
 import { Server as SocketIoServer } from 'socket.io';
-import { clients, getOrCreateClient, ClientState, AsyncMessageQueue } from './store';
+import { clients, getOrCreateClient, ClientState, AsyncMessageQueue, SequenceRanges } from './store';
+import {
+  LzDecompressor,
+  readFrame,
+  SUPPORTED_COMPRESSION,
+  SUPPORTED_PROTOCOLS,
+  WIRE_MAGIC,
+  WireDecoder,
+  WireKind,
+} from './wire';
 
 function isIgnorableSocketError(err: any): boolean {
   return err && (err.code === 'EPIPE' || err.code === 'ECONNRESET');
@@ -165,6 +174,8 @@ async function clientReader(
 ) {
   let buffer = Buffer.alloc(0);
   let dataIndex = 0;
+  const wire = new WireDecoder();
+  const lz = new LzDecompressor();
 
   try {
     while (true) {
@@ -175,19 +186,44 @@ async function clientReader(
       }
       buffer = Buffer.concat([buffer, chunk]);
 
-      let newlineIndex: number;
-      while ((newlineIndex = buffer.indexOf('\n')) !== -1) {
-        const line = buffer.slice(0, newlineIndex);
-        buffer = buffer.slice(newlineIndex + 1);
-        dataIndex += 1;
-        if (line.length === 0) continue;
-
+      while (buffer.length > 0) {
         let data: any;
-        try {
-          data = JSON.parse(line.toString('utf-8'));
-        } catch (e) {
-          console.warn(`Invalid JSON from ${ip}: ${line.toString()}`);
-          continue;
+        if (buffer[0] === WIRE_MAGIC) {
+          const frame = readFrame(buffer);
+          if (!frame) break;
+          buffer = buffer.slice(frame.size);
+          if (frame.kind === WireKind.Compressed) {
+            // A compressed block holds whole frames and lines; parse them before the rest of the stream. A bad
+            // block leaves the window out of step with the collector, so it ends the connection instead.
+            buffer = Buffer.concat([lz.decompress(frame.payload), buffer]);
+            continue;
+          }
+          try {
+            data = wire.decode(frame);
+          } catch (e) {
+            // Schemas, keyframes and deltas chain on each other, so after a bad one every later sample would be
+            // decoded against stale state; end the connection and let the collector resume with a fresh schema
+            // and keyframe. A replayed sample stands alone and can be skipped.
+            if (frame.kind !== WireKind.StatsReplay) throw e;
+            console.warn(`Invalid replayed frame from ${ip}:`, e);
+            continue;
+          }
+          if (!data) continue;
+          dataIndex += 1;
+        } else {
+          const newlineIndex = buffer.indexOf('\n');
+          if (newlineIndex === -1) break;
+          const line = buffer.slice(0, newlineIndex);
+          buffer = buffer.slice(newlineIndex + 1);
+          dataIndex += 1;
+          if (line.length === 0) continue;
+
+          try {
+            data = JSON.parse(line.toString('utf-8'));
+          } catch (e) {
+            console.warn(`Invalid JSON from ${ip}: ${line.toString()}`);
+            continue;
+          }
         }
 
         if (!data.type) {
@@ -206,11 +242,46 @@ async function clientReader(
           case 'heartbeat':
             // no-op
             break;
+          case 'hello': {
+            const protocol = SUPPORTED_PROTOCOLS.includes(data.protocol) ? data.protocol : 'json';
+            const compression = SUPPORTED_COMPRESSION.includes(data.compression) ? data.compression : 'none';
+            console.log(`Client ${ip} requested ${data.protocol} samples, using ${protocol} and ${compression}`);
+            outbound.put(JSON.stringify({ type: 'hello_ack', protocol, compression }) + '\n');
+            break;
+          }
+          case 'resume': {
+            if (client.session !== data.session) {
+              client.session = data.session;
+              client.received = new SequenceRanges();
+            }
+            const missing = client.received.missing(data.first_seq, data.last_seq);
+            console.log(`Client ${ip} resumed session ${data.session}, missing ranges: ${missing}`);
+            outbound.put(JSON.stringify({ type: 'resume_ack', missing }) + '\n');
+            break;
+          }
           case 'process_list':
             client.hasProcessList = true;
             client.lastProcessList = data;
             io.emit(`process_list/${ip}`, data);
             break;
+          case 'process_added':
+          case 'process_removed':
+            if (!client.hasProcessList) break;
+            applyProcessDelta(client, data);
+            io.emit(`process_list/${ip}`, client.lastProcessList);
+            break;
+          case 'self_stats':
+            // The collector's own footprint: kept in the log next to the samples and shown live.
+            client.lastSelfStats = data;
+            writeDataToFile(filename, JSON.stringify(data) + '\n');
+            io.emit(`self_stats/${ip}`, data);
+            break;
+          case 'summary':
+            // Min/avg/max over the collector's reporting window, closed by the sample with the same seq.
+            client.lastSummary = data;
+            writeDataToFile(filename, JSON.stringify(data) + '\n');
+            io.emit(`summary/${ip}`, data);
+            break;
           case 'filter_ack':
             io.emit(`filter_status/${ip}`, {
               matched_count: data.matched_count || 0,
@@ -265,6 +336,44 @@ function readChunk(socket: net.Socket): Promise<Buffer> {
   });
 }
 
+function applyProcessDelta(client: ClientState, data: any) {
+  const byPid = new Map<number, any>();
+  for (const process of client.lastProcessList.processes || []) {
+    byPid.set(process.pid, process);
+  }
+  if (data.type === 'process_removed') {
+    for (const pid of data.pids || []) {
+      byPid.delete(pid);
+    }
+  } else {
+    for (const process of data.processes || []) {
+      byPid.set(process.pid, process);
+    }
+  }
+  const processes = Array.from(byPid.values()).sort((a, b) => a.pid - b.pid);
+  client.lastProcessList = { type: 'process_list', timestamp: data.timestamp, processes };
+}
+
+// A collector sampling groups at different rates sends partial samples that only carry the groups that
+// were due (see "groups"). Merging them into the last sample keeps the log and the charts complete.
+// Processes sampled without their threads keep the previous ones; exited processes are never carried over.
+function mergeStats(client: ClientState, data: any): any {
+  const last = client.lastStats;
+  const merged = last ? { ...last, ...data } : { ...data };
+  merged.exited = data.exited || [];
+  if (last && data.processes) {
+    const threads = new Map<number, any[]>();
+    for (const process of last.processes || []) {
+      threads.set(process.pid, process.threads);
+    }
+    merged.processes = data.processes.map((process: any) =>
+      process.threads ? process : { ...process, threads: threads.get(process.pid) || [] }
+    );
+  }
+  client.lastStats = merged;
+  return merged;
+}
+
 function handleStatsMessage(
   ip: string,
   data: any,
@@ -272,10 +381,19 @@ function handleStatsMessage(
   dataIndex: number,
   io: SocketIoServer
 ) {
-  const jsonStr = JSON.stringify(data) + '\n';
   const client = clients.get(ip);
   if (!client) return;
 
+  if (client.session && typeof data.seq === 'number') {
+    client.received.add(data.seq);
+  }
+  if (data.replay) {
+    // Backfill from the collector's spool: keep it in the log, but it is too old for the live charts.
+    writeDataToFile(filename, JSON.stringify(data) + '\n');
+    return;
+  }
+  const jsonStr = JSON.stringify(mergeStats(client, data)) + '\n';
+
   client.data.push(jsonStr);
   if (client.data.length > 1000) {
     client.data = client.data.slice(-1000);
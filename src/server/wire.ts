@@ -0,0 +1,279 @@
+// Decoder for the collector's binary sample frames (see client/wire.h).
+// Frame: 0xB1 | kind (1 byte) | payload length (uint32 LE) | payload.
+
+export const WIRE_MAGIC = 0xb1;
+export const WIRE_HEADER_SIZE = 6;
+export const SUPPORTED_PROTOCOLS = ['json', 'binary', 'delta'];
+export const SUPPORTED_COMPRESSION = ['none', 'lz'];
+
+export enum WireKind {
+  Schema = 1,
+  Stats = 2,
+  StatsDelta = 3,
+  StatsReplay = 4,
+  Compressed = 5,
+  ReplaySchema = 6,
+}
+
+export interface WireFrame {
+  kind: number;
+  payload: Buffer;
+  size: number;
+}
+
+// Name, type and, for fields of a sample group, the group (see "groups" in the schema).
+type FieldSpec = [string, string, string?];
+
+interface WireSchema {
+  version: number;
+  [record: string]: any;
+}
+
+// Returns the frame at the start of buffer, or null while it is still incomplete.
+export function readFrame(buffer: Buffer): WireFrame | null {
+  if (buffer.length < WIRE_HEADER_SIZE) return null;
+  const length = buffer.readUInt32LE(2);
+  const size = WIRE_HEADER_SIZE + length;
+  if (buffer.length < size) return null;
+  return { kind: buffer[1], payload: buffer.subarray(WIRE_HEADER_SIZE, size), size };
+}
+
+class Cursor {
+  private offset = 0;
+
+  constructor(private readonly buffer: Buffer) {}
+
+  unsigned(): number {
+    let result = 0;
+    let multiplier = 1;
+    while (true) {
+      if (this.offset >= this.buffer.length) throw new Error('Truncated varint');
+      const byte = this.buffer[this.offset++];
+      result += (byte & 0x7f) * multiplier;
+      if ((byte & 0x80) === 0) return result;
+      multiplier *= 128;
+    }
+  }
+
+  signed(): number {
+    const value = this.unsigned();
+    return value % 2 === 0 ? value / 2 : -(value + 1) / 2;
+  }
+
+  bytes(length: number): Buffer {
+    if (this.offset + length > this.buffer.length) throw new Error('Truncated bytes');
+    const value = this.buffer.subarray(this.offset, this.offset + length);
+    this.offset += length;
+    return value;
+  }
+
+  string(): string {
+    const length = this.unsigned();
+    if (this.offset + length > this.buffer.length) throw new Error('Truncated string');
+    const value = this.buffer.toString('utf-8', this.offset, this.offset + length);
+    this.offset += length;
+    return value;
+  }
+}
+
+// Inverse of the collector's LzCompressor (client/compress.h). Matches may reach back into earlier blocks,
+// so one decompressor must see every block of a connection, in order.
+export class LzDecompressor {
+  static readonly WINDOW = 64 * 1024;
+  private window = Buffer.alloc(0);
+
+  // Returns the raw bytes of one compressed block: whole frames and JSON lines, never a partial one.
+  decompress(payload: Buffer): Buffer {
+    const cursor = new Cursor(payload);
+    const size = cursor.unsigned();
+    const base = this.window.length;
+    const out = Buffer.alloc(base + size);
+    this.window.copy(out);
+    let position = base;
+    while (position < out.length) {
+      const literals = cursor.bytes(cursor.unsigned());
+      if (position + literals.length > out.length) throw new Error('Compressed block overruns its size');
+      literals.copy(out, position);
+      position += literals.length;
+      const length = cursor.unsigned();
+      if (length === 0) break;
+      const distance = cursor.unsigned();
+      if (distance === 0 || distance > position || position + length > out.length) {
+        throw new Error('Invalid compressed match');
+      }
+      // Byte by byte: a match may overlap the bytes it produces.
+      for (let i = 0; i < length; i++, position++) {
+        out[position] = out[position - distance];
+      }
+    }
+    if (position !== out.length) throw new Error('Truncated compressed block');
+    this.window = out.subarray(Math.max(0, out.length - LzDecompressor.WINDOW));
+    return out.subarray(base);
+  }
+}
+
+export class WireDecoder {
+  private schema: WireSchema | null = null;
+  // Schema the collector spooled the replayed frames with, which may predate the live one.
+  private replaySchema: WireSchema | null = null;
+  private previous: any | null = null;
+  // Sample groups present in the frame being decoded, from its "groups" field.
+  private groups = ~0;
+
+  hasSchema(): boolean {
+    return this.schema !== null;
+  }
+
+  // Decodes one frame. Schema frames return null; sample frames, full or delta, return the same object
+  // the collector would have sent as JSON.
+  decode(frame: WireFrame): any | null {
+    if (frame.kind === WireKind.Schema) {
+      this.schema = JSON.parse(frame.payload.toString('utf-8'));
+      return null;
+    }
+    if (frame.kind === WireKind.ReplaySchema) {
+      this.replaySchema = JSON.parse(frame.payload.toString('utf-8'));
+      return null;
+    }
+    if (frame.kind === WireKind.StatsReplay) {
+      return this.decodeReplay(frame);
+    }
+    if (!this.schema) {
+      throw new Error('Binary sample received before schema');
+    }
+    this.groups = ~0;
+    if (frame.kind === WireKind.Stats) {
+      this.previous = this.readRecord(new Cursor(frame.payload), 'stats');
+      return { type: 'stats', ...this.previous };
+    }
+    if (frame.kind === WireKind.StatsDelta) {
+      if (!this.previous) throw new Error('Delta sample received before keyframe');
+      this.previous = this.readDelta(new Cursor(frame.payload), 'stats', this.previous, 0, {});
+      // The delta chain keeps the groups this frame left out; the sample itself only has the ones it carries.
+      const sample: any = { type: 'stats' };
+      for (const spec of this.schema!.stats as FieldSpec[]) {
+        if (this.present(spec) && spec[0] in this.previous) sample[spec[0]] = this.previous[spec[0]];
+      }
+      return sample;
+    }
+    throw new Error(`Unknown binary frame kind ${frame.kind}`);
+  }
+
+  // Resent from the collector's spool; older than the live stream, so it must not touch the delta chain, and
+  // encoded against the replay schema.
+  private decodeReplay(frame: WireFrame): any {
+    if (!this.replaySchema) throw new Error('Replayed sample received before its schema');
+    const live = this.schema;
+    this.schema = this.replaySchema;
+    try {
+      this.groups = ~0;
+      return { type: 'stats', replay: true, ...this.readRecord(new Cursor(frame.payload), 'stats') };
+    } finally {
+      this.schema = live;
+    }
+  }
+
+  private readRecord(cursor: Cursor, name: string): any {
+    const fields: FieldSpec[] = this.schema![name];
+    if (!fields) throw new Error(`Unknown record ${name}`);
+    const record: any = {};
+    for (const spec of fields) {
+      if (!this.present(spec)) continue;
+      const [field, type] = spec;
+      record[field] = this.readValue(cursor, type);
+      if (name === 'stats' && field === 'groups') this.groups = record[field];
+    }
+    return record;
+  }
+
+  private present(spec: FieldSpec): boolean {
+    return spec[2] === undefined || (this.groups & this.schema!.groups[spec[2]]) !== 0;
+  }
+
+  // Reads fields of record name from index first on, counters relative to previous.
+  private readDelta(cursor: Cursor, name: string, previous: any, first: number, record: any): any {
+    const fields: FieldSpec[] = this.schema![name];
+    if (!fields) throw new Error(`Unknown record ${name}`);
+    for (let i = first; i < fields.length; i++) {
+      const [field, type] = fields[i];
+      if (!this.present(fields[i])) {
+        if (field in previous) record[field] = previous[field];
+        continue;
+      }
+      record[field] = this.readDeltaValue(cursor, type, previous[field]);
+      if (name === 'stats' && field === 'groups') this.groups = record[field];
+    }
+    return record;
+  }
+
+  private readDeltaValue(cursor: Cursor, type: string, previous: any): any {
+    if (type === 'c') {
+      return (previous || 0) + cursor.signed();
+    }
+    if (type === 'c[]') {
+      const count = cursor.unsigned();
+      const values = new Array(count);
+      for (let i = 0; i < count; i++) {
+        values[i] = ((previous && previous[i]) || 0) + cursor.signed();
+      }
+      return values;
+    }
+    if (type.endsWith('[]') && this.schema![type.slice(0, -2)]) {
+      return this.readRecordsDelta(cursor, type.slice(0, -2), previous || []);
+    }
+    if (this.schema![type]) {
+      return this.readDelta(cursor, type, previous || {}, 0, {});
+    }
+    return this.readValue(cursor, type);
+  }
+
+  // Removed keys, then changed records flagged 1 (new, full) or 0 (update against the previous record).
+  private readRecordsDelta(cursor: Cursor, name: string, previous: any[]): any[] {
+    const [keyField, keyType] = this.schema![name][0];
+    const byKey = new Map<number, any>();
+    for (const record of previous) {
+      byKey.set(record[keyField], record);
+    }
+
+    const removed = cursor.unsigned();
+    for (let i = 0; i < removed; i++) {
+      byKey.delete(cursor.signed());
+    }
+
+    const changed = cursor.unsigned();
+    for (let i = 0; i < changed; i++) {
+      if (cursor.unsigned() === 1) {
+        const record = this.readRecord(cursor, name);
+        byKey.set(record[keyField], record);
+      } else {
+        const key = this.readValue(cursor, keyType);
+        const record = this.readDelta(cursor, name, byKey.get(key) || {}, 1, { [keyField]: key });
+        byKey.set(key, record);
+      }
+    }
+    return Array.from(byKey.values());
+  }
+
+  private readValue(cursor: Cursor, type: string): any {
+    if (type.endsWith('[]')) {
+      const element = type.slice(0, -2);
+      const count = cursor.unsigned();
+      const values = new Array(count);
+      for (let i = 0; i < count; i++) {
+        values[i] = this.readValue(cursor, element);
+      }
+      return values;
+    }
+    switch (type) {
+      case 'u':
+      case 'c':
+        return cursor.unsigned();
+      case 'i':
+        return cursor.signed();
+      case 's':
+        return cursor.string();
+      default:
+        return this.readRecord(cursor, type);
+    }
+  }
+}